@@ -0,0 +1,361 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // nftw
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <argp.h>
+
+#include "pak.h"
+#include "mkpak/util.h"
+
+const char* argp_program_version = "Pak Benchmark 0.1";
+
+static struct argp_option options[] = {
+{"entries",         'n', "N",     0, "Number of files in the generated tree (default 10000)", 0},
+{"depth",           'D', "N",     0, "Directory depth of the generated tree (default 3)", 0},
+{"fanout",          'f', "N",     0, "Subdirectories per directory (default 8)", 0},
+{"min-size",        's', "BYTES", 0, "Smallest generated file (default 64)", 0},
+{"max-size",        'S', "BYTES", 0, "Largest generated file, sizes are log-uniform in between (default 1048576)", 0},
+{"compressibility", 'r', "RATIO", 0, "Fraction of each file drawn from a small vocabulary, the rest is random (default 0.5)", 0},
+{"lookups",         'l', "N",     0, "Number of timed pak_find_file calls (default 10000)", 0},
+{"seed",            'x', "N",     0, "Random seed (default 1)", 0},
+{"workdir",         'w', "DIR",   0, "Where the tree and pak are generated (default /tmp/pak_bench)", 0},
+{"compress",        'c', 0,       0, "Build a compressed pak", 0},
+{"solid",           'b', 0,       0, "Pack small files into solid blocks", 0},
+{"keep",            'k', 0,       0, "Don't delete the generated tree and pak", 0},
+{0}
+};
+
+static char doc[] = "Builds a synthetic pak and prints timings as a single JSON object";
+
+typedef struct _bench_config {
+    uint64_t entries;
+    uint32_t depth;
+    uint32_t fanout;
+    uint64_t min_size;
+    uint64_t max_size;
+    double compressibility;
+    uint64_t lookups;
+    uint32_t seed;
+    const char* workdir;
+    bool compress;
+    bool solid;
+    bool keep;
+} bench_config_t;
+
+static error_t parse_opt(int key, char* arg, struct argp_state* state) {
+    bench_config_t* config = state->input;
+    switch (key) {
+        case 'n': config->entries = strtoull(arg, NULL, 0); break;
+        case 'D': config->depth = strtoul(arg, NULL, 0); break;
+        case 'f': config->fanout = strtoul(arg, NULL, 0); break;
+        case 's': config->min_size = strtoull(arg, NULL, 0); break;
+        case 'S': config->max_size = strtoull(arg, NULL, 0); break;
+        case 'r': config->compressibility = strtod(arg, NULL); break;
+        case 'l': config->lookups = strtoull(arg, NULL, 0); break;
+        case 'x': config->seed = strtoul(arg, NULL, 0); break;
+        case 'w': config->workdir = arg; break;
+        case 'c': config->compress = true; break;
+        case 'b': config->solid = true; break;
+        case 'k': config->keep = true; break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp_object = {options, parse_opt, NULL, doc, NULL, NULL, NULL};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t rss_bytes() {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    unsigned long size = 0, resident = 0;
+    if (statm) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t bench_rand(uint64_t* state) {
+    // xorshift64*, rand() is too slow and too short for filling files
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void mkdirs(const char* path) {
+    char tmp[FILENAME_MAX];
+    strcpy(tmp, path);
+    for (char* p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, 0755);
+}
+
+// Writes the tree and returns the pak path of every file
+static char** generate_tree(const bench_config_t* config, const char* root, uint64_t* total_bytes) {
+    static const char* vocabulary[] = {"vertex ", "normal ", "texcoord ", "material ", "0.0 ", "1.0 ", "{\"id\": ", "}, ", "\n"};
+    uint64_t state = config->seed * 0x9E3779B97F4A7C15ULL + 1;
+    char** paths = malloc(config->entries * sizeof(char*));
+    char* data = malloc(config->max_size);
+    *total_bytes = 0;
+
+    for (uint64_t i = 0; i < config->entries; i++) {
+        char dir[FILENAME_MAX] = {0};
+        uint64_t pick = bench_rand(&state);
+        uint32_t depth = config->depth ? pick % (config->depth + 1) : 0;
+        for (uint32_t d = 0; d < depth; d++)
+            sprintf(dir + strlen(dir), "/d%" PRIu64, (bench_rand(&state) % config->fanout));
+
+        char path[FILENAME_MAX];
+        sprintf(path, "%s/f%" PRIu64 ".bin", dir, i);
+        paths[i] = strdup(path);
+
+        char full[FILENAME_MAX];
+        sprintf(full, "%s%s", root, dir);
+        mkdirs(full);
+        strcat(full, path + strlen(dir));
+
+        double lo = log((double)config->min_size), hi = log((double)config->max_size);
+        double u = (bench_rand(&state) >> 11) * (1.0 / 9007199254740992.0);
+        uint64_t size = (uint64_t)exp(lo + (hi - lo) * u);
+        uint64_t pos = 0;
+        while (pos < size) {
+            double v = (bench_rand(&state) >> 11) * (1.0 / 9007199254740992.0);
+            if (v < config->compressibility) {
+                const char* word = vocabulary[bench_rand(&state) % (sizeof(vocabulary) / sizeof(vocabulary[0]))];
+                size_t len = strlen(word);
+                if (len > size - pos)
+                    len = size - pos;
+                memcpy(data + pos, word, len);
+                pos += len;
+            } else {
+                uint64_t r = bench_rand(&state);
+                size_t len = size - pos < 8 ? size - pos : 8;
+                memcpy(data + pos, &r, len);
+                pos += len;
+            }
+        }
+
+        FILE* out = fopen(full, "wb");
+        if (out) {
+            fwrite(data, 1, size, out);
+            fclose(out);
+        }
+        *total_bytes += size;
+    }
+
+    free(data);
+    return paths;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double da = *(const double*)a, db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double* sorted, uint64_t count, double p) {
+    if (!count)
+        return 0.0;
+    uint64_t idx = (uint64_t)(p * (count - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void shuffle(pak_node_t** nodes, uint64_t count, uint64_t* state) {
+    for (uint64_t i = count; i > 1; i--) {
+        uint64_t j = bench_rand(state) % i;
+        pak_node_t* tmp = nodes[i - 1];
+        nodes[i - 1] = nodes[j];
+        nodes[j] = tmp;
+    }
+}
+
+static int compare_node_offset(const void* a, const void* b) {
+    const pak_node_t* na = *(pak_node_t* const*)a;
+    const pak_node_t* nb = *(pak_node_t* const*)b;
+    int64_t oa = na->entry->data_offset_or_first_child, ob = nb->entry->data_offset_or_first_child;
+    if ((na->entry->flags ^ nb->entry->flags) & PAK_ENTRY_FLAGS_SOLID)
+        return (na->entry->flags & PAK_ENTRY_FLAGS_SOLID) ? -1 : 1;
+    return (oa > ob) - (oa < ob);
+}
+
+// Reads every node once, returns the number of decoded bytes
+static uint64_t read_nodes(pak_handle_t* pak, pak_node_t** nodes, uint64_t count, char* buf, uint64_t buf_size) {
+    uint64_t bytes = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        int64_t ret = pak_read_entry(pak, nodes[i], buf, buf_size);
+        if (ret > 0)
+            bytes += ret;
+    }
+    return bytes;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Children first and without following symlinks, like rm -rf. A tree that isn't there is fine.
+static void remove_tree(const char* path) {
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) && errno != ENOENT)
+        fprintf(stderr, "Unable to remove %s\n", path);
+}
+
+int main(int argc, char* argv[]) {
+    bench_config_t config = {10000, 3, 8, 64, 1024 * 1024, 0.5, 10000, 1, "/tmp/pak_bench", false, false, false};
+    argp_parse(&argp_object, argc, argv, 0, 0, &config);
+    if (!config.entries || !config.fanout || config.min_size > config.max_size || !config.min_size)
+        return EXIT_FAILURE;
+
+    char tree[FILENAME_MAX], pak_path[FILENAME_MAX];
+    snprintf(tree, sizeof(tree), "%s/tree", config.workdir);
+    snprintf(pak_path, sizeof(pak_path), "%s/bench.pak", config.workdir);
+    remove_tree(tree);
+    remove(pak_path);
+    mkdirs(tree);
+
+    uint64_t total_bytes;
+    double start = now();
+    char** paths = generate_tree(&config, tree, &total_bytes);
+    double generate_time = now() - start;
+
+    // make_pak reports progress on stdout and exits on failure, keep it away from our output
+    start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stdout))
+            _exit(EXIT_FAILURE);
+        make_pak_options_t options;
+        memset(&options, 0, sizeof(make_pak_options_t));
+        options.compress = config.compress;
+        options.solid_block_size = config.solid ? SOLID_BLOCK_SIZE_DEFAULT : 0;
+        options.solid_threshold = SOLID_THRESHOLD_DEFAULT;
+        make_pak(tree, pak_path, &options);
+        _exit(EXIT_SUCCESS);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    double build_time = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "Building %s failed\n", pak_path);
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    stat(pak_path, &st);
+
+    uint64_t rss_before = rss_bytes();
+    start = now();
+    pak_handle_t* pak = pak_open_read(pak_path);
+    double open_time = now() - start;
+    uint64_t open_rss = rss_bytes() - rss_before;
+    if (!pak) {
+        fprintf(stderr, "Unable to open %s\n", pak_path);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t state = config.seed + 7;
+    double* lookup_times = malloc(config.lookups * sizeof(double));
+    pak_node_t** nodes = malloc(config.entries * sizeof(pak_node_t*));
+    uint64_t lookup_misses = 0;
+    for (uint64_t i = 0; i < config.lookups; i++) {
+        const char* path = paths[bench_rand(&state) % config.entries];
+        start = now();
+        pak_node_t* node = pak_find_file(pak, path);
+        lookup_times[i] = (now() - start) * 1e9;
+        if (!node)
+            lookup_misses++;
+    }
+    qsort(lookup_times, config.lookups, sizeof(double), compare_double);
+
+    uint64_t node_count = 0;
+    uint64_t buf_size = 0;
+    for (uint64_t i = 0; i < config.entries; i++) {
+        pak_node_t* node = pak_find_file(pak, paths[i]);
+        if (!node)
+            continue;
+        nodes[node_count++] = node;
+        if (pak_get_node_size(node) > buf_size)
+            buf_size = pak_get_node_size(node);
+    }
+    char* buf = malloc(buf_size ? buf_size : 1);
+
+    // sequential is in data section order, random is shuffled, both run with a warm page cache after the build
+    qsort(nodes, node_count, sizeof(pak_node_t*), compare_node_offset);
+    start = now();
+    uint64_t seq_bytes = read_nodes(pak, nodes, node_count, buf, buf_size);
+    double seq_time = now() - start;
+
+    shuffle(nodes, node_count, &state);
+    start = now();
+    uint64_t rand_bytes = read_nodes(pak, nodes, node_count, buf, buf_size);
+    double rand_time = now() - start;
+
+    uint64_t compressed_in = 0, decompressed_out = 0;
+    double decompress_time = 0.0;
+    for (uint64_t i = 0; i < node_count; i++) {
+        if (!(nodes[i]->entry->flags & PAK_ENTRY_FLAGS_COMPRESSED))
+            continue;
+        start = now();
+        int64_t ret = pak_read_entry(pak, nodes[i], buf, buf_size);
+        decompress_time += now() - start;
+        if (ret > 0) {
+            decompressed_out += ret;
+            compressed_in += nodes[i]->entry->data_size_or_child_count;
+        }
+    }
+
+    printf("{\"version\": %u, \"entries\": %" PRIu64 ", \"depth\": %u, \"fanout\": %u, "
+           "\"min_size\": %" PRIu64 ", \"max_size\": %" PRIu64 ", \"compressibility\": %.3f, "
+           "\"compress\": %s, \"solid\": %s, \"seed\": %u, ",
+           PAK_VERSION, config.entries, config.depth, config.fanout, config.min_size, config.max_size,
+           config.compressibility, config.compress ? "true" : "false", config.solid ? "true" : "false", config.seed);
+    printf("\"input_bytes\": %" PRIu64 ", \"pak_bytes\": %" PRIu64 ", \"generate_s\": %.6f, "
+           "\"build_s\": %.6f, \"build_mb_s\": %.3f, ",
+           total_bytes, (uint64_t)st.st_size, generate_time, build_time, total_bytes / build_time / 1e6);
+    printf("\"open_s\": %.6f, \"open_rss_bytes\": %" PRIu64 ", ", open_time, open_rss);
+    printf("\"lookups\": %" PRIu64 ", \"lookup_misses\": %" PRIu64 ", \"lookup_ns\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"max\": %.0f}, ",
+           config.lookups, lookup_misses, percentile(lookup_times, config.lookups, 0.5), percentile(lookup_times, config.lookups, 0.9),
+           percentile(lookup_times, config.lookups, 0.99), percentile(lookup_times, config.lookups, 1.0));
+    printf("\"sequential_read_mb_s\": %.3f, \"random_read_mb_s\": %.3f, ",
+           seq_bytes / seq_time / 1e6, rand_bytes / rand_time / 1e6);
+    printf("\"decompress_in_bytes\": %" PRIu64 ", \"decompress_out_bytes\": %" PRIu64 ", \"decompress_mb_s\": %.3f}\n",
+           compressed_in, decompressed_out, decompress_time > 0.0 ? decompressed_out / decompress_time / 1e6 : 0.0);
+
+    pak_close(pak);
+    free(buf);
+    free(nodes);
+    free(lookup_times);
+    for (uint64_t i = 0; i < config.entries; i++)
+        free(paths[i]);
+    free(paths);
+    if (!config.keep) {
+        remove_tree(tree);
+        remove(pak_path);
+    }
+
+    return EXIT_SUCCESS;
+}
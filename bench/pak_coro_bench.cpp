@@ -0,0 +1,290 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cinttypes>
+#include <ctime>
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <argp.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pak.hpp"
+
+const char* argp_program_version = "Pak Coroutine Benchmark 0.1";
+
+static struct argp_option options[] = {
+{"coroutines", 'n', "N",     0, "Loads in flight at once (default 256)", 0},
+{"threads",    't', "N",     0, "Executor threads running the coroutines and the blocking loads (default 2)", 0},
+{"io-threads", 'i', "N",     0, "Scheduler threads serving the reads (default 8)", 0},
+{"rounds",     'r', "N",     0, "Times every file is loaded (default 3)", 0},
+{"work",       'w', "US",    0, "CPU time spent on each loaded file, like a job would (default 0)", 0},
+{"cold",       'c', 0,       0, "Drop the pak from the page cache before each run", 0},
+{}
+};
+
+static char doc[] = "Loads every file of a pak with blocking reads and with co_await on a few threads, "
+                    "prints timings as a single JSON object";
+
+typedef struct _bench_config {
+    const char* pak_path;
+    uint32_t coroutines;
+    uint32_t threads;
+    uint32_t io_threads;
+    uint32_t rounds;
+    uint32_t work_us;
+    bool cold;
+} bench_config_t;
+
+static error_t parse_opt(int key, char* arg, struct argp_state* state) {
+    bench_config_t* config = static_cast<bench_config_t*>(state->input);
+    switch (key) {
+        case 'n': config->coroutines = strtoul(arg, NULL, 10); break;
+        case 't': config->threads = strtoul(arg, NULL, 10); break;
+        case 'i': config->io_threads = strtoul(arg, NULL, 10); break;
+        case 'r': config->rounds = strtoul(arg, NULL, 10); break;
+        case 'w': config->work_us = strtoul(arg, NULL, 10); break;
+        case 'c': config->cold = true; break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num)
+                argp_usage(state);
+            config->pak_path = arg;
+            break;
+        case ARGP_KEY_END:
+            if (!config->pak_path)
+                argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp_object = {options, parse_opt, "PAK", doc, NULL, NULL, NULL};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Stands in for the job's own work on the loaded data
+static void spin(uint32_t us) {
+    if (!us)
+        return;
+    double end = now() + us * 1e-6;
+    while (now() < end)
+        ;
+}
+
+// Clean pages of the file leave the page cache, shards of a split pak aren't touched
+static void evict(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Test executor: a few threads resuming whatever is posted, in order
+class Pool {
+public:
+    explicit Pool(uint32_t threads) {
+        for (uint32_t i = 0; i < threads; i++)
+            threads_.emplace_back([this] { run(); });
+    }
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            stopping_ = true;
+        }
+        cond_.notify_all();
+        for (std::thread& thread : threads_)
+            thread.join();
+    }
+
+    void post(std::coroutine_handle<> coroutine) {
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            queue_.push_back(coroutine);
+        }
+        cond_.notify_one();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(lock_);
+        for (;;) {
+            cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty())
+                return;
+            std::coroutine_handle<> coroutine = queue_.front();
+            queue_.pop_front();
+            lock.unlock();
+            coroutine.resume();
+            lock.lock();
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::deque<std::coroutine_handle<>> queue_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+    bool stopping_ = false;
+};
+
+// Fire and forget coroutine, started on the pool and counted down in a Latch when it returns
+class Latch {
+public:
+    explicit Latch(uint32_t count) : count_(count) {}
+    void count_down() {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (!--count_)
+            cond_.notify_all();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(lock_);
+        cond_.wait(lock, [this] { return !count_; });
+    }
+
+private:
+    uint32_t count_;
+    std::mutex lock_;
+    std::condition_variable cond_;
+};
+
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::abort(); }
+    };
+};
+
+struct Shared {
+    pak::Archive* archive;
+    const std::vector<uint64_t>* files;
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> failed{0};
+    uint32_t work_us;
+};
+
+// Hops onto the pool so the coroutines start there rather than on the caller
+struct Schedule {
+    Pool* pool;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> coroutine) const { pool->post(coroutine); }
+    void await_resume() const noexcept {}
+};
+
+static Task load(Shared* shared, Pool* pool, Latch* latch) {
+    co_await Schedule{pool};
+    pak::ReadOptions options;
+    options.executor = pak::make_executor(*pool);
+    for (;;) {
+        uint64_t i = shared->next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= shared->files->size())
+            break;
+        pak::Entry entry = shared->archive->entry((*shared->files)[i]);
+        pak::Contents contents = co_await shared->archive->read(entry, options);
+        if (!contents) {
+            shared->failed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        spin(shared->work_us);
+        shared->bytes.fetch_add(contents.size(), std::memory_order_relaxed);
+    }
+    latch->count_down();
+}
+
+// Today's way, each thread blocks in the read
+static void load_blocking(Shared* shared) {
+    std::vector<std::byte> buf;
+    for (;;) {
+        uint64_t i = shared->next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= shared->files->size())
+            break;
+        pak::Entry entry = shared->archive->entry((*shared->files)[i]);
+        buf.resize(entry.size() ? entry.size() : 1);
+        if (entry.read(buf.data(), 0, entry.size()) != static_cast<int64_t>(entry.size())) {
+            shared->failed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        spin(shared->work_us);
+        shared->bytes.fetch_add(entry.size(), std::memory_order_relaxed);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bench_config_t config = {NULL, 256, 2, 8, 3, 0, false};
+    argp_parse(&argp_object, argc, argv, 0, 0, &config);
+    if (!config.coroutines || !config.threads || !config.io_threads || !config.rounds)
+        return EXIT_FAILURE;
+
+    pak::Archive archive(config.pak_path);
+    if (!archive || !archive.start_scheduler(config.io_threads)) {
+        fprintf(stderr, "Unable to open %s\n", config.pak_path);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<uint64_t> files;
+    for (uint32_t round = 0; round < config.rounds; round++) {
+        for (uint64_t i = 0; i < archive.entry_count(); i++) {
+            if (!archive.entry(i).is_dir())
+                files.push_back(i);
+        }
+    }
+
+    Shared blocking;
+    blocking.archive = &archive;
+    blocking.files = &files;
+    blocking.work_us = config.work_us;
+    if (config.cold)
+        evict(config.pak_path);
+    double start = now();
+    {
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < config.threads; i++)
+            threads.emplace_back(load_blocking, &blocking);
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+    double blocking_time = now() - start;
+
+    Shared coro;
+    coro.archive = &archive;
+    coro.files = &files;
+    coro.work_us = config.work_us;
+    pak_reset_scheduler_stats(archive.get());
+    if (config.cold)
+        evict(config.pak_path);
+    start = now();
+    {
+        Pool pool(config.threads);
+        Latch latch(config.coroutines);
+        for (uint32_t i = 0; i < config.coroutines; i++)
+            load(&coro, &pool, &latch);
+        latch.wait();
+    }
+    double coro_time = now() - start;
+
+    pak_scheduler_stats_t stats;
+    pak_get_scheduler_stats(archive.get(), PAK_PRIORITY_NORMAL, &stats);
+    double mean_latency = stats.completed ? stats.latency_ns * 1e-6 / stats.completed : 0.0;
+
+    printf("{\"files\": %zu, \"threads\": %u, \"io_threads\": %u, \"coroutines\": %u, \"work_us\": %u, \"cold\": %s, ",
+           files.size(), config.threads, config.io_threads, config.coroutines, config.work_us, config.cold ? "true" : "false");
+    printf("\"blocking_s\": %.6f, \"blocking_mb_s\": %.3f, \"blocking_failed\": %" PRIu64 ", ",
+           blocking_time, blocking.bytes / blocking_time / 1e6, blocking.failed.load());
+    printf("\"coroutine_s\": %.6f, \"coroutine_mb_s\": %.3f, \"coroutine_failed\": %" PRIu64 ", ",
+           coro_time, coro.bytes / coro_time / 1e6, coro.failed.load());
+    printf("\"read_latency_ms\": {\"mean\": %.3f, \"max\": %.3f}}\n", mean_latency, stats.max_latency_ns * 1e-6);
+    return blocking.failed || coro.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
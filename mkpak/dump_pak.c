@@ -1,5 +1,6 @@
 #include "pak.h"
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <inttypes.h>
@@ -25,25 +26,14 @@ void dump_node_recursive(pak_node_t* node, pak_handle_t* pak, bool verbose) {
         }
         chdir("..");
     } else {
-        char* buf = malloc(node->entry->data_size_or_child_count);
-        fseeko64(pak->file, pak->header->data_offset + node->entry->data_offset_or_first_child, SEEK_SET);
-        fread(buf, 1, node->entry->data_size_or_child_count, pak->file);
-        FILE* out = fopen(node->filename, "wb");
-        size_t data_len = node->entry->data_size_or_child_count;
-        if (node->entry->flags & PAK_ENTRY_FLAGS_COMPRESSED) {
-            void* uncmp = malloc(node->entry->data_uncompressed_size * 2);
-            int64_t uncomp_len = util_decompress(buf, node->entry->data_size_or_child_count, uncmp, node->entry->data_uncompressed_size * 2);
-            if (uncomp_len == node->entry->data_uncompressed_size) {
-                free(buf);
-                buf = uncmp;
-                data_len = uncomp_len;
-            } else {
-                free(uncmp);
-            }
-        }
-        fwrite(buf, 1, data_len, out);
-        fclose(out);
-        free(buf);
+        // stored data goes from the pak to the file without passing through us
+        uint64_t data_len = pak_get_node_size(node);
+        int64_t index = pak_get_index_from_entry(pak, node->entry);
+        int out = open(node->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out < 0 || index < 0 || pak_copy_index(pak, index, out, 0, data_len) != (int64_t)data_len)
+            fprintf(stderr, "Unable to read %s\n", curpath);
+        if (out >= 0)
+            close(out);
     }
     strcpy(curpath, tmp);
 }
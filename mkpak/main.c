@@ -17,12 +17,38 @@
 const char* argp_program_version = "Pak Creator 0.1";
 const char* argp_program_bug_address = "<antidote.crk@gmail.com>";
 
+enum {
+    OPT_ORDER_FILE = 256,
+    OPT_SOLID,
+    OPT_SOLID_THRESHOLD,
+    OPT_DICTIONARY,
+    OPT_NO_POLICY,
+    OPT_ENDIAN,
+    OPT_CONVERT,
+    OPT_CHECKPOINT_INTERVAL,
+    OPT_SHARD_SIZE,
+    OPT_MANIFEST,
+    OPT_DIFF,
+};
+
 static struct argp_option options[] = {
 {"verbose", 'v', 0, 0, "Produce verbose output", 0},
-{"make",    'm', 0, 0, "Create a pak from the specified directory, to the specified file", 0},
+{"make",    'm', 0, 0, "Create a pak from the specified directory, to the specified file. Either can be '-' for a tar on stdin or the pak on stdout", 0},
 {"dump",    'd', 0, 0, "Dump a pak from the specified file to the specified directory", 0},
 {"compress", 'c', 0, 0, "Compress each file before storing, if possible", 0},
 {"info",     'i', 0, 0, "Print pak statistics and contents", 0},
+{"convert",  OPT_CONVERT, 0, 0, "Rewrite the input pak in the current format to the specified file", 0},
+{"order-file", OPT_ORDER_FILE, "FILE", 0, "Store file data in the load order recorded in FILE (see pak_set_access_log)", 0},
+{"solid",    OPT_SOLID, "SIZE", OPTION_ARG_OPTIONAL, "Pack small files into shared compressed blocks of SIZE bytes (default 65536)", 0},
+{"dictionary", OPT_DICTIONARY, "SIZE", OPTION_ARG_OPTIONAL, "Train a preset dictionary of up to SIZE bytes (default 32768) for small compressed files", 0},
+{"no-policy", OPT_NO_POLICY, 0, 0, "Try the best compression level on every file, even already compressed media", 0},
+{"solid-threshold", OPT_SOLID_THRESHOLD, "SIZE", 0, "Files smaller than SIZE bytes go into solid blocks (default 4096)", 0},
+{"checkpoint-interval", OPT_CHECKPOINT_INTERVAL, "SIZE", 0, "Let reads restart every SIZE bytes in large compressed files, 0 disables (default 1048576)", 0},
+{"shard-size", OPT_SHARD_SIZE, "SIZE", 0, "Split file data into <output>.001, <output>.002, ... of at most SIZE bytes each, unless a single file is larger", 0},
+{"manifest", OPT_MANIFEST, 0, 0, "Read \"<pak path><TAB><source file>\" lines from the input file, or stdin for '-', instead of a directory or tar", 0},
+{"diff",     OPT_DIFF, 0, 0, "Write a patch pak, named with --output, of what changed from the input pak to the second pak", 0},
+{"output",   'o', "FILE", 0, "Patch pak written by --diff", 0},
+{"endian",   OPT_ENDIAN, "ORDER", 0, "Write the pak for a big or little endian target (default: this machine's)", 0},
 {0}
 };
 
@@ -38,6 +64,18 @@ struct arguments {
     bool abort;
     bool compress;
     bool info;
+    bool convert;
+    bool diff;
+    char* patch;
+    char* order_file;
+    uint64_t solid_block_size;
+    uint64_t solid_threshold;
+    uint64_t dictionary_size;
+    bool no_policy;
+    int endian;
+    uint64_t checkpoint_interval;
+    uint64_t shard_size;
+    bool manifest;
     char* input;
     char* output;
 };
@@ -58,6 +96,53 @@ static error_t parse_opt(int key, char* arg, struct argp_state* state) {
         case 'c':
             arguments->compress = true;
             break;
+        case OPT_ORDER_FILE:
+            arguments->order_file = arg;
+            break;
+        case OPT_SOLID:
+            arguments->solid_block_size = arg ? strtoull(arg, NULL, 0) : SOLID_BLOCK_SIZE_DEFAULT;
+            if (!arguments->solid_block_size)
+                argp_error(state, "invalid solid block size '%s'", arg);
+            break;
+        case OPT_SOLID_THRESHOLD:
+            arguments->solid_threshold = strtoull(arg, NULL, 0);
+            break;
+        case OPT_DICTIONARY:
+            arguments->dictionary_size = arg ? strtoull(arg, NULL, 0) : DICTIONARY_SIZE_DEFAULT;
+            if (!arguments->dictionary_size || arguments->dictionary_size > DICTIONARY_SIZE_DEFAULT)
+                argp_error(state, "dictionary size must be between 1 and %d bytes", DICTIONARY_SIZE_DEFAULT);
+            break;
+        case OPT_NO_POLICY:
+            arguments->no_policy = true;
+            break;
+        case OPT_CHECKPOINT_INTERVAL:
+            arguments->checkpoint_interval = strtoull(arg, NULL, 0);
+            break;
+        case OPT_SHARD_SIZE:
+            arguments->shard_size = strtoull(arg, NULL, 0);
+            if (!arguments->shard_size)
+                argp_error(state, "invalid shard size '%s'", arg);
+            break;
+        case OPT_MANIFEST:
+            arguments->manifest = true;
+            break;
+        case OPT_CONVERT:
+            arguments->convert = true;
+            break;
+        case OPT_DIFF:
+            arguments->diff = true;
+            break;
+        case 'o':
+            arguments->patch = arg;
+            break;
+        case OPT_ENDIAN:
+            if (!strcmp(arg, "big"))
+                arguments->endian = TARGET_ENDIAN_BIG;
+            else if (!strcmp(arg, "little"))
+                arguments->endian = TARGET_ENDIAN_LITTLE;
+            else
+                argp_error(state, "endian must be 'big' or 'little', not '%s'", arg);
+            break;
         case 'i':
             arguments->info = true;
             if (state->next + 1 > state->argc) {
@@ -88,12 +173,43 @@ struct argp argp_object = {options, parse_opt, args_doc, doc, NULL, NULL, NULL};
 int main(int argc, char* argv[]) {
     struct arguments args;
     memset(&args, 0, sizeof(struct arguments));
+    args.checkpoint_interval = CHECKPOINT_INTERVAL_DEFAULT;
     argp_parse(&argp_object, argc, argv, 0, 0, &args);
 
     if (args.abort || !args.input)
         return EXIT_FAILURE;
     if (args.info) {
         print_pak_info(args.input);
+    } else if (args.convert) {
+        if (!args.output) {
+            printf("Convert Mode: Missing output file\n");
+            printf("Rerun with -? for more information\n");
+            return EXIT_FAILURE;
+        }
+        make_pak_options_t options;
+        memset(&options, 0, sizeof(make_pak_options_t));
+        options.endian = args.endian;
+        if (!convert_pak(args.input, args.output, &options))
+            return EXIT_FAILURE;
+    } else if (args.diff) {
+        if (!args.output || !args.patch) {
+            printf("Diff Mode: Usage is mkpak --diff old.pak new.pak -o patch.pak\n");
+            printf("Rerun with -? for more information\n");
+            return EXIT_FAILURE;
+        }
+        make_pak_options_t options;
+        memset(&options, 0, sizeof(make_pak_options_t));
+        options.compress = args.compress;
+        options.verbose = args.verbose;
+        options.solid_block_size = args.solid_block_size;
+        options.solid_threshold = args.solid_threshold ? args.solid_threshold : SOLID_THRESHOLD_DEFAULT;
+        options.no_policy = args.no_policy;
+        options.endian = args.endian;
+        options.checkpoint_interval = args.checkpoint_interval;
+        if (options.solid_threshold > options.solid_block_size)
+            options.solid_threshold = options.solid_block_size;
+        if (!diff_pak(args.input, args.output, args.patch, &options))
+            return EXIT_FAILURE;
     } else if (!args.make) {
         if (!args.output) {
             printf("Dump Mode: Missing output directory\n");
@@ -107,7 +223,25 @@ int main(int argc, char* argv[]) {
             printf("Rerun with -? for more information\n");
             return EXIT_FAILURE;
         }
-        make_pak(args.input, args.output, args.compress, args.verbose);
+        make_pak_options_t options;
+        memset(&options, 0, sizeof(make_pak_options_t));
+        options.compress = args.compress;
+        options.verbose = args.verbose;
+        options.order_file = args.order_file;
+        options.solid_block_size = args.solid_block_size;
+        options.solid_threshold = args.solid_threshold ? args.solid_threshold : SOLID_THRESHOLD_DEFAULT;
+        options.dictionary_size = args.dictionary_size;
+        options.no_policy = args.no_policy;
+        options.endian = args.endian;
+        options.checkpoint_interval = args.checkpoint_interval;
+        options.shard_size = args.shard_size;
+        options.manifest = args.manifest;
+        if (options.solid_threshold > options.solid_block_size)
+            options.solid_threshold = options.solid_block_size;
+        if (!strcmp(args.input, "-") || !strcmp(args.output, "-") || options.manifest)
+            stream_pak(args.input, args.output, &options);
+        else
+            make_pak(args.input, args.output, &options);
     }
     return EXIT_SUCCESS;
 }
@@ -3,146 +3,768 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <zlib.h>
 #include "util.h"
 #include <time.h>
 #include <inttypes.h>
 
-static char curpath[FILENAME_MAX] = {0};
 static int time_last = 0;
 
-int pak_file_or_dir(struct dirent* dent, uint32_t idx, FILE* entryFile, FILE* stringFile, FILE* dataFile, bool compress, bool verbose)
-{
-    char tmppath[FILENAME_MAX];
-    memcpy(tmppath, curpath, strlen(curpath) + 1);
-    strcat(curpath, "/");
-    strcat(curpath, dent->d_name);
+typedef struct _pending_file {
+    uint64_t index;     // index in the entry table
+    uint64_t rank;      // position in the order file, UINT64_MAX if it's not listed
+    char* path;         // path on disk, the pak path starts at path + basepath_len
+} pending_file_t;
 
-    if ((time(NULL) - time_last) > 1 && !verbose)
-    {
-        printf(".");
-        fflush(stdout);
-        time_last = time(NULL);
+typedef struct _order_entry {
+    const char* path;
+    uint64_t rank;
+} order_entry_t;
+
+static pending_file_t* pending_files = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+static size_t basepath_len = 0;
+
+// solid block currently being filled and the table of blocks written so far
+static char* solid_buf = NULL;
+static size_t solid_len = 0;
+static pak_block_t* blocks = NULL;
+static size_t block_count = 0;
+static size_t block_capacity = 0;
+
+static size_t policy_stored_count = 0;
+
+// size of the data section so far, dataFile may be a pipe that can't tell its position
+static uint64_t data_written = 0;
+
+static char* dictionary_buf = NULL;
+static size_t dictionary_len = 0;
+
+// restart points of large compressed files, sorted by entry before they're written
+static pak_checkpoint_t* checkpoints = NULL;
+static size_t checkpoint_count = 0;
+static size_t checkpoint_capacity = 0;
+
+static void add_checkpoints(uint64_t index, const uint64_t* offsets, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (checkpoint_count == checkpoint_capacity) {
+            checkpoint_capacity = checkpoint_capacity ? checkpoint_capacity * 2 : 256;
+            checkpoints = realloc(checkpoints, checkpoint_capacity * sizeof(pak_checkpoint_t));
+        }
+        pak_checkpoint_t* checkpoint = &checkpoints[checkpoint_count++];
+        checkpoint->entry_index = index;
+        checkpoint->uncompressed_offset = offsets[i * 2];
+        checkpoint->compressed_offset = offsets[i * 2 + 1];
     }
+}
 
-    struct stat64 st;
-    stat64(curpath, &st);
-    if (verbose)
-        printf("%s\n", curpath);
+// pak_hash_data of each file, by entry index or by sequence while streaming. Directories stay 0.
+static uint64_t* content_hashes = NULL;
+static size_t content_hash_capacity = 0;
 
-    pak_entry_t* entry = pak_create_entry();
+static uint64_t* content_hash_table(size_t count) {
+    if (count > content_hash_capacity) {
+        size_t capacity = content_hash_capacity ? content_hash_capacity : 1024;
+        while (capacity < count)
+            capacity *= 2;
+        content_hashes = realloc(content_hashes, capacity * sizeof(uint64_t));
+        memset(content_hashes + content_hash_capacity, 0, (capacity - content_hash_capacity) * sizeof(uint64_t));
+        content_hash_capacity = capacity;
+    }
+    return content_hashes;
+}
 
-    if (S_ISLNK(st.st_mode))
-        goto fail;
+static void set_content_hash(uint64_t index, uint64_t hash) {
+    content_hash_table(index + 1)[index] = hash;
+}
 
-    if (!S_ISDIR(st.st_mode)) {
+static void content_hash_free(void) {
+    free(content_hashes);
+    content_hashes = NULL;
+    content_hash_capacity = 0;
+}
 
-        FILE* in = fopen(curpath, "rb");
-        if (in) {
-            entry->flags = PAK_ENTRY_FLAGS_WRITEABLE;
-            entry->file_id = idx;
-            entry->string_offset = ftello64(stringFile);
-            entry->data_offset_or_first_child = ftello64(dataFile);
-            entry->data_size_or_child_count = st.st_size;
-            entry->data_uncompressed_size = 0;
+static int compare_checkpoint(const void* a, const void* b) {
+    const pak_checkpoint_t* ca = a;
+    const pak_checkpoint_t* cb = b;
+    if (ca->entry_index != cb->entry_index)
+        return ca->entry_index < cb->entry_index ? -1 : 1;
+    if (ca->uncompressed_offset != cb->uncompressed_offset)
+        return ca->uncompressed_offset < cb->uncompressed_offset ? -1 : 1;
+    return 0;
+}
 
-            idx++;
+// Repeated names like index.json share one slot of the string table, readers only go by offset
+typedef struct _intern_slot {
+    char* name;
+    uint32_t hash;
+    uint32_t offset;
+} intern_slot_t;
 
-            fwrite(dent->d_name, 1, strlen(dent->d_name) + 1, stringFile);
-            uint32_t data_len = st.st_size;
-            char* buf = malloc(st.st_size);
-            fread(buf, 1, st.st_size, in);
-
-            if (compress) {
-                void* comp_buf = malloc(data_len);
-                size_t comp_len = util_compress(buf, st.st_size, comp_buf, Z_BEST_COMPRESSION);
-                if (comp_len < (size_t)st.st_size) {
-                    entry->flags |= PAK_ENTRY_FLAGS_COMPRESSED;
-                    entry->data_uncompressed_size = st.st_size;
-                    entry->data_size_or_child_count = comp_len;
-                    data_len = (comp_len + 31) & ~31;
-                    free(buf);
-                    buf = malloc(data_len);
-                    pak_clear(buf, data_len);
-                    memcpy(buf, comp_buf, comp_len);
-                    free(comp_buf);
-                } else {
-                    data_len = (data_len + 31) & ~31;
-                    void* tmp = malloc(data_len);
-                    pak_clear(tmp, data_len);
-                    memcpy(tmp, buf, st.st_size);
-                    free(buf);
-                    buf = tmp;
-                }
-            }
-            else
-            {
-                data_len = (data_len + 31) & ~31;
-                void* tmp = malloc(data_len);
-                pak_clear(tmp, data_len);
-                memcpy(tmp, buf, st.st_size);
-                free(buf);
-                buf = tmp;
-            }
+static intern_slot_t* intern_slots = NULL;
+static size_t intern_capacity = 0;
+static size_t intern_count = 0;
+static size_t intern_shared = 0;    // names that reused a slot
 
-            fwrite(entry, 1, sizeof(pak_entry_t), entryFile);
+static void intern_grow(void) {
+    intern_slot_t* old = intern_slots;
+    size_t old_capacity = intern_capacity;
+    intern_capacity = old_capacity ? old_capacity * 2 : 4096;
+    intern_slots = calloc(intern_capacity, sizeof(intern_slot_t));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].name)
+            continue;
+        size_t slot = old[i].hash & (intern_capacity - 1);
+        while (intern_slots[slot].name)
+            slot = (slot + 1) & (intern_capacity - 1);
+        intern_slots[slot] = old[i];
+    }
+    free(old);
+}
+
+// Returns the string table offset of name, appending it to stringFile the first time it comes up
+static uint32_t intern_string(FILE* stringFile, const char* name, size_t len) {
+    if ((intern_count + 1) * 2 > intern_capacity)
+        intern_grow();
+
+    uint32_t hash = pak_hash_name(name, len);
+    size_t slot = hash & (intern_capacity - 1);
+    while (intern_slots[slot].name) {
+        intern_slot_t* found = &intern_slots[slot];
+        if (found->hash == hash && !strncmp(found->name, name, len) && !found->name[len]) {
+            intern_shared++;
+            return found->offset;
+        }
+        slot = (slot + 1) & (intern_capacity - 1);
+    }
+
+    uint64_t offset = ftello64(stringFile);
+    if (offset > UINT32_MAX) {
+        printf("\nString table is larger than 4 GiB\n");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(name, 1, len, stringFile);
+    fputc('\0', stringFile);
+
+    intern_slots[slot].name = strndup(name, len);
+    intern_slots[slot].hash = hash;
+    intern_slots[slot].offset = offset;
+    intern_count++;
+    return offset;
+}
+
+static void intern_free(void) {
+    for (size_t i = 0; i < intern_capacity; i++)
+        free(intern_slots[i].name);
+    free(intern_slots);
+    intern_slots = NULL;
+    intern_capacity = 0;
+    intern_count = 0;
+    intern_shared = 0;
+}
+
+static void add_pending_file(uint64_t index, const char* path) {
+    if (pending_count == pending_capacity) {
+        pending_capacity = pending_capacity ? pending_capacity * 2 : 1024;
+        pending_files = realloc(pending_files, pending_capacity * sizeof(pending_file_t));
+    }
+
+    pending_files[pending_count].index = index;
+    pending_files[pending_count].rank = UINT64_MAX;
+    pending_files[pending_count].path = strdup(path);
+    pending_count++;
+}
+
+static int compare_order_entry(const void* a, const void* b) {
+    const order_entry_t* ea = a;
+    const order_entry_t* eb = b;
+    int ret = strcmp(ea->path, eb->path);
+    if (ret)
+        return ret;
+    return (ea->rank > eb->rank) - (ea->rank < eb->rank);
+}
+
+static int compare_pending_file(const void* a, const void* b) {
+    const pending_file_t* fa = a;
+    const pending_file_t* fb = b;
+    if (fa->rank != fb->rank)
+        return (fa->rank > fb->rank) - (fa->rank < fb->rank);
+    // unlisted files keep their directory order
+    return (fa->index > fb->index) - (fa->index < fb->index);
+}
+
+// Reads an access log as produced by pak_set_access_log and ranks the pending files by it,
+// a path that is listed more than once is ranked by its first load.
+static bool apply_order_file(const char* filename) {
+    FILE* in = fopen(filename, "r");
+    if (!in)
+        return false;
+
+    order_entry_t* order = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char line[FILENAME_MAX];
+    while (fgets(line, sizeof(line), in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0])
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            order = realloc(order, capacity * sizeof(order_entry_t));
+        }
+
+        char* path = malloc(strlen(line) + 2);
+        path[0] = '\0';
+        if (line[0] != '/')
+            strcat(path, "/");
+        strcat(path, line);
+        order[count].path = path;
+        order[count].rank = count;
+        count++;
+    }
+    fclose(in);
+
+    qsort(order, count, sizeof(order_entry_t), compare_order_entry);
+    for (size_t i = 0; i < pending_count; i++) {
+        order_entry_t key = {pending_files[i].path + basepath_len, 0};
+        order_entry_t* found = bsearch(&key, order, count, sizeof(order_entry_t), compare_order_entry);
+        if (!found)
+            continue;
+
+        // bsearch may land on any duplicate, walk back to the earliest load
+        while (found > order && !strcmp((found - 1)->path, found->path))
+            found--;
+        pending_files[i].rank = found->rank;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free((void*)order[i].path);
+    free(order);
+    return true;
+}
+
+static bool read_whole_file(const char* path, char** buf, size_t* len) {
+    struct stat64 st;
+    FILE* in = fopen(path, "rb");
+    if (!in || fstat64(fileno(in), &st)) {
+        if (in)
             fclose(in);
-            fwrite(buf, 1, data_len, dataFile);
+        return false;
+    }
+
+    *len = st.st_size;
+    *buf = malloc(*len + 1);
+    *len = fread(*buf, 1, *len, in);
+    fclose(in);
+    return true;
+}
+
+// Samples the files that will be compressed on their own and trains a preset dictionary on them
+static void train_dictionary(const make_pak_options_t* options) {
+    const void** samples = malloc(DICTIONARY_MAX_SAMPLES * sizeof(void*));
+    size_t* sample_sizes = malloc(DICTIONARY_MAX_SAMPLES * sizeof(size_t));
+    size_t sample_count = 0;
+    size_t stride = pending_count / DICTIONARY_MAX_SAMPLES + 1;
+    for (size_t i = 0; i < pending_count && sample_count < DICTIONARY_MAX_SAMPLES; i += stride) {
+        struct stat64 st;
+        if (stat64(pending_files[i].path, &st) || st.st_size >= DICTIONARY_MAX_FILE_SIZE || st.st_size < 16)
+            continue;
+        if (options->solid_block_size && (uint64_t)st.st_size < options->solid_threshold)
+            continue;
+
+        char* buf;
+        size_t len;
+        if (!read_whole_file(pending_files[i].path, &buf, &len))
+            continue;
+        samples[sample_count] = buf;
+        sample_sizes[sample_count] = len;
+        sample_count++;
+    }
+
+    dictionary_buf = malloc(options->dictionary_size);
+    dictionary_len = util_train_dictionary(samples, sample_sizes, sample_count, dictionary_buf, options->dictionary_size);
+    if (options->verbose)
+        printf("Trained a %zu byte dictionary on %zu files\n", dictionary_len, sample_count);
+
+    for (size_t i = 0; i < sample_count; i++)
+        free((void*)samples[i]);
+    free(samples);
+    free(sample_sizes);
+}
+
+static void write_data(const void* buf, size_t len, FILE* dataFile) {
+    fwrite(buf, 1, len, dataFile);
+    data_written += len;
+}
+
+static void flush_solid_block(FILE* dataFile) {
+    if (!solid_len)
+        return;
+
+    if (block_count == block_capacity) {
+        block_capacity = block_capacity ? block_capacity * 2 : 256;
+        blocks = realloc(blocks, block_capacity * sizeof(pak_block_t));
+    }
+
+    pak_block_t* block = &blocks[block_count++];
+    block->data_offset = data_written;
+    block->data_uncompressed_size = solid_len;
+
+    void* comp_buf = malloc(solid_len);
+    size_t comp_len = util_compress(solid_buf, solid_len, comp_buf, Z_BEST_COMPRESSION);
+    char* out = comp_buf;
+    if (comp_len >= solid_len) {
+        comp_len = solid_len;
+        out = solid_buf;
+    }
+    block->data_size = comp_len;
+
+    char pad[32];
+    pak_clear(pad, sizeof(pad));
+    write_data(out, comp_len, dataFile);
+    write_data(pad, ((comp_len + 31) & ~31) - comp_len, dataFile);
+
+    free(comp_buf);
+    solid_len = 0;
+}
+
+static void add_solid_file(pak_entry_t* entry, const char* buf, size_t len, FILE* dataFile, const make_pak_options_t* options) {
+    if (solid_len + len > options->solid_block_size)
+        flush_solid_block(dataFile);
+    if (!solid_buf)
+        solid_buf = malloc(options->solid_block_size);
+
+    entry->flags |= PAK_ENTRY_FLAGS_SOLID;
+    entry->data_offset_or_first_child = block_count;
+    entry->data_uncompressed_size = solid_len;
+    entry->data_size_or_child_count = len;
+
+    memcpy(solid_buf + solid_len, buf, len);
+    solid_len += len;
+}
+
+// Appends a file's contents to the data section and fills in entry, index keys its checkpoints.
+// Takes ownership of buf.
+static void write_file_data(const char* path, uint64_t index, char* buf, size_t len, pak_entry_t* entry,
+                            FILE* dataFile, const make_pak_options_t* options) {
+    bool compress = options->compress;
+    bool verbose = options->verbose;
+
+    entry->data_offset_or_first_child = data_written;
+    entry->data_size_or_child_count = len;
+    uint32_t data_len = len;
+    set_content_hash(index, pak_hash_data(buf, len));
+
+    if (options->solid_block_size && (uint64_t)len < options->solid_threshold) {
+        add_solid_file(entry, buf, len, dataFile, options);
+        free(buf);
+        return;
+    }
+
+    int32_t level = Z_BEST_COMPRESSION;
+    if (compress && !options->no_policy) {
+        const char* reason;
+        level = policy_choose_level(path, buf, len, &reason);
+        if (level == Z_NO_COMPRESSION) {
+            policy_stored_count++;
+            if (verbose)
+                printf("stored (%s)\n", reason);
+        }
+    }
+
+    if (compress && level != Z_NO_COMPRESSION) {
+        void* comp_buf = malloc(data_len);
+        size_t comp_len;
+        uint64_t* file_checkpoints = NULL;
+        size_t file_checkpoint_count = 0;
+        uint64_t interval = options->checkpoint_interval;
+        if (dictionary_len && len < DICTIONARY_MAX_FILE_SIZE) {
+            comp_len = util_compress_dict(buf, len, comp_buf, level, dictionary_buf, dictionary_len);
+        } else if (interval && (uint64_t)len >= interval * 2) {
+            file_checkpoints = malloc((len / interval) * 2 * sizeof(uint64_t));
+            comp_len = util_compress_checkpoints(buf, len, comp_buf, level, interval, file_checkpoints, &file_checkpoint_count);
+        } else {
+            comp_len = util_compress(buf, len, comp_buf, level);
+        }
+        if (comp_len < (size_t)len) {
+            add_checkpoints(index, file_checkpoints, file_checkpoint_count);
+            entry->flags |= PAK_ENTRY_FLAGS_COMPRESSED;
+            entry->data_uncompressed_size = len;
+            entry->data_size_or_child_count = comp_len;
+            data_len = (comp_len + 31) & ~31;
             free(buf);
+            buf = malloc(data_len);
+            pak_clear(buf, data_len);
+            memcpy(buf, comp_buf, comp_len);
+            free(comp_buf);
+        } else {
+            data_len = (data_len + 31) & ~31;
+            void* tmp = malloc(data_len);
+            pak_clear(tmp, data_len);
+            memcpy(tmp, buf, len);
+            free(buf);
+            free(comp_buf);
+            buf = tmp;
+        }
+        free(file_checkpoints);
+    }
+    else
+    {
+        data_len = (data_len + 31) & ~31;
+        void* tmp = malloc(data_len);
+        pak_clear(tmp, data_len);
+        memcpy(tmp, buf, len);
+        free(buf);
+        buf = tmp;
+    }
+
+    write_data(buf, data_len, dataFile);
+    free(buf);
+}
+
+static void write_pending_file(pending_file_t* file, pak_entry_t* entry, FILE* dataFile, const make_pak_options_t* options) {
+    if (options->verbose)
+        printf("%s\n", file->path);
+
+    entry->data_offset_or_first_child = data_written;
+
+    // a file that can't be read fails the build, the same in every mode, rather than leaving a hole in the pak
+    char* buf;
+    size_t len;
+    if (!read_whole_file(file->path, &buf, &len)) {
+        printf("\nUnable to read %s\n", file->path);
+        exit(EXIT_FAILURE);
+    }
+    write_file_data(file->path, file->index, buf, len, entry, dataFile, options);
+}
+
+static void write_pending_data(char* entryTableBuf, FILE* dataFile, const make_pak_options_t* options) {
+    bool verbose = options->verbose;
+    qsort(pending_files, pending_count, sizeof(pending_file_t), compare_pending_file);
+    for (size_t i = 0; i < pending_count; i++) {
+        if ((time(NULL) - time_last) > 1 && !verbose)
+        {
+            printf(".");
+            fflush(stdout);
+            time_last = time(NULL);
         }
 
-    } else if (S_ISDIR(st.st_mode)) {
-        entry->flags = PAK_ENTRY_FLAGS_WRITEABLE | PAK_ENTRY_FLAGS_DIR;
-        entry->file_id = idx;
-        entry->string_offset = ftello64(stringFile);
-        entry->data_offset_or_first_child = idx + 1;
+        pak_entry_t* entry = (pak_entry_t*)(entryTableBuf + pending_files[i].index * sizeof(pak_entry_t));
+        write_pending_file(&pending_files[i], entry, dataFile, options);
+        free(pending_files[i].path);
+    }
+    flush_solid_block(dataFile);
+    free(solid_buf);
+    solid_buf = NULL;
+
+    free(pending_files);
+    pending_files = NULL;
+    pending_count = 0;
+    pending_capacity = 0;
+}
+
+// Writes the entries below dir depth first, the order the reader's subtree index expects.
+// path holds dir's path on disk and is extended for each child.
+static uint64_t write_scanned_dir(const scan_dir_t* dir, uint64_t idx, FILE* entryFile, FILE* stringFile,
+                                  char* path, size_t path_len, bool verbose)
+{
+    for (size_t i = 0; i < dir->child_count; i++) {
+        const scan_child_t* child = &dir->children[i];
+        size_t name_len = strlen(child->name);
+        if (path_len + name_len + 2 > FILENAME_MAX) {
+            printf("\nPath too long: %s/%s\n", path, child->name);
+            exit(EXIT_FAILURE);
+        }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, child->name, name_len + 1);
+
+        if ((time(NULL) - time_last) > 1 && !verbose)
+        {
+            printf(".");
+            fflush(stdout);
+            time_last = time(NULL);
+        }
+        if (verbose)
+            printf("%s\n", path);
+
+        pak_entry_t* entry = pak_create_entry();
+        entry->string_offset = intern_string(stringFile, child->name, name_len);
+        entry->data_offset_or_first_child = 0;
         entry->data_size_or_child_count = 0;
-        idx++;
-
-        fwrite(dent->d_name, 1, strlen(dent->d_name) + 1, stringFile);
-        uint32_t offset = ftello64(entryFile);
-        fseeko64(entryFile, sizeof(pak_entry_t), SEEK_CUR);
-        DIR* thisDir = opendir(curpath);
-        if (thisDir) {   struct dirent * child = NULL;
-            while ((child = readdir(thisDir)) != NULL) {
-                if (!strcmp(child->d_name, ".") || !strcmp(child->d_name, "..") || !strcmp(child->d_name, ".git"))
-                    continue;
-
-                idx = pak_file_or_dir(child, idx, entryFile, stringFile, dataFile, compress, verbose);
-                entry->data_size_or_child_count++;
+
+        if (!child->dir) {
+            // data is written later by write_pending_data, once we know the load order
+            entry->flags = PAK_ENTRY_FLAGS_WRITEABLE;
+            entry->data_uncompressed_size = 0;
+            add_pending_file(idx, path);
+            fwrite(entry, 1, sizeof(pak_entry_t), entryFile);
+            idx++;
+        } else {
+            entry->flags = PAK_ENTRY_FLAGS_WRITEABLE | PAK_ENTRY_FLAGS_DIR;
+            if (child->dir->child_count) {
+                entry->data_offset_or_first_child = idx + 1;
+                entry->data_size_or_child_count = child->dir->child_count;
             }
-            if (!entry->data_size_or_child_count)
-                entry->data_offset_or_first_child = 0;
+            fwrite(entry, 1, sizeof(pak_entry_t), entryFile);
+            idx = write_scanned_dir(child->dir, idx + 1, entryFile, stringFile, path, path_len + 1 + name_len, verbose);
         }
+        pak_free_entry(entry);
+    }
+    path[path_len] = '\0';
+    return idx;
+}
 
-        fseeko64(entryFile, offset, SEEK_SET);
-        fwrite(entry, 1, sizeof(pak_entry_t), entryFile);
-        fseeko64(entryFile, 0, SEEK_END);
+static uint64_t copy_data(FILE* from, FILE* to, uint64_t size) {
+    uint64_t bytesRead = 0;
+    size_t blockSize = BUF_SIZ;
+    char* buf = malloc(blockSize);
+    while(bytesRead < size)
+    {
+        if (blockSize > size - bytesRead)
+            blockSize = size - bytesRead;
+        size_t nextReadSize = fread(buf, 1, blockSize, from);
+        if (nextReadSize <= 0)
+            break;  // error or early EOF!
 
+        fwrite(buf, 1, nextReadSize, to);
+        bytesRead += nextReadSize;
     }
-    else if (verbose)
-fail:
-        printf("skipped\n");
+    free(buf);
+    return bytesRead;
+}
 
-    strcpy(curpath, tmppath);
-    pak_free_entry(entry);
+typedef struct _shard_item {
+    uint64_t offset;
+    uint64_t size;
+    pak_entry_t* entry;         // NULL for solid blocks
+    uint64_t block;
+} shard_item_t;
 
-    return idx;
+static int compare_shard_item(const void* a, const void* b) {
+    const shard_item_t* ia = a;
+    const shard_item_t* ib = b;
+    if (ia->offset != ib->offset)
+        return ia->offset < ib->offset ? -1 : 1;
+    return 0;
+}
+
+// Cuts the data file into shards of at most shardSize bytes between two files or blocks and rebases their
+// offsets to the start of their shard. Shards past the first are written next to output, the first stays
+// at the start of dataFile for write_pak. Returns the shard count, shard 0's size goes in firstShardSize.
+static uint64_t split_shards(char* entryTable, size_t entryCount, pak_block_t* blockTable, size_t blockCount,
+                             FILE* dataFile, uint64_t dataTableSize, uint64_t shardSize, const char* output,
+                             uint64_t* firstShardSize) {
+    shard_item_t* items = malloc((entryCount + blockCount) * sizeof(shard_item_t));
+    size_t itemCount = 0;
+    for (size_t i = 0; i < entryCount; i++) {
+        pak_entry_t* entry = (pak_entry_t*)(entryTable + i * sizeof(pak_entry_t));
+        if (PAK_ENTRY_IS_DIR(entry) || (entry->flags & PAK_ENTRY_FLAGS_SOLID))
+            continue;
+        items[itemCount++] = (shard_item_t){entry->data_offset_or_first_child, entry->data_size_or_child_count, entry, 0};
+    }
+    for (size_t i = 0; i < blockCount; i++)
+        items[itemCount++] = (shard_item_t){blockTable[i].data_offset, blockTable[i].data_size, NULL, i};
+    qsort(items, itemCount, sizeof(shard_item_t), compare_shard_item);
+
+    uint64_t* starts = malloc((itemCount + 1) * sizeof(uint64_t));
+    uint16_t* blockShards = calloc(blockCount ? blockCount : 1, sizeof(uint16_t));
+    uint64_t shardCount = 1;
+    starts[0] = 0;
+    for (size_t i = 0; i < itemCount; i++) {
+        shard_item_t* item = &items[i];
+        uint64_t start = starts[shardCount - 1];
+        if (item->offset > start && item->offset + item->size - start > shardSize) {
+            if (shardCount > UINT16_MAX) {
+                printf("\nToo many shards, use a larger shard size\n");
+                exit(EXIT_FAILURE);
+            }
+            starts[shardCount++] = item->offset;
+            start = item->offset;
+        }
+
+        if (item->entry) {
+            item->entry->shard = shardCount - 1;
+            item->entry->data_offset_or_first_child -= start;
+        } else {
+            blockShards[item->block] = shardCount - 1;
+            blockTable[item->block].data_offset -= start;
+        }
+    }
+    starts[shardCount] = dataTableSize;
+
+    // files in a solid block are read out of the block's shard
+    for (size_t i = 0; i < entryCount; i++) {
+        pak_entry_t* entry = (pak_entry_t*)(entryTable + i * sizeof(pak_entry_t));
+        if (!PAK_ENTRY_IS_DIR(entry) && (entry->flags & PAK_ENTRY_FLAGS_SOLID) && entry->data_offset_or_first_child < blockCount)
+            entry->shard = blockShards[entry->data_offset_or_first_child];
+    }
+
+    for (uint64_t i = 1; i < shardCount; i++) {
+        char path[FILENAME_MAX];
+        FILE* shard = NULL;
+        if (pak_shard_path(output, i, path, sizeof(path)))
+            shard = fopen(path, "wb");
+        if (!shard) {
+            printf("\nUnable to write shard %" PRIu64 "\n", i);
+            exit(EXIT_FAILURE);
+        }
+        fseeko64(dataFile, starts[i], SEEK_SET);
+        copy_data(dataFile, shard, starts[i + 1] - starts[i]);
+        fclose(shard);
+    }
+    fseeko64(dataFile, 0, SEEK_SET);
+
+    *firstShardSize = starts[1 < shardCount ? 1 : shardCount];
+    free(items);
+    free(starts);
+    free(blockShards);
+    return shardCount;
+}
+
+// Places the tables one after another from start on, returns the 32 byte aligned offset where they end
+static uint64_t layout_tables(pak_handle_t* handle, uint64_t start, size_t entryCount, size_t stringTableSize,
+                              size_t blockCount, size_t dictionaryLen, size_t checkpointCount, bool hashes) {
+    size_t entryTableSize = entryCount * sizeof(pak_entry_t);
+
+    pak_set_entry_start(handle, start);
+    pak_set_entry_count(handle, entryCount);
+    pak_set_string_table_offset(handle, (start + entryTableSize + 31) & ~31);
+    pak_set_string_table_size(handle, stringTableSize);
+    size_t blockTableSize = blockCount * sizeof(pak_block_t);
+    uint64_t blockTableOffset = (handle->header->string_table_offset + stringTableSize + 31) & ~31;
+    if (blockCount) {
+        pak_set_block_table_offset(handle, blockTableOffset);
+        pak_set_block_count(handle, blockCount);
+    }
+    uint64_t dictionaryOffset = (blockTableOffset + blockTableSize + 31) & ~31;
+    if (dictionaryLen) {
+        pak_set_dictionary_offset(handle, dictionaryOffset);
+        pak_set_dictionary_size(handle, dictionaryLen);
+    }
+    size_t checkpointTableSize = checkpointCount * sizeof(pak_checkpoint_t);
+    uint64_t checkpointTableOffset = (dictionaryOffset + dictionaryLen + 31) & ~31;
+    if (checkpointCount) {
+        pak_set_checkpoint_table_offset(handle, checkpointTableOffset);
+        pak_set_checkpoint_count(handle, checkpointCount);
+    }
+    uint64_t hashTableOffset = (checkpointTableOffset + checkpointTableSize + 31) & ~31;
+    if (!hashes)
+        return hashTableOffset;
+    pak_set_hash_table_offset(handle, hashTableOffset);
+    return (hashTableOffset + entryCount * sizeof(uint64_t) + 31) & ~31;
 }
 
-void make_pak(char *input, char *output, bool compress, bool verbose) {
+// Writes the tables as placed by layout_tables at the current position of pak, hashTable has one
+// hash per entry or is NULL. The tables are in host order and aren't modified.
+static void write_tables(pak_handle_t* handle, FILE* pak, const void* entryTable, size_t entryCount, const void* stringTable,
+                         size_t stringTableSize, const pak_block_t* blockTable, size_t blockCount, const void* dictionary,
+                         size_t dictionaryLen, const pak_checkpoint_t* checkpointTable, size_t checkpointCount,
+                         const uint64_t* hashTable) {
+    size_t entryTableSize = entryCount * sizeof(pak_entry_t);
+    size_t blockTableSize = blockCount * sizeof(pak_block_t);
+    size_t checkpointTableSize = checkpointCount * sizeof(pak_checkpoint_t);
+
+    // pad buffers
+    size_t paddedEntryBufSize = (entryTableSize + 31) & ~31;
+    char* paddedEntryBuf = malloc(paddedEntryBufSize);
+    pak_clear(paddedEntryBuf, paddedEntryBufSize);
+    memcpy(paddedEntryBuf, entryTable, entryTableSize);
+
+    size_t paddedStringBufSize = (stringTableSize + 31) & ~31;
+    char* paddedStringBuf = malloc(paddedStringBufSize);
+
+    pak_clear(paddedStringBuf, paddedStringBufSize);
+    memcpy(paddedStringBuf, stringTable, stringTableSize);
+
+    size_t paddedBlockBufSize = (blockTableSize + 31) & ~31;
+    char* paddedBlockBuf = malloc(paddedBlockBufSize);
+    pak_clear(paddedBlockBuf, paddedBlockBufSize);
+    memcpy(paddedBlockBuf, blockTable, blockTableSize);
+
+    size_t paddedDictionaryBufSize = (dictionaryLen + 31) & ~31;
+    char* paddedDictionaryBuf = malloc(paddedDictionaryBufSize);
+    pak_clear(paddedDictionaryBuf, paddedDictionaryBufSize);
+    memcpy(paddedDictionaryBuf, dictionary, dictionaryLen);
+
+    size_t paddedCheckpointBufSize = (checkpointTableSize + 31) & ~31;
+    char* paddedCheckpointBuf = malloc(paddedCheckpointBufSize);
+    pak_clear(paddedCheckpointBuf, paddedCheckpointBufSize);
+    memcpy(paddedCheckpointBuf, checkpointTable, checkpointTableSize);
+
+    size_t hashTableSize = hashTable ? entryCount * sizeof(uint64_t) : 0;
+    size_t paddedHashBufSize = (hashTableSize + 31) & ~31;
+    char* paddedHashBuf = malloc(paddedHashBufSize);
+    pak_clear(paddedHashBuf, paddedHashBufSize);
+    memcpy(paddedHashBuf, hashTable, hashTableSize);
+
+    // tables are built in host order, the data is opaque bytes either way
+    if (!pak_is_native_endian(handle)) {
+        pak_swap_entries((pak_entry_t*)paddedEntryBuf, entryCount);
+        pak_swap_blocks((pak_block_t*)paddedBlockBuf, blockCount);
+        pak_swap_checkpoints((pak_checkpoint_t*)paddedCheckpointBuf, checkpointCount);
+        pak_swap_hashes((uint64_t*)paddedHashBuf, hashTableSize / sizeof(uint64_t));
+    }
+
+    fwrite(paddedEntryBuf, 1, paddedEntryBufSize, pak);
+    fwrite(paddedStringBuf, 1, paddedStringBufSize, pak);
+    fwrite(paddedBlockBuf, 1, paddedBlockBufSize, pak);
+    fwrite(paddedDictionaryBuf, 1, paddedDictionaryBufSize, pak);
+    fwrite(paddedCheckpointBuf, 1, paddedCheckpointBufSize, pak);
+    fwrite(paddedHashBuf, 1, paddedHashBufSize, pak);
+
+    free(paddedEntryBuf);
+    free(paddedStringBuf);
+    free(paddedBlockBuf);
+    free(paddedDictionaryBuf);
+    free(paddedCheckpointBuf);
+    free(paddedHashBuf);
+}
+
+// Lays out the tables after the header and copies data_size bytes of file data from dataFile behind them.
+// The tables are in host order and aren't modified.
+static void write_pak(pak_handle_t* handle, const void* entryTable, size_t entryCount, const void* stringTable, size_t stringTableSize,
+                      const pak_block_t* blockTable, size_t blockCount, const void* dictionary, size_t dictionaryLen,
+                      const pak_checkpoint_t* checkpointTable, size_t checkpointCount, const uint64_t* hashTable,
+                      FILE* dataFile, uint64_t dataTableSize) {
+    uint64_t start = (sizeof(pak_header_t) + 31) & ~31;
+    pak_set_data_offset(handle, layout_tables(handle, start, entryCount, stringTableSize, blockCount, dictionaryLen,
+                                              checkpointCount, hashTable != NULL));
+
+    // write pak
+    FILE* pak = handle->file;
+    if (pak)
+    {
+        pak_write_header(handle);
+        fseeko64(pak, start, SEEK_SET);
+        write_tables(handle, pak, entryTable, entryCount, stringTable, stringTableSize, blockTable, blockCount,
+                     dictionary, dictionaryLen, checkpointTable, checkpointCount, hashTable);
+
+        copy_data(dataFile, pak, dataTableSize);
+    }
+}
+
+void make_pak(char *input, char *output, const make_pak_options_t* options) {
+    bool compress = options->compress;
+    bool verbose = options->verbose;
 
     time_last = time(NULL);
-    DIR* dir;
-    struct dirent * dent;
+    data_written = 0;
     char* basepath = input;
-    dir = opendir(basepath);
-    if (!dir) {
+    basepath_len = strlen(basepath);
+    if (basepath_len >= FILENAME_MAX)
+        exit(EXIT_FAILURE);
+    scan_tree_t* tree = scan_tree(basepath, 0);
+    if (!tree) {
         exit(EXIT_FAILURE);
     }
 
     pak_handle_t* handle = pak_open_write(output);
+    if (options->endian == TARGET_ENDIAN_BIG)
+        pak_set_endian(handle, BigEndian);
+    else if (options->endian == TARGET_ENDIAN_LITTLE)
+        pak_set_endian(handle, LittleEndian);
 
     printf("Building entry, string and data files...");
     fflush(stdout);
@@ -162,43 +784,38 @@ void make_pak(char *input, char *output, bool compress, bool verbose) {
     FILE* entryFile  = fopen(entryTempPath, "wb");
     FILE* stringFile = fopen(stringTempPath, "wb");
 
-    uint64_t idx = 0;
-    while ((dent = readdir(dir)) != NULL)
-    {
-        if ((time(NULL) - time_last) > 1)
-        {
-            printf(".");
-            fflush(stdout);
-            time_last = time(NULL);
-        }
-        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
-            continue;
-
-        curpath[0] = '\0';
-        strcat(curpath, basepath);
-        idx = pak_file_or_dir(dent, idx, entryFile, stringFile, dataFile, compress, verbose);
-    }
-
-    printf("\nBuilding pak...\n");
-    closedir(dir);
-    fclose(dataFile);
+    char path[FILENAME_MAX];
+    strcpy(path, basepath);
+    write_scanned_dir(tree->root, 0, entryFile, stringFile, path, basepath_len, verbose);
+    scan_free(tree);
     fclose(stringFile);
     fclose(entryFile);
 
-    // now to build the file
-    // first reopen the temp data
+    // read entry table, file entries still need their data fields filled in
     struct stat64 st;
     entryFile = fopen(entryTempPath, "rb");
-    stringFile = fopen(stringTempPath, "rb");
-    dataFile = fopen(dataTempPath, "rb");
-
-    // read entry table
     stat64(entryTempPath, &st);
     size_t entryTableSize = st.st_size;
     size_t entryCount = entryTableSize / sizeof(pak_entry_t);
     char* entryTableBuf = malloc(entryTableSize);
     fread(entryTableBuf, 1, entryTableSize, entryFile);
 
+    if (options->order_file && !apply_order_file(options->order_file))
+        printf("\nUnable to read order file %s, using directory order\n", options->order_file);
+
+    if (compress && options->dictionary_size)
+        train_dictionary(options);
+
+    write_pending_data(entryTableBuf, dataFile, options);
+
+    printf("\nBuilding pak...\n");
+    fclose(dataFile);
+
+    // now to build the file
+    // first reopen the temp data
+    stringFile = fopen(stringTempPath, "rb");
+    dataFile = fopen(dataTempPath, "rb");
+
     // read string table
     stat64(stringTempPath, &st);
     size_t stringTableSize = st.st_size;
@@ -213,59 +830,1030 @@ void make_pak(char *input, char *output, bool compress, bool verbose) {
     fclose(entryFile);
     fclose(stringFile);
 
-    // TODO: Make this manageable
-    pak_set_entry_start(handle, (sizeof(pak_header_t) + 31) & ~31);
-    pak_set_entry_count(handle, entryCount);
-    pak_set_string_table_offset(handle, (handle->header->entry_start + entryTableSize + 31) & ~31);
-    pak_set_string_table_size(handle, stringTableSize);
-    pak_set_data_offset(handle, (handle->header->string_table_offset + stringTableSize + 31) & ~31);
+    uint64_t shardCount = 1;
+    if (options->shard_size) {
+        uint64_t firstShardSize;
+        shardCount = split_shards(entryTableBuf, entryCount, blocks, block_count, dataFile, dataTableSize,
+                                  options->shard_size, output, &firstShardSize);
+        dataTableSize = firstShardSize;
+        if (shardCount > 1)
+            pak_set_shard_count(handle, shardCount);
+    }
 
-    // pad buffers
-    size_t paddedEntryBufSize = (entryTableSize + 31) & ~31;
-    char* paddedEntryBuf = malloc(paddedEntryBufSize);
-    pak_clear(paddedEntryBuf, paddedEntryBufSize);
-    memcpy(paddedEntryBuf, entryTableBuf, entryTableSize);
+    qsort(checkpoints, checkpoint_count, sizeof(pak_checkpoint_t), compare_checkpoint);
+    write_pak(handle, entryTableBuf, entryCount, stringTableBuf, stringTableSize, blocks, block_count,
+              dictionary_buf, dictionary_len, checkpoints, checkpoint_count, content_hash_table(entryCount),
+              dataFile, dataTableSize);
+    content_hash_free();
     free(entryTableBuf);
+    free(stringTableBuf);
+    free(blocks);
+    blocks = NULL;
+    block_count = 0;
+    block_capacity = 0;
+    free(dictionary_buf);
+    dictionary_buf = NULL;
+    dictionary_len = 0;
+    free(checkpoints);
+    checkpoints = NULL;
+    checkpoint_count = 0;
+    checkpoint_capacity = 0;
 
-    size_t paddedStringBufSize = (stringTableSize + 31) & ~31;
-    char* paddedStringBuf = malloc(paddedStringBufSize);
+    fclose(dataFile);
 
-    pak_clear(paddedStringBuf, paddedStringBufSize);
-    memcpy(paddedStringBuf, stringTableBuf, stringTableSize);
-    free(stringTableBuf);
+    printf("Stored %" PRIu64 " files (%s)\n", pak_get_entry_count(handle), (compress ? "compressed" : "uncompressed"));
+    if (intern_shared)
+        printf("Shared the string table slots of %zu repeated names\n", intern_shared);
+    intern_free();
+    if (policy_stored_count)
+        printf("Stored %zu files without trying to compress them\n", policy_stored_count);
+    policy_stored_count = 0;
+    if (pak_get_block_count(handle))
+        printf("Packed small files into %" PRIu64 " solid blocks\n", pak_get_block_count(handle));
+    if (shardCount > 1)
+        printf("Split file data over %" PRIu64 " shards\n", shardCount);
+    pak_close(handle);
+    remove(entryTempPath);
+    remove(stringTempPath);
+    remove(dataTempPath);
+}
 
-    // write pak
-    FILE* pak = handle->file;
-    if (pak)
+// Streamed input arrives in no particular order, so the tree is kept in memory and only becomes
+// an entry table once the input has ended
+typedef struct _stream_node {
+    char* name;
+    struct _stream_node* parent;
+    struct _stream_node* first_child;
+    struct _stream_node* last_child;
+    struct _stream_node* next;
+    uint64_t child_count;
+    uint64_t sequence;          // keys the file's checkpoints until it has an index
+    pak_entry_t entry;
+    bool is_dir;
+} stream_node_t;
+
+// every node but the root, open addressing on parent and name
+static stream_node_t** stream_table = NULL;
+static size_t stream_table_capacity = 0;
+static size_t stream_node_count = 0;
+static uint64_t stream_sequence = 0;
+
+static size_t stream_slot(const stream_node_t* parent, const char* name, size_t len) {
+    uint64_t hash = pak_hash_name(name, len) ^ ((uint64_t)(uintptr_t)parent * 0x9E3779B97F4A7C15ull);
+    return (hash ^ (hash >> 29)) & (stream_table_capacity - 1);
+}
+
+static void stream_grow(void) {
+    stream_node_t** old = stream_table;
+    size_t old_capacity = stream_table_capacity;
+    stream_table_capacity = old_capacity ? old_capacity * 2 : 4096;
+    stream_table = calloc(stream_table_capacity, sizeof(stream_node_t*));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i])
+            continue;
+        size_t slot = stream_slot(old[i]->parent, old[i]->name, strlen(old[i]->name));
+        while (stream_table[slot])
+            slot = (slot + 1) & (stream_table_capacity - 1);
+        stream_table[slot] = old[i];
+    }
+    free(old);
+}
+
+static stream_node_t* stream_lookup(const stream_node_t* parent, const char* name, size_t len) {
+    if (!stream_table_capacity)
+        return NULL;
+    size_t slot = stream_slot(parent, name, len);
+    while (stream_table[slot]) {
+        stream_node_t* node = stream_table[slot];
+        if (node->parent == parent && !strncmp(node->name, name, len) && !node->name[len])
+            return node;
+        slot = (slot + 1) & (stream_table_capacity - 1);
+    }
+    return NULL;
+}
+
+// Finds or creates the child called name, NULL if it exists as the other kind
+static stream_node_t* stream_child(stream_node_t* parent, const char* name, size_t len, bool is_dir) {
+    if ((stream_node_count + 1) * 2 > stream_table_capacity)
+        stream_grow();
+
+    stream_node_t* existing = stream_lookup(parent, name, len);
+    if (existing)
+        return existing->is_dir == is_dir ? existing : NULL;
+    size_t slot = stream_slot(parent, name, len);
+    while (stream_table[slot])
+        slot = (slot + 1) & (stream_table_capacity - 1);
+
+    stream_node_t* node = calloc(1, sizeof(stream_node_t));
+    node->name = strndup(name, len);
+    node->parent = parent;
+    node->is_dir = is_dir;
+    pak_clear(&node->entry, sizeof(pak_entry_t));
+    node->entry.shard = 0;
+    node->entry.data_offset_or_first_child = 0;
+    node->entry.data_size_or_child_count = 0;
+    if (is_dir) {
+        node->entry.flags = PAK_ENTRY_FLAGS_WRITEABLE | PAK_ENTRY_FLAGS_DIR;
+    } else {
+        node->entry.flags = PAK_ENTRY_FLAGS_WRITEABLE;
+        node->entry.data_uncompressed_size = 0;
+    }
+
+    if (parent->last_child)
+        parent->last_child->next = node;
+    else
+        parent->first_child = node;
+    parent->last_child = node;
+    parent->child_count++;
+
+    stream_table[slot] = node;
+    stream_node_count++;
+    return node;
+}
+
+// Skips empty and "." components, returns the next one or NULL at the end of path
+static const char* stream_component(const char* pos, size_t* len) {
+    for (;;) {
+        while (*pos == '/')
+            pos++;
+        if (!*pos)
+            return NULL;
+        *len = strcspn(pos, "/");
+        if (*len != 1 || pos[0] != '.')
+            return pos;
+        pos++;
+    }
+}
+
+// Finds or creates path below root along with its parent directories. Returns NULL for paths that
+// are empty or leave the root, and where a file and a directory clash.
+static stream_node_t* stream_add(stream_node_t* root, const char* path, bool is_dir) {
+    size_t len;
+    const char* name = stream_component(path, &len);
+    stream_node_t* node = NULL;
+    stream_node_t* parent = root;
+    while (name) {
+        if (len == 2 && name[0] == '.' && name[1] == '.')
+            return NULL;
+        size_t next_len;
+        const char* next = stream_component(name + len, &next_len);
+        node = stream_child(parent, name, len, next ? true : is_dir);
+        if (!node)
+            return NULL;
+        parent = node;
+        name = next;
+        len = next_len;
+    }
+    return node;
+}
+
+// Finds path below root without creating anything, an empty path is root itself
+static stream_node_t* stream_find(stream_node_t* root, const char* path) {
+    size_t len;
+    const char* name = stream_component(path, &len);
+    stream_node_t* node = root;
+    while (name && node) {
+        node = stream_lookup(node, name, len);
+        name = stream_component(name + len, &len);
+    }
+    return node;
+}
+
+// Resolves rel against the first dir_len bytes of dir into out as "/a/b", false if it leaves the root
+static bool stream_resolve(const char* dir, size_t dir_len, const char* rel, char* out) {
+    char* joined = malloc(dir_len + strlen(rel) + 2);
+    sprintf(joined, "%.*s/%s", (int)dir_len, dir, rel);
+    size_t out_len = 0;
+    size_t len;
+    bool ok = true;
+    for (const char* name = stream_component(joined, &len); name && ok; name = stream_component(name + len, &len)) {
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            ok = out_len > 0;
+            while (out_len && out[--out_len] != '/')
+                ;
+        } else if (out_len + len + 2 > FILENAME_MAX) {
+            ok = false;
+        } else {
+            out[out_len++] = '/';
+            memcpy(out + out_len, name, len);
+            out_len += len;
+        }
+    }
+    out[out_len] = '\0';
+    free(joined);
+    return ok;
+}
+
+// Gives node the data target already stored, like a second name for the same inode. Nothing is
+// written, the entry, checkpoints and hash are copied.
+static void stream_link(stream_node_t* node, const stream_node_t* target) {
+    uint64_t hash = content_hash_table(target->sequence + 1)[target->sequence];
+    node->entry = target->entry;
+    node->sequence = stream_sequence++;
+    set_content_hash(node->sequence, hash);
+    size_t count = checkpoint_count;
+    for (size_t i = 0; i < count; i++) {
+        if (checkpoints[i].entry_index != target->sequence)
+            continue;
+        uint64_t offsets[2] = {checkpoints[i].uncompressed_offset, checkpoints[i].compressed_offset};
+        add_checkpoints(node->sequence, offsets, 1);
+    }
+}
+
+// A path that shows up again replaces the earlier copy, whose data stays behind unreferenced
+static void stream_write_file(stream_node_t* node, const char* path, char* buf, size_t len, FILE* out,
+                              const make_pak_options_t* options) {
+    if ((time(NULL) - time_last) > 1 && !options->verbose)
     {
-        fwrite(handle->header, 1, sizeof(pak_header_t), pak);
-        fseeko64(pak, (sizeof(pak_header_t) + 31) & ~31, SEEK_SET);
-        fwrite(paddedEntryBuf, 1, paddedEntryBufSize, pak);
-        fwrite(paddedStringBuf, 1, paddedStringBufSize, pak);
-
-        size_t bytesRead = 0;
-        size_t blockSize = BUF_SIZ;
-        while(bytesRead < dataTableSize)
-        {
-            if (blockSize > dataTableSize - bytesRead)
-                blockSize = dataTableSize - bytesRead;
-            char buf[blockSize];
-            size_t nextReadSize = fread(buf, 1, blockSize, dataFile);
-            if (nextReadSize <= 0)
-                break;  // error or early EOF!
+        printf(".");
+        fflush(stdout);
+        time_last = time(NULL);
+    }
+    if (options->verbose)
+        printf("%s\n", path);
+
+    node->entry.flags = PAK_ENTRY_FLAGS_WRITEABLE;
+    node->entry.data_uncompressed_size = 0;
+    node->sequence = stream_sequence++;
+    write_file_data(path, node->sequence, buf, len, &node->entry, out, options);
+}
+
+// Symlinks may point at entries further down the archive, so they're resolved once it has ended.
+// Directory mode follows links to files the same way, the rest can't be expressed in a pak and is reported.
+static void stream_tar_symlinks(stream_node_t* root, char** links, size_t count, const make_pak_options_t* options) {
+    char* target = malloc(FILENAME_MAX);
+    // chains of links resolve over several passes
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (size_t i = 0; i < count; i++) {
+            const char* path = links[i * 2];
+            const char* link = links[i * 2 + 1];
+            if (!path)
+                continue;
+            const char* slash = strrchr(path, '/');
+            if (link[0] == '/' || !stream_resolve(path, slash ? slash - path : 0, link, target))
+                continue;
+            stream_node_t* node = stream_find(root, target);
+            if (!node || node == root || node->is_dir)
+                continue;
+            stream_node_t* linked = stream_add(root, path, false);
+            if (linked && linked != node) {
+                if (options->verbose)
+                    printf("%s\n", path);
+                stream_link(linked, node);
+            } else {
+                printf("\nSkipped %s\n", path);
+            }
+            free(links[i * 2]);
+            links[i * 2] = NULL;
+            progress = true;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char* path = links[i * 2];
+        const char* link = links[i * 2 + 1];
+        if (!path)
+            continue;
+        const char* slash = strrchr(path, '/');
+        const char* reason = "it doesn't exist in the archive";
+        if (link[0] == '/' || !stream_resolve(path, slash ? slash - path : 0, link, target)) {
+            reason = "it leaves the archive";
+        } else {
+            stream_node_t* node = stream_find(root, target);
+            if (node == root || (node && node->is_dir))
+                reason = "it's a directory";
+        }
+        printf("\nSkipped symlink %s -> %s, %s\n", path, link, reason);
+    }
+    free(target);
+}
+
+static bool stream_tar(FILE* in, stream_node_t* root, FILE* out, const make_pak_options_t* options) {
+    tar_entry_t* te = malloc(sizeof(tar_entry_t));
+    char** links = NULL;        // symlink path and target pairs
+    size_t link_count = 0;
+    bool ok = true;
+    int ret;
+    while (ok && (ret = tar_next(in, te)) == TAR_NEXT_ENTRY) {
+        if (te->type == TAR_TYPE_DIR) {
+            stream_add(root, te->path, true);
+            continue;
+        }
+        if (te->type == TAR_TYPE_OTHER) {
+            if (options->verbose)
+                printf("%s\nskipped\n", te->path);
+            continue;
+        }
+        if (te->type == TAR_TYPE_SYMLINK) {
+            links = realloc(links, (link_count + 1) * 2 * sizeof(char*));
+            links[link_count * 2] = strdup(te->path);
+            links[link_count * 2 + 1] = strdup(te->link);
+            link_count++;
+            continue;
+        }
+        if (te->type == TAR_TYPE_HARDLINK) {
+            // tar only stores the data under the first name, the target comes earlier in the archive
+            stream_node_t* target = stream_find(root, te->link);
+            if (!target || target == root || target->is_dir) {
+                printf("\nHard link %s points at %s, which isn't a file earlier in the archive\n", te->path, te->link);
+                ok = false;
+                continue;
+            }
+            stream_node_t* node = stream_add(root, te->path, false);
+            if (!node) {
+                printf("\nSkipped %s\n", te->path);
+                continue;
+            }
+            if (node != target) {
+                if (options->verbose)
+                    printf("%s\n", te->path);
+                stream_link(node, target);
+            }
+            continue;
+        }
+
+        char* buf = malloc(te->size + 1);
+        if (!tar_read_data(in, te, buf)) {
+            printf("\nTruncated tar archive in %s\n", te->path);
+            free(buf);
+            ok = false;
+            continue;
+        }
+        stream_node_t* node = stream_add(root, te->path, false);
+        if (!node) {
+            printf("\nSkipped %s\n", te->path);
+            free(buf);
+            continue;
+        }
+        stream_write_file(node, te->path, buf, te->size, out, options);
+    }
+    if (ok && ret == TAR_NEXT_ERROR) {
+        printf("\nDamaged or truncated tar archive\n");
+        ok = false;
+    }
+    if (ok)
+        stream_tar_symlinks(root, links, link_count, options);
+    for (size_t i = 0; i < link_count * 2; i++)
+        free(links[i]);
+    free(links);
+    free(te);
+    return ok && !ferror(in);
+}
+
+// Bad lines and unreadable sources fail the whole build, like unreadable files in directory mode
+static bool stream_manifest(FILE* in, stream_node_t* root, FILE* out, const make_pak_options_t* options) {
+    char* line = NULL;
+    size_t capacity = 0;
+    bool ok = true;
+    while (ok && getline(&line, &capacity, in) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!line[0])
+            continue;
+        char* tab = strchr(line, '\t');
+        if (!tab) {
+            printf("\nBad manifest line: %s\n", line);
+            ok = false;
+            continue;
+        }
+        *tab = '\0';
+
+        char* buf;
+        size_t len;
+        if (!read_whole_file(tab + 1, &buf, &len)) {
+            printf("\nUnable to read %s\n", tab + 1);
+            ok = false;
+            continue;
+        }
+        stream_node_t* node = stream_add(root, line, false);
+        if (!node) {
+            printf("\nSkipped %s\n", line);
+            free(buf);
+            continue;
+        }
+        stream_write_file(node, line, buf, len, out, options);
+    }
+    free(line);
+    return ok && !ferror(in);
+}
+
+static void stream_scanned_dir(const scan_dir_t* dir, stream_node_t* node, char* path, size_t path_len, FILE* out,
+                               const make_pak_options_t* options) {
+    for (size_t i = 0; i < dir->child_count; i++) {
+        const scan_child_t* child = &dir->children[i];
+        size_t name_len = strlen(child->name);
+        if (path_len + name_len + 2 > FILENAME_MAX) {
+            printf("\nPath too long: %s/%s\n", path, child->name);
+            exit(EXIT_FAILURE);
+        }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, child->name, name_len + 1);
+
+        if (child->dir) {
+            stream_node_t* sub = stream_child(node, child->name, name_len, true);
+            stream_scanned_dir(child->dir, sub, path, path_len + 1 + name_len, out, options);
+            continue;
+        }
+
+        char* buf;
+        size_t len;
+        if (!read_whole_file(path, &buf, &len)) {
+            printf("\nUnable to read %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        stream_write_file(stream_child(node, child->name, name_len, false), path, buf, len, out, options);
+    }
+    path[path_len] = '\0';
+}
+
+// Numbers the tree depth first, the same order write_scanned_dir writes entries in
+static uint64_t stream_flatten(const stream_node_t* dir, uint64_t idx, pak_entry_t* entries, FILE* stringFile,
+                               uint64_t* sequenceIndex) {
+    for (const stream_node_t* node = dir->first_child; node; node = node->next) {
+        pak_entry_t* entry = &entries[idx];
+        *entry = node->entry;
+        entry->string_offset = intern_string(stringFile, node->name, strlen(node->name));
 
-            fwrite(buf, 1, nextReadSize, pak);
-            bytesRead += nextReadSize;
+        if (node->is_dir) {
+            if (node->child_count) {
+                entry->data_offset_or_first_child = idx + 1;
+                entry->data_size_or_child_count = node->child_count;
+            }
+            idx = stream_flatten(node, idx + 1, entries, stringFile, sequenceIndex);
+        } else {
+            sequenceIndex[node->sequence] = idx;
+            idx++;
         }
     }
+    return idx;
+}
+
+static void stream_free(void) {
+    for (size_t i = 0; i < stream_table_capacity; i++) {
+        if (!stream_table[i])
+            continue;
+        free(stream_table[i]->name);
+        free(stream_table[i]);
+    }
+    free(stream_table);
+    stream_table = NULL;
+    stream_table_capacity = 0;
+    stream_node_count = 0;
+    stream_sequence = 0;
+}
+
+static FILE* stream_open_output(const char* output) {
+    FILE* out;
+    if (!strcmp(output, "-")) {
+        // the pak takes over stdout, messages go to stderr instead
+        int fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        out = fd < 0 ? NULL : fdopen(fd, "wb");
+    } else {
+        out = fopen(output, "wb");
+    }
+    if (!out) {
+        printf("Unable to write %s\n", output);
+        exit(EXIT_FAILURE);
+    }
+    return out;
+}
+
+static pak_handle_t* stream_begin(FILE* out, const make_pak_options_t* options) {
+    time_last = time(NULL);
+    data_written = 0;
 
+    if (options->order_file)
+        printf("Streamed paks store files in input order, ignoring %s\n", options->order_file);
+    if (options->dictionary_size)
+        printf("Streamed paks can't train a dictionary, ignoring it\n");
+    if (options->shard_size)
+        printf("Streamed paks can't be split into shards, ignoring the shard size\n");
+
+    pak_handle_t* handle = pak_open_write_stream(out);
+    if (options->endian == TARGET_ENDIAN_BIG)
+        pak_set_endian(handle, BigEndian);
+    else if (options->endian == TARGET_ENDIAN_LITTLE)
+        pak_set_endian(handle, LittleEndian);
+    pak_set_data_offset(handle, PAK_TRAILER_SIZE);
+    pak_write_placeholder(handle);
+    return handle;
+}
+
+// Writes the tables and the trailer once everything below root has been streamed, then closes handle
+static void stream_finish(pak_handle_t* handle, FILE* out, stream_node_t* root, const char* output,
+                          const make_pak_options_t* options) {
+    flush_solid_block(out);
+    free(solid_buf);
+    solid_buf = NULL;
+
+    printf("\nBuilding tables...\n");
+    pak_entry_t* entryTable = malloc((stream_node_count ? stream_node_count : 1) * sizeof(pak_entry_t));
+    uint64_t* sequenceIndex = malloc((stream_sequence ? stream_sequence : 1) * sizeof(uint64_t));
+    memset(sequenceIndex, 0xFF, stream_sequence * sizeof(uint64_t));
+    char* stringTable = NULL;
+    size_t stringTableSize = 0;
+    FILE* stringFile = open_memstream(&stringTable, &stringTableSize);
+    size_t entryCount = stream_flatten(root, 0, entryTable, stringFile, sequenceIndex);
+    fclose(stringFile);
+
+    // checkpoints were keyed by sequence, the ones of replaced files go
+    size_t kept = 0;
+    for (size_t i = 0; i < checkpoint_count; i++) {
+        uint64_t idx = sequenceIndex[checkpoints[i].entry_index];
+        if (idx == UINT64_MAX)
+            continue;
+        checkpoints[kept] = checkpoints[i];
+        checkpoints[kept++].entry_index = idx;
+    }
+    checkpoint_count = kept;
+    qsort(checkpoints, checkpoint_count, sizeof(pak_checkpoint_t), compare_checkpoint);
+
+    // so were the hashes
+    uint64_t* hashTable = calloc(entryCount ? entryCount : 1, sizeof(uint64_t));
+    content_hash_table(stream_sequence);
+    for (uint64_t i = 0; i < stream_sequence; i++) {
+        if (sequenceIndex[i] != UINT64_MAX)
+            hashTable[sequenceIndex[i]] = content_hashes[i];
+    }
+    content_hash_free();
+
+    layout_tables(handle, PAK_TRAILER_SIZE + data_written, entryCount, stringTableSize, block_count, 0, checkpoint_count, true);
+    write_tables(handle, out, entryTable, entryCount, stringTable, stringTableSize, blocks, block_count,
+                 NULL, 0, checkpoints, checkpoint_count, hashTable);
+    free(hashTable);
+    if (!pak_write_trailer(handle) || fflush(out) || ferror(out)) {
+        printf("Unable to write %s\n", output);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Stored %" PRIu64 " files (%s)\n", pak_get_entry_count(handle), (options->compress ? "compressed" : "uncompressed"));
+    if (intern_shared)
+        printf("Shared the string table slots of %zu repeated names\n", intern_shared);
+    intern_free();
+    if (policy_stored_count)
+        printf("Stored %zu files without trying to compress them\n", policy_stored_count);
+    policy_stored_count = 0;
+    if (pak_get_block_count(handle))
+        printf("Packed small files into %" PRIu64 " solid blocks\n", pak_get_block_count(handle));
+    pak_close(handle);
+
+    free(entryTable);
+    free(sequenceIndex);
+    free(stringTable);
+    stream_free();
+    free(blocks);
+    blocks = NULL;
+    block_count = 0;
+    block_capacity = 0;
+    free(checkpoints);
+    checkpoints = NULL;
+    checkpoint_count = 0;
+    checkpoint_capacity = 0;
+}
+
+// The data goes out as it is read, right behind a placeholder header. Once the input ends the tables
+// follow the data and the real header is appended as a trailer, see pak_write_trailer.
+void stream_pak(char* input, char* output, const make_pak_options_t* options) {
+    FILE* out = stream_open_output(output);
+    pak_handle_t* handle = stream_begin(out, options);
+
+    printf("Streaming file data...");
+    fflush(stdout);
+
+    stream_node_t root;
+    memset(&root, 0, sizeof(stream_node_t));
+    bool ok;
+    if (options->manifest) {
+        FILE* in = strcmp(input, "-") ? fopen(input, "r") : stdin;
+        ok = in && stream_manifest(in, &root, out, options);
+        if (in && in != stdin)
+            fclose(in);
+    } else if (!strcmp(input, "-")) {
+        ok = stream_tar(stdin, &root, out, options);
+    } else {
+        scan_tree_t* tree = scan_tree(input, 0);
+        ok = tree && strlen(input) < FILENAME_MAX;
+        if (ok) {
+            char path[FILENAME_MAX];
+            strcpy(path, input);
+            stream_scanned_dir(tree->root, &root, path, strlen(input), out, options);
+        }
+        scan_free(tree);
+    }
+    if (!ok) {
+        printf("\nUnable to read %s\n", input);
+        exit(EXIT_FAILURE);
+    }
+    stream_finish(handle, out, &root, output, options);
+}
+
+// Rewrites a pak in the current format, file data is copied as is since its offsets are relative to data_offset
+bool convert_pak(char* input, char* output, const make_pak_options_t* options) {
+    pak_handle_t* source = pak_open_read(input);
+    if (!source) {
+        printf("Unable to open %s\n", input);
+        return false;
+    }
+
+    struct stat64 st;
+    if (stat64(input, &st) || (uint64_t)st.st_size < pak_get_data_offset(source)) {
+        pak_close(source);
+        return false;
+    }
+    uint64_t dataTableSize = st.st_size - pak_get_data_offset(source);
+    // streamed paks keep their tables after the data
+    if (pak_get_entry_start(source) > pak_get_data_offset(source))
+        dataTableSize = pak_get_entry_start(source) - pak_get_data_offset(source);
+
+    remove(output);
+    pak_handle_t* handle = pak_open_write(output);
+    if (!handle) {
+        pak_close(source);
+        return false;
+    }
+    if (options->endian == TARGET_ENDIAN_BIG)
+        pak_set_endian(handle, BigEndian);
+    else if (options->endian == TARGET_ENDIAN_LITTLE)
+        pak_set_endian(handle, LittleEndian);
+    else
+        pak_set_endian(handle, pak_get_endian(source));
+
+    // shards only hold file data, they carry over byte for byte
+    uint64_t shardCount = pak_get_shard_count(source);
+    for (uint64_t i = 1; i < shardCount; i++) {
+        char from[FILENAME_MAX];
+        char to[FILENAME_MAX];
+        FILE* fromFile = NULL;
+        FILE* toFile = NULL;
+        if (pak_shard_path(input, i, from, sizeof(from)) && pak_shard_path(output, i, to, sizeof(to))) {
+            fromFile = fopen(from, "rb");
+            toFile = fopen(to, "wb");
+        }
+        if (!fromFile || !toFile || stat64(from, &st)) {
+            printf("Unable to copy shard %" PRIu64 "\n", i);
+            if (fromFile)
+                fclose(fromFile);
+            if (toFile)
+                fclose(toFile);
+            pak_close(handle);
+            pak_close(source);
+            return false;
+        }
+        copy_data(fromFile, toFile, st.st_size);
+        fclose(fromFile);
+        fclose(toFile);
+    }
+    if (shardCount > 1)
+        pak_set_shard_count(handle, shardCount);
+
+    // names are interned again, paks from before that shrink
+    uint64_t entryCount = pak_get_entry_count(source);
+    pak_entry_t* entryTable = malloc(entryCount * sizeof(pak_entry_t));
+    memcpy(entryTable, source->entry_table_data, entryCount * sizeof(pak_entry_t));
+    char* stringTable = NULL;
+    size_t stringTableSize = 0;
+    FILE* stringFile = open_memstream(&stringTable, &stringTableSize);
+    for (uint64_t i = 0; i < entryCount; i++) {
+        const char* name = pak_get_string_from_index(source, i);
+        entryTable[i].string_offset = intern_string(stringFile, name, strlen(name));
+    }
+    fclose(stringFile);
+
+    // paks from before 0.8 are decoded once to hash their files
+    uint64_t* hashTable = source->hash_table_data;
+    if (!hashTable) {
+        hashTable = calloc(entryCount ? entryCount : 1, sizeof(uint64_t));
+        for (uint64_t i = 0; i < entryCount; i++) {
+            if (PAK_ENTRY_IS_DIR(&entryTable[i]))
+                continue;
+            uint64_t size = pak_get_entry_size(&entryTable[i]);
+            char* buf = malloc(size ? size : 1);
+            if (pak_read_index(source, i, buf, 0, size) != (int64_t)size) {
+                printf("Unable to read entry %" PRIu64 " of %s\n", i, input);
+                free(buf);
+                free(hashTable);
+                free(entryTable);
+                free(stringTable);
+                pak_close(handle);
+                pak_close(source);
+                return false;
+            }
+            hashTable[i] = pak_hash_data(buf, size);
+            free(buf);
+        }
+    }
+
+    uint32_t version = pak_get_version(source);
+    FILE* dataFile = fopen(input, "rb");
+    fseeko64(dataFile, pak_get_data_offset(source), SEEK_SET);
+    write_pak(handle, entryTable, entryCount, stringTable, stringTableSize,
+              source->block_table_data, pak_get_block_count(source),
+              source->dictionary_data, pak_get_dictionary_size(source),
+              source->checkpoint_table_data, pak_get_checkpoint_count(source), hashTable,
+              dataFile, dataTableSize);
     fclose(dataFile);
+    if (hashTable != source->hash_table_data)
+        free(hashTable);
+    free(entryTable);
+    free(stringTable);
 
-    printf("Stored %" PRIu64 " files (%s)\n", pak_get_entry_count(handle), (compress ? "compressed" : "uncompressed"));
+    printf("Converted %" PRIu64 " entries from version %u.%u to %u.%u\n", pak_get_entry_count(handle),
+           PAK_VERSION_GET_MAJOR(version), PAK_VERSION_GET_MINOR(version), PAK_VERSION_MAJOR, PAK_VERSION_MINOR);
+    if (intern_shared)
+        printf("String table went from %" PRIu64 " to %" PRIu64 " bytes\n", pak_get_string_table_size(source),
+               pak_get_string_table_size(handle));
+    intern_free();
     pak_close(handle);
-    free(paddedEntryBuf);
-    free(paddedStringBuf);
-    remove(entryTempPath);
-    remove(stringTempPath);
-    remove(dataTempPath);
+    pak_close(source);
+    return true;
+}
+
+#define DIFF_CHUNK (256 * 1024)
+
+typedef struct _diff_state {
+    pak_handle_t* old_pak;
+    pak_handle_t* new_pak;
+    bool same_dictionary;       // compressed bytes of the two paks decode the same way
+    stream_node_t* root;        // of the patch
+    FILE* out;
+    FILE* deleted;              // the deletion list, one "/path\n" per line
+    const make_pak_options_t* options;
+    char* old_buf;
+    char* new_buf;
+    bool ok;
+    uint64_t added;
+    uint64_t changed;
+    uint64_t deleted_count;
+    uint64_t unchanged;
+    uint64_t by_hash;
+    uint64_t by_stored;
+    uint64_t by_content;
+} diff_state_t;
+
+static int compare_dirent_name(const void* a, const void* b) {
+    return strcmp(((const pak_dirent_t*)a)->name, ((const pak_dirent_t*)b)->name);
+}
+
+// Children of index, -1 for the root, sorted by name so two paks can be walked side by side
+static pak_dirent_t* diff_children(pak_handle_t* handle, int64_t index, size_t* count) {
+    pak_dir_t dir;
+    *count = 0;
+    if (index < 0 ? !pak_opendir(handle, NULL, &dir) : !pak_opendir_index(handle, index, &dir))
+        return NULL;
+
+    size_t capacity = 16;
+    pak_dirent_t* ents = malloc(capacity * sizeof(pak_dirent_t));
+    while (pak_readdir(&dir, &ents[*count])) {
+        if (++*count == capacity) {
+            capacity *= 2;
+            ents = realloc(ents, capacity * sizeof(pak_dirent_t));
+        }
+    }
+    qsort(ents, *count, sizeof(pak_dirent_t), compare_dirent_name);
+    return ents;
+}
+
+// Compares the decoded contents chunk by chunk, 1 if they match, 0 if not and -1 if either can't be read
+static int diff_same_content(diff_state_t* state, uint64_t old_index, uint64_t new_index, uint64_t size) {
+    pak_file_t* old_file = pak_open_index(state->old_pak, old_index);
+    pak_file_t* new_file = pak_open_index(state->new_pak, new_index);
+    int ret = old_file && new_file ? 1 : -1;
+    for (uint64_t pos = 0; ret == 1 && pos < size; pos += DIFF_CHUNK) {
+        uint64_t chunk = size - pos < DIFF_CHUNK ? size - pos : DIFF_CHUNK;
+        if (pak_file_read(old_file, state->old_buf, chunk) != (int64_t)chunk ||
+            pak_file_read(new_file, state->new_buf, chunk) != (int64_t)chunk)
+            ret = -1;
+        else if (memcmp(state->old_buf, state->new_buf, chunk))
+            ret = 0;
+    }
+    if (old_file)
+        pak_close_file(old_file);
+    if (new_file)
+        pak_close_file(new_file);
+    return ret;
+}
+
+// Cheapest first: decoded size, then the hash tables when both paks have one, then the stored bytes
+// when both are stored the same way. Only what's left gets decoded.
+static int diff_same(diff_state_t* state, const pak_dirent_t* old_ent, const pak_dirent_t* new_ent) {
+    uint64_t size = pak_get_entry_size(old_ent->entry);
+    if (size != pak_get_entry_size(new_ent->entry))
+        return 0;
+
+    uint64_t old_hash, new_hash;
+    if (pak_get_entry_hash(state->old_pak, old_ent->index, &old_hash) &&
+        pak_get_entry_hash(state->new_pak, new_ent->index, &new_hash)) {
+        state->by_hash++;
+        return old_hash == new_hash;
+    }
+
+    const pak_entry_t* old_entry = old_ent->entry;
+    const pak_entry_t* new_entry = new_ent->entry;
+    bool compressed = old_entry->flags & PAK_ENTRY_FLAGS_COMPRESSED;
+    if (!(old_entry->flags & PAK_ENTRY_FLAGS_SOLID) && !(new_entry->flags & PAK_ENTRY_FLAGS_SOLID) &&
+        compressed == !!(new_entry->flags & PAK_ENTRY_FLAGS_COMPRESSED) &&
+        old_entry->data_size_or_child_count == new_entry->data_size_or_child_count &&
+        (!compressed || state->same_dictionary)) {
+        uint64_t stored = old_entry->data_size_or_child_count;
+        int ret = 1;
+        for (uint64_t pos = 0; ret == 1 && pos < stored; pos += DIFF_CHUNK) {
+            uint64_t chunk = stored - pos < DIFF_CHUNK ? stored - pos : DIFF_CHUNK;
+            if (pak_read_stored(state->old_pak, old_ent->index, state->old_buf, pos, chunk) != (int64_t)chunk ||
+                pak_read_stored(state->new_pak, new_ent->index, state->new_buf, pos, chunk) != (int64_t)chunk)
+                ret = -1;
+            else if (memcmp(state->old_buf, state->new_buf, chunk))
+                ret = 0;
+        }
+        // the same data compressed at another level differs without having changed
+        if (ret == 1 || (ret == 0 && !compressed)) {
+            state->by_stored++;
+            return ret;
+        }
+    }
+
+    state->by_content++;
+    return diff_same_content(state, old_ent->index, new_ent->index, size);
+}
+
+static void diff_add(diff_state_t* state, const pak_dirent_t* ent, char* path, size_t path_len);
+
+static void diff_add_file(diff_state_t* state, const pak_dirent_t* ent, const char* path) {
+    uint64_t size = pak_get_entry_size(ent->entry);
+    char* buf = malloc(size ? size : 1);
+    stream_node_t* node = stream_add(state->root, path, false);
+    if (!node || pak_read_index(state->new_pak, ent->index, buf, 0, size) != (int64_t)size) {
+        printf("\nUnable to read %s\n", path);
+        free(buf);
+        state->ok = false;
+        return;
+    }
+    stream_write_file(node, path, buf, size, state->out, state->options);
+}
+
+static void diff_add_children(diff_state_t* state, int64_t index, char* path, size_t path_len) {
+    size_t count;
+    pak_dirent_t* ents = diff_children(state->new_pak, index, &count);
+    for (size_t i = 0; i < count && state->ok; i++)
+        diff_add(state, &ents[i], path, path_len);
+    free(ents);
+}
+
+// Puts ent and everything below it into the patch, path holds its parent's path
+static void diff_add(diff_state_t* state, const pak_dirent_t* ent, char* path, size_t path_len) {
+    size_t name_len = strlen(ent->name);
+    if (path_len + name_len + 2 > FILENAME_MAX) {
+        printf("\nPath too long below %s\n", path_len ? path : "/");
+        state->ok = false;
+        return;
+    }
+    path[path_len] = '/';
+    memcpy(path + path_len + 1, ent->name, name_len + 1);
+    path_len += name_len + 1;
+
+    if (ent->is_dir) {
+        // kept even when empty
+        stream_add(state->root, path, true);
+        diff_add_children(state, ent->index, path, path_len);
+    } else {
+        state->added++;
+        diff_add_file(state, ent, path);
+    }
+}
+
+// A removed directory is listed once, everything below it goes with it
+static void diff_delete(diff_state_t* state, const pak_dirent_t* ent, char* path, size_t path_len) {
+    fprintf(state->deleted, "%.*s/%s\n", (int)path_len, path, ent->name);
+    state->deleted_count++;
+}
+
+// Merge walks the sorted children of the same directory in both paks, -1 stands for the root
+static void diff_dir(diff_state_t* state, int64_t old_index, int64_t new_index, char* path, size_t path_len) {
+    size_t old_count, new_count;
+    pak_dirent_t* old_ents = diff_children(state->old_pak, old_index, &old_count);
+    pak_dirent_t* new_ents = diff_children(state->new_pak, new_index, &new_count);
+    size_t i = 0, j = 0;
+    while ((i < old_count || j < new_count) && state->ok) {
+        int cmp = i == old_count ? 1 : j == new_count ? -1 : strcmp(old_ents[i].name, new_ents[j].name);
+        if (cmp < 0) {
+            diff_delete(state, &old_ents[i++], path, path_len);
+            continue;
+        }
+        if (cmp > 0) {
+            diff_add(state, &new_ents[j++], path, path_len);
+            continue;
+        }
+
+        const pak_dirent_t* old_ent = &old_ents[i++];
+        const pak_dirent_t* new_ent = &new_ents[j++];
+        if (old_ent->is_dir != new_ent->is_dir) {
+            // a file became a directory or the other way around, the old one has to go first
+            diff_delete(state, old_ent, path, path_len);
+            diff_add(state, new_ent, path, path_len);
+            continue;
+        }
+
+        size_t name_len = strlen(new_ent->name);
+        if (path_len + name_len + 2 > FILENAME_MAX) {
+            printf("\nPath too long below %s\n", path_len ? path : "/");
+            state->ok = false;
+            break;
+        }
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, new_ent->name, name_len + 1);
+
+        if (new_ent->is_dir) {
+            diff_dir(state, old_ent->index, new_ent->index, path, path_len + name_len + 1);
+            continue;
+        }
+
+        int same = diff_same(state, old_ent, new_ent);
+        if (same < 0) {
+            printf("\nUnable to compare %s\n", path);
+            state->ok = false;
+        } else if (same) {
+            state->unchanged++;
+        } else {
+            state->changed++;
+            diff_add_file(state, new_ent, path);
+        }
+    }
+    path[path_len] = '\0';
+    free(old_ents);
+    free(new_ents);
+}
+
+bool diff_pak(char* old_input, char* new_input, char* output, const make_pak_options_t* options) {
+    // only the tables are needed, the node tree would cost far more than the walk itself
+    diff_state_t state;
+    memset(&state, 0, sizeof(diff_state_t));
+    state.old_pak = pak_open_read_lazy(old_input);
+    if (!state.old_pak) {
+        printf("Unable to open %s\n", old_input);
+        return false;
+    }
+    state.new_pak = pak_open_read_lazy(new_input);
+    if (!state.new_pak) {
+        printf("Unable to open %s\n", new_input);
+        pak_close(state.old_pak);
+        return false;
+    }
+    if (pak_find_index(state.new_pak, "/" PATCH_DELETION_LIST) >= 0) {
+        printf("%s has a /%s of its own, it can't be told apart from the deletion list\n", new_input, PATCH_DELETION_LIST);
+        pak_close(state.old_pak);
+        pak_close(state.new_pak);
+        return false;
+    }
+
+    uint64_t dictionary_size = pak_get_dictionary_size(state.old_pak);
+    state.same_dictionary = dictionary_size == pak_get_dictionary_size(state.new_pak) &&
+                            (!dictionary_size || !memcmp(state.old_pak->dictionary_data, state.new_pak->dictionary_data, dictionary_size));
+
+    FILE* out = stream_open_output(output);
+    pak_handle_t* handle = stream_begin(out, options);
+    printf("Comparing %s to %s...", old_input, new_input);
+    fflush(stdout);
+
+    stream_node_t root;
+    memset(&root, 0, sizeof(stream_node_t));
+    char* deleted = NULL;
+    size_t deleted_len = 0;
+    state.root = &root;
+    state.out = out;
+    state.deleted = open_memstream(&deleted, &deleted_len);
+    state.options = options;
+    state.old_buf = malloc(DIFF_CHUNK);
+    state.new_buf = malloc(DIFF_CHUNK);
+    state.ok = true;
+
+    char path[FILENAME_MAX];
+    path[0] = '\0';
+    diff_dir(&state, -1, -1, path, 0);
+    fclose(state.deleted);
+    free(state.old_buf);
+    free(state.new_buf);
+    pak_close(state.old_pak);
+    pak_close(state.new_pak);
+    if (!state.ok) {
+        free(deleted);
+        pak_close(handle);
+        if (strcmp(output, "-"))
+            unlink(output);
+        return false;
+    }
+
+    // stream_write_file takes the buffer. A pak can't be empty, so a patch with nothing else in it still
+    // gets the (empty) list.
+    if (deleted_len || !root.child_count)
+        stream_write_file(stream_add(&root, "/" PATCH_DELETION_LIST, false), "/" PATCH_DELETION_LIST, deleted, deleted_len, out, options);
+    else
+        free(deleted);
+    stream_finish(handle, out, &root, output, options);
+
+    printf("%" PRIu64 " added, %" PRIu64 " changed, %" PRIu64 " deleted, %" PRIu64 " unchanged\n",
+           state.added, state.changed, state.deleted_count, state.unchanged);
+    printf("Compared %" PRIu64 " files by hash, %" PRIu64 " by stored bytes and %" PRIu64 " by decoding them\n",
+           state.by_hash, state.by_stored, state.by_content);
+    return true;
 }
@@ -0,0 +1,130 @@
+#include "util.h"
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define POLICY_SAMPLE_SIZE      (4 * 1024)
+#define POLICY_SAMPLE_MIN_FILE  (16 * 1024)     // smaller files are cheaper to just compress
+#define POLICY_MAX_ENTROPY      7.9             // bits per byte, above this the data is already packed
+#define POLICY_MIN_SAVINGS      0.03            // a level 1 trial on the sample has to save at least this much
+
+#define POLICY_SMALL_FILE       (64 * 1024)
+#define POLICY_LARGE_FILE       (8 * 1024 * 1024)
+
+static const char* stored_extensions[] = {
+    "png", "jpg", "jpeg", "gif", "webp", "ktx2", "basis",
+    "ogg", "opus", "mp3", "m4a", "aac", "flac", "wma",
+    "mp4", "m4v", "mkv", "webm", "mov", "avi", "bik", "bk2", "usm",
+    "zip", "gz", "tgz", "bz2", "xz", "7z", "zst", "lz4", "rar", "jar", "apk", "pak",
+    NULL
+};
+
+typedef struct _policy_magic {
+    size_t offset;
+    size_t len;
+    const char* bytes;
+} policy_magic_t;
+
+static const policy_magic_t stored_magics[] = {
+    {0, 8, "\x89PNG\r\n\x1a\n"},
+    {0, 3, "\xFF\xD8\xFF"},             // jpeg
+    {0, 4, "GIF8"},
+    {8, 4, "WEBP"},
+    {0, 4, "OggS"},
+    {0, 3, "ID3"},
+    {0, 4, "fLaC"},
+    {4, 4, "ftyp"},                     // mp4, mov, m4a
+    {0, 4, "\x1a\x45\xdf\xa3"},         // matroska, webm
+    {0, 3, "BIK"},
+    {0, 3, "KB2"},
+    {0, 4, "PK\x03\x04"},
+    {0, 2, "\x1f\x8b"},                 // gzip
+    {0, 4, "\x28\xb5\x2f\xfd"},         // zstd
+    {0, 6, "\xfd" "7zXZ\x00"},
+    {0, 3, "BZh"},
+    {0, 6, "7z\xbc\xaf\x27\x1c"},
+    {0, 4, "Rar!"},
+    {0, 0, NULL}
+};
+
+static bool policy_has_stored_extension(const char* path) {
+    const char* ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/'))
+        return false;
+
+    ext++;
+    for (int i = 0; stored_extensions[i]; i++) {
+        if (!strcasecmp(ext, stored_extensions[i]))
+            return true;
+    }
+    return false;
+}
+
+static bool policy_has_stored_magic(const uint8_t* buf, size_t len) {
+    for (int i = 0; stored_magics[i].bytes; i++) {
+        const policy_magic_t* magic = &stored_magics[i];
+        if (len >= magic->offset + magic->len && !memcmp(buf + magic->offset, magic->bytes, magic->len))
+            return true;
+    }
+    return false;
+}
+
+static double policy_entropy(const uint8_t* buf, size_t len) {
+    uint32_t counts[256] = {0};
+    for (size_t i = 0; i < len; i++)
+        counts[buf[i]]++;
+
+    double entropy = 0.0;
+    for (int i = 0; i < 256; i++) {
+        if (!counts[i])
+            continue;
+        double p = (double)counts[i] / len;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+// Looks at the start, middle and end of the file, media containers often have a compressible header
+static bool policy_sample_is_incompressible(const uint8_t* buf, size_t len) {
+    uint8_t sample[POLICY_SAMPLE_SIZE * 3];
+    size_t part = POLICY_SAMPLE_SIZE;
+    memcpy(sample, buf, part);
+    memcpy(sample + part, buf + len / 2 - part / 2, part);
+    memcpy(sample + part * 2, buf + len - part, part);
+
+    if (policy_entropy(sample, sizeof(sample)) > POLICY_MAX_ENTROPY)
+        return true;
+
+    uint8_t trial[sizeof(sample)];
+    size_t trial_len = util_compress(sample, sizeof(sample), trial, Z_BEST_SPEED);
+    return trial_len >= sizeof(sample) * (1.0 - POLICY_MIN_SAVINGS);
+}
+
+int32_t policy_choose_level(const char* path, const void* buf, size_t len, const char** reason) {
+    const char* dummy;
+    if (!reason)
+        reason = &dummy;
+
+    if (policy_has_stored_extension(path)) {
+        *reason = "extension";
+        return Z_NO_COMPRESSION;
+    }
+
+    if (policy_has_stored_magic(buf, len)) {
+        *reason = "magic";
+        return Z_NO_COMPRESSION;
+    }
+
+    if (len >= POLICY_SAMPLE_MIN_FILE && policy_sample_is_incompressible(buf, len)) {
+        *reason = "sample";
+        return Z_NO_COMPRESSION;
+    }
+
+    // the best level only pays off while files are small enough for it to be cheap
+    *reason = "size";
+    if (len < POLICY_SMALL_FILE)
+        return Z_BEST_COMPRESSION;
+    if (len < POLICY_LARGE_FILE)
+        return Z_DEFAULT_COMPRESSION;
+    return 4;
+}
@@ -3,48 +3,56 @@
 #include <inttypes.h>
 #include "pak.h"
 
-static char curpath[FILENAME_MAX] = {0};
-
-void print_name_recursive(pak_node_t* node) {
-    char tmp[FILENAME_MAX];
-    strcpy(tmp, curpath);
-    strcat(curpath, "/");
-    strcat(curpath, node->filename);
-    printf("%s", curpath);
-    if (node->parent) {
-        printf(" (parent: %s, file id: %" PRIu64 ")\n", node->parent->filename, node->entry->file_id);
+static int print_entry(pak_handle_t* pak, const char* path, const pak_dirent_t* ent, void* user_data) {
+    (void)user_data;
+    printf("%s", path);
+    if (ent->parent >= 0) {
+        printf(" (parent: %s, file id: %" PRIu64 ")\n", pak_get_string_from_index(pak, ent->parent), ent->index);
     } else {
-        printf(" (file id: %" PRIu64 ")\n", node->entry->file_id);
-    }
-
-    if (node->is_dir) {
-
-        pak_node_t* child = node->child;
-        while (child != NULL) {
-            print_name_recursive(child);
-            child = child->next;
-        }
+        printf(" (file id: %" PRIu64 ")\n", ent->index);
     }
+    return 0;
+}
 
-    strcpy(curpath, tmp);
+static void print_pak_stats(pak_handle_t* pak) {
+#ifdef PAK_ENABLE_STATS
+    pak_stats_t stats;
+    pak_get_stats(pak, &stats);
+    printf("Opened in %.3f ms, %" PRIu64 " bytes read in %" PRIu64 " syscalls (%.3f ms)\n",
+           stats.open_ns / 1e6, stats.bytes_read, stats.syscalls, stats.io_ns / 1e6);
+    printf("%" PRIu64 " lookups (%" PRIu64 " misses, %.3f ms), %" PRIu64 " files opened, %" PRIu64 " reads\n",
+           stats.lookups, stats.lookup_misses, stats.lookup_ns / 1e6, stats.files_opened, stats.reads);
+    printf("%" PRIu64 " bytes decompressed (%.3f ms), %" PRIu64 " cache hits, %" PRIu64 " cache misses\n",
+           stats.bytes_decompressed, stats.decompress_ns / 1e6, stats.cache_hits, stats.cache_misses);
+#else
+    (void)pak;
+    printf("Statistics are disabled in this build\n");
+#endif
 }
 
 void print_pak_info(const char* input) {
     pak_handle_t* pak = pak_open_read(input);
 
     if (pak) {
-        pak_node_t* node = pak->root->next;
-        while (node != NULL) {
-            print_name_recursive(node);
-            node = node->next;
-        }
+        pak_walk(pak, NULL, NULL, print_entry, NULL);
 
         printf("%" PRIu64 " Files in %s\n", pak_get_entry_count(pak), input);
-        printf("Target endian is %s\n", (pak_get_endian(pak) ? "Big" : "Little"));
+        printf("Target endian is %s\n", (pak_get_endian(pak) == BigEndian ? "Big" : "Little"));
         printf("Entry table starts at 0x%.8" PRIX64 "\n", pak_get_entry_start(pak));
         printf("String table starts at 0x%.8" PRIX64 "\n", pak_get_string_table_offset(pak));
         printf("String table is %" PRIu64 " bytes long\n", pak_get_string_table_size(pak));
+        if (pak_get_checkpoint_count(pak))
+            printf("%" PRIu64 " restart points in large compressed files\n", pak_get_checkpoint_count(pak));
+        if (pak_get_shard_count(pak) > 1)
+            printf("File data split over %" PRIu64 " shards\n", pak_get_shard_count(pak));
+        if (pak_get_block_count(pak))
+            printf("%" PRIu64 " solid blocks, block table starts at 0x%.8" PRIX64 "\n", pak_get_block_count(pak), pak_get_block_table_offset(pak));
+        if (pak_get_dictionary_size(pak))
+            printf("%" PRIu64 " byte dictionary starts at 0x%.8" PRIX64 "\n", pak_get_dictionary_size(pak), pak_get_dictionary_offset(pak));
+        if (pak->hash_table_data)
+            printf("Content hash table starts at 0x%.8" PRIX64 "\n", pak_get_hash_table_offset(pak));
         printf("Data table starts at 0x%.8" PRIX64 "\n", pak_get_data_offset(pak));
+        print_pak_stats(pak);
         pak_close(pak);
     } else {
         exit(EXIT_FAILURE);
@@ -0,0 +1,301 @@
+#include "util.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#define SCAN_ARENA_SIZE (1024 * 1024)
+#define SCAN_MAX_THREADS 64
+
+// Names and child arrays come out of per worker arenas, a tree with millions of files would
+// otherwise spend most of its time in malloc
+typedef struct _scan_arena {
+    struct _scan_arena* next;
+    size_t used;
+    size_t size;
+    char data[];
+} scan_arena_t;
+
+// Directories are pushed and popped at the top by their owner, which keeps it depth first,
+// other workers steal from the bottom where the largest unscanned subtrees are
+typedef struct _scan_deque {
+    scan_dir_t** items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    pthread_mutex_t lock;
+} scan_deque_t;
+
+typedef struct _scan_worker {
+    struct _scan* scan;
+    int id;
+    scan_deque_t deque;
+    scan_arena_t* arena;
+    pthread_t thread;
+} scan_worker_t;
+
+typedef struct _scan {
+    scan_worker_t* workers;
+    int worker_count;
+    uint64_t pending;                   // directories queued or being read
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int idle;                           // workers waiting on idle_cond, under idle_lock
+} scan_t;
+
+static void* arena_alloc(scan_arena_t** arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!*arena || (*arena)->used + size > (*arena)->size) {
+        size_t capacity = size > SCAN_ARENA_SIZE ? size : SCAN_ARENA_SIZE;
+        scan_arena_t* next = malloc(sizeof(scan_arena_t) + capacity);
+        next->next = *arena;
+        next->used = 0;
+        next->size = capacity;
+        *arena = next;
+    }
+    void* ret = (*arena)->data + (*arena)->used;
+    (*arena)->used += size;
+    return ret;
+}
+
+static char* arena_strdup(scan_arena_t** arena, const char* str, size_t len) {
+    char* ret = arena_alloc(arena, len + 1);
+    memcpy(ret, str, len + 1);
+    return ret;
+}
+
+static void deque_push(scan_deque_t* deque, scan_dir_t* dir) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // compact before growing, stolen items leave a gap at the bottom
+        if (deque->head) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(scan_dir_t*));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail == deque->capacity) {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 256;
+            deque->items = realloc(deque->items, deque->capacity * sizeof(scan_dir_t*));
+        }
+    }
+    deque->items[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static scan_dir_t* deque_pop(scan_deque_t* deque) {
+    scan_dir_t* ret = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        ret = deque->items[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static scan_dir_t* deque_steal(scan_deque_t* deque) {
+    scan_dir_t* ret = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+        ret = deque->items[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return ret;
+}
+
+static void scan_queue(scan_worker_t* worker, scan_dir_t* dir) {
+    scan_t* scan = worker->scan;
+    __atomic_add_fetch(&scan->pending, 1, __ATOMIC_RELAXED);
+    deque_push(&worker->deque, dir);
+    pthread_mutex_lock(&scan->idle_lock);
+    if (scan->idle)
+        pthread_cond_signal(&scan->idle_cond);
+    pthread_mutex_unlock(&scan->idle_lock);
+}
+
+static void scan_add_child(scan_worker_t* worker, scan_dir_t* dir, const char* name, size_t name_len, scan_dir_t* sub) {
+    if (dir->child_count == dir->child_capacity) {
+        // the old array stays in the arena, directories are scanned once so little is wasted
+        size_t capacity = dir->child_capacity ? dir->child_capacity * 2 : 16;
+        scan_child_t* children = arena_alloc(&worker->arena, capacity * sizeof(scan_child_t));
+        if (dir->child_count)
+            memcpy(children, dir->children, dir->child_count * sizeof(scan_child_t));
+        dir->children = children;
+        dir->child_capacity = capacity;
+    }
+    scan_child_t* child = &dir->children[dir->child_count++];
+    child->name = arena_strdup(&worker->arena, name, name_len);
+    child->dir = sub;
+}
+
+// Lists one directory. d_type saves the stat for most entries, the rest are looked up relative
+// to the directory's fd. Like stat, symlinks are followed.
+static void scan_dir(scan_worker_t* worker, scan_dir_t* dir) {
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+    DIR* handle = fd < 0 ? NULL : fdopendir(fd);
+    if (!handle) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    size_t path_len = strlen(dir->path);
+    struct dirent* dent;
+    while ((dent = readdir(handle)) != NULL) {
+        const char* name = dent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if (dir->depth && !strcmp(name, ".git"))
+            continue;
+
+        bool is_dir;
+        if (dent->d_type == DT_DIR) {
+            is_dir = true;
+        } else if (dent->d_type == DT_REG) {
+            is_dir = false;
+        } else {
+            struct stat64 st;
+            if (fstatat64(fd, name, &st, 0))
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+
+        size_t name_len = strlen(name);
+        scan_dir_t* sub = NULL;
+        if (is_dir) {
+            sub = arena_alloc(&worker->arena, sizeof(scan_dir_t));
+            memset(sub, 0, sizeof(scan_dir_t));
+            sub->depth = dir->depth + 1;
+            sub->path = arena_alloc(&worker->arena, path_len + name_len + 2);
+            memcpy(sub->path, dir->path, path_len);
+            sub->path[path_len] = '/';
+            memcpy(sub->path + path_len + 1, name, name_len + 1);
+        }
+        scan_add_child(worker, dir, name, name_len, sub);
+        if (sub)
+            scan_queue(worker, sub);
+    }
+    closedir(handle);
+}
+
+static scan_dir_t* scan_take(scan_worker_t* worker) {
+    scan_t* scan = worker->scan;
+    scan_dir_t* dir = deque_pop(&worker->deque);
+    for (int i = 1; !dir && i < scan->worker_count; i++)
+        dir = deque_steal(&scan->workers[(worker->id + i) % scan->worker_count].deque);
+    return dir;
+}
+
+// Waits for work while other workers may still queue some, NULL once every directory is read
+static scan_dir_t* scan_next(scan_worker_t* worker) {
+    scan_t* scan = worker->scan;
+    for (;;) {
+        scan_dir_t* dir = scan_take(worker);
+        if (dir)
+            return dir;
+
+        // looking again under the lock means a push can't slip in between the check and the wait
+        pthread_mutex_lock(&scan->idle_lock);
+        dir = scan_take(worker);
+        bool done = !dir && !__atomic_load_n(&scan->pending, __ATOMIC_ACQUIRE);
+        if (!dir && !done) {
+            scan->idle++;
+            pthread_cond_wait(&scan->idle_cond, &scan->idle_lock);
+            scan->idle--;
+        }
+        pthread_mutex_unlock(&scan->idle_lock);
+        if (dir)
+            return dir;
+        if (done)
+            return NULL;
+    }
+}
+
+static void* scan_thread(void* arg) {
+    scan_worker_t* worker = arg;
+    scan_t* scan = worker->scan;
+    scan_dir_t* dir;
+    while ((dir = scan_next(worker)) != NULL) {
+        scan_dir(worker, dir);
+        if (__atomic_sub_fetch(&scan->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&scan->idle_lock);
+            pthread_cond_broadcast(&scan->idle_cond);
+            pthread_mutex_unlock(&scan->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+scan_tree_t* scan_tree(const char* path, int threads) {
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+    if (threads > SCAN_MAX_THREADS)
+        threads = SCAN_MAX_THREADS;
+
+    scan_t scan;
+    memset(&scan, 0, sizeof(scan_t));
+    scan.worker_count = threads;
+    scan.workers = calloc(threads, sizeof(scan_worker_t));
+    pthread_mutex_init(&scan.idle_lock, NULL);
+    pthread_cond_init(&scan.idle_cond, NULL);
+    for (int i = 0; i < threads; i++) {
+        scan.workers[i].scan = &scan;
+        scan.workers[i].id = i;
+        pthread_mutex_init(&scan.workers[i].deque.lock, NULL);
+    }
+
+    scan_tree_t* tree = calloc(1, sizeof(scan_tree_t));
+    scan_dir_t* root = arena_alloc(&scan.workers[0].arena, sizeof(scan_dir_t));
+    memset(root, 0, sizeof(scan_dir_t));
+    root->path = arena_strdup(&scan.workers[0].arena, path, strlen(path));
+    tree->root = root;
+
+    // the root is read up front so a missing directory fails before any thread is started
+    DIR* dir = opendir(path);
+    if (!dir) {
+        free(scan.workers[0].arena);
+        free(scan.workers);
+        free(tree);
+        return NULL;
+    }
+    closedir(dir);
+
+    scan_queue(&scan.workers[0], root);
+    for (int i = 1; i < threads; i++)
+        pthread_create(&scan.workers[i].thread, NULL, scan_thread, &scan.workers[i]);
+    scan_thread(&scan.workers[0]);
+    for (int i = 1; i < threads; i++)
+        pthread_join(scan.workers[i].thread, NULL);
+
+    // the tree keeps the arenas, everything else goes
+    for (int i = 0; i < threads; i++) {
+        scan_arena_t* arena = scan.workers[i].arena;
+        while (arena) {
+            scan_arena_t* next = arena->next;
+            arena->next = tree->arenas;
+            tree->arenas = arena;
+            arena = next;
+        }
+        free(scan.workers[i].deque.items);
+        pthread_mutex_destroy(&scan.workers[i].deque.lock);
+    }
+    pthread_mutex_destroy(&scan.idle_lock);
+    pthread_cond_destroy(&scan.idle_cond);
+    free(scan.workers);
+    return tree;
+}
+
+void scan_free(scan_tree_t* tree) {
+    if (!tree)
+        return;
+    scan_arena_t* arena = tree->arenas;
+    while (arena) {
+        scan_arena_t* next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    free(tree);
+}
@@ -0,0 +1,231 @@
+#include "util.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct _tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+// Octal, or big endian base 256 with the top bit set for sizes that don't fit 11 digits
+static uint64_t tar_number(const char* field, size_t len) {
+    uint64_t ret = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        for (size_t i = 1; i < len; i++)
+            ret = (ret << 8) | (unsigned char)field[i];
+        return ret;
+    }
+
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        ret = ret * 8 + (field[i] - '0');
+    return ret;
+}
+
+static bool tar_checksum_ok(const unsigned char* block) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (i >= offsetof(tar_header_t, checksum) && i < offsetof(tar_header_t, type)) ? ' ' : block[i];
+    return sum == tar_number(((const tar_header_t*)block)->checksum, sizeof(((tar_header_t*)0)->checksum));
+}
+
+static bool tar_skip(FILE* in, uint64_t size) {
+    char buf[TAR_BLOCK_SIZE];
+    while (size) {
+        size_t chunk = size < sizeof(buf) ? size : sizeof(buf);
+        if (fread(buf, 1, chunk, in) != chunk)
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+static uint64_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+// Reads the body of a GNU long name or pax record, both are small
+static char* tar_read_extension(FILE* in, uint64_t size) {
+    if (size > 1024 * 1024)
+        return NULL;
+    char* buf = malloc(size + 1);
+    if (fread(buf, 1, size, in) != size || !tar_skip(in, tar_padding(size))) {
+        free(buf);
+        return NULL;
+    }
+    buf[size] = '\0';
+    return buf;
+}
+
+// pax records are "<len> <key>=<value>\n", only path, linkpath and size matter here. Returns false
+// on a malformed record.
+static bool tar_apply_pax(const char* records, uint64_t len, tar_entry_t* entry, bool* have_path, bool* have_link,
+                          bool* have_size) {
+    const char* pos = records;
+    const char* end = records + len;
+    while (pos < end) {
+        char* after;
+        uint64_t record_len = strtoull(pos, &after, 10);
+        if (!record_len || after >= end || *after != ' ' || record_len > (uint64_t)(end - pos) ||
+            after + 1 >= pos + record_len || pos[record_len - 1] != '\n')
+            return false;
+        const char* key = after + 1;
+        const char* record_end = pos + record_len - 1;     // the newline
+        const char* equals = memchr(key, '=', record_end - key);
+        if (equals) {
+            const char* value = equals + 1;
+            size_t value_len = record_end - value;
+            if (equals - key == 4 && !memcmp(key, "path", 4) && value_len < sizeof(entry->path)) {
+                memcpy(entry->path, value, value_len);
+                entry->path[value_len] = '\0';
+                *have_path = true;
+            } else if (equals - key == 8 && !memcmp(key, "linkpath", 8) && value_len < sizeof(entry->link)) {
+                memcpy(entry->link, value, value_len);
+                entry->link[value_len] = '\0';
+                *have_link = true;
+            } else if (equals - key == 4 && !memcmp(key, "size", 4)) {
+                entry->size = strtoull(value, NULL, 10);
+                *have_size = true;
+            }
+        }
+        pos += record_len;
+    }
+    return true;
+}
+
+static bool tar_zero_block(const unsigned char* block) {
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (block[i])
+            return false;
+    }
+    return true;
+}
+
+// Copies a name field that may use all of its bytes without a terminator
+static void tar_copy_name(char* dst, const char* field, size_t len) {
+    len = strnlen(field, len);
+    memcpy(dst, field, len);
+    dst[len] = '\0';
+}
+
+int tar_next(FILE* in, tar_entry_t* entry) {
+    bool have_path = false;
+    bool have_link = false;
+    bool have_size = false;
+    for (;;) {
+        unsigned char block[TAR_BLOCK_SIZE];
+        size_t got = fread(block, 1, TAR_BLOCK_SIZE, in);
+        if (!got && feof(in) && !have_path && !have_link && !have_size)
+            return TAR_NEXT_END;
+        if (got != TAR_BLOCK_SIZE)
+            return TAR_NEXT_ERROR;
+
+        // the archive ends with two zero blocks, a writer that stops after the first is let off
+        if (tar_zero_block(block)) {
+            got = fread(block, 1, TAR_BLOCK_SIZE, in);
+            if ((!got && feof(in)) || (got == TAR_BLOCK_SIZE && tar_zero_block(block)))
+                return TAR_NEXT_END;
+            return TAR_NEXT_ERROR;
+        }
+        if (!tar_checksum_ok(block))
+            return TAR_NEXT_ERROR;
+
+        const tar_header_t* header = (const tar_header_t*)block;
+        uint64_t size = tar_number(header->size, sizeof(header->size));
+        if (header->type == 'g') {
+            if (!tar_skip(in, size + tar_padding(size)))
+                return TAR_NEXT_ERROR;
+            continue;
+        }
+        if (header->type == 'L' || header->type == 'K' || header->type == 'x') {
+            char* ext = tar_read_extension(in, size);
+            if (!ext)
+                return TAR_NEXT_ERROR;
+            if (header->type == 'L' || header->type == 'K') {
+                char* dst = header->type == 'L' ? entry->path : entry->link;
+                size_t len = strnlen(ext, size);
+                if (len < FILENAME_MAX) {
+                    memcpy(dst, ext, len + 1);
+                    *(header->type == 'L' ? &have_path : &have_link) = true;
+                }
+            } else if (!tar_apply_pax(ext, size, entry, &have_path, &have_link, &have_size)) {
+                free(ext);
+                return TAR_NEXT_ERROR;
+            }
+            free(ext);
+            continue;
+        }
+
+        if (!have_path) {
+            size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+            size_t name_len = strnlen(header->name, sizeof(header->name));
+            // GNU headers say "ustar " and keep times and sparse maps where the prefix would be
+            if (!memcmp(header->magic, "ustar", sizeof(header->magic)) && prefix_len) {
+                memcpy(entry->path, header->prefix, prefix_len);
+                entry->path[prefix_len] = '/';
+                memcpy(entry->path + prefix_len + 1, header->name, name_len);
+                entry->path[prefix_len + 1 + name_len] = '\0';
+            } else {
+                memcpy(entry->path, header->name, name_len);
+                entry->path[name_len] = '\0';
+            }
+        }
+        if (!have_link)
+            tar_copy_name(entry->link, header->linkname, sizeof(header->linkname));
+        if (!have_size)
+            entry->size = size;
+
+        switch (header->type) {
+            case '0':
+            case '\0':
+            case '7':
+                entry->type = TAR_TYPE_FILE;
+                break;
+            case '1':
+                entry->type = TAR_TYPE_HARDLINK;
+                break;
+            case '2':
+                entry->type = TAR_TYPE_SYMLINK;
+                break;
+            case '5':
+                entry->type = TAR_TYPE_DIR;
+                break;
+            default:
+                entry->type = TAR_TYPE_OTHER;
+                break;
+        }
+        // only regular files keep their data, the rest is skipped here
+        if (entry->type != TAR_TYPE_FILE) {
+            if (!tar_skip(in, entry->size + tar_padding(entry->size)))
+                return TAR_NEXT_ERROR;
+            entry->size = 0;
+        }
+        return TAR_NEXT_ENTRY;
+    }
+}
+
+bool tar_read_data(FILE* in, const tar_entry_t* entry, void* buf) {
+    if (entry->type != TAR_TYPE_FILE)
+        return true;
+    return fread(buf, 1, entry->size, in) == entry->size && tar_skip(in, tar_padding(entry->size));
+}
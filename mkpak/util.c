@@ -1,5 +1,6 @@
 #include "util.h"
 #include <time.h>
+#include <string.h>
 
 #define CHUNK 16384
 
@@ -15,6 +16,164 @@ size_t util_compress(const void* src, size_t src_len, void* dst, int32_t level)
 }
 
 
+size_t util_compress_dict(const void* src, size_t src_len, void* dst, int32_t level, const void* dict, size_t dict_len) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if (deflateInit(&strm, level) != Z_OK)
+        return -1;
+
+    if (deflateSetDictionary(&strm, dict, dict_len) != Z_OK) {
+        deflateEnd(&strm);
+        return -1;
+    }
+
+    strm.next_in = (Bytef*)src;
+    strm.avail_in = src_len;
+    strm.next_out = dst;
+    strm.avail_out = src_len;
+    int32_t ret = deflate(&strm, Z_FINISH);
+    size_t dst_len = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END)
+        return -1;
+
+    return dst_len;
+}
+
+size_t util_compress_checkpoints(const void* src, size_t src_len, void* dst, int32_t level, size_t interval,
+                                 uint64_t* checkpoints, size_t* checkpoint_count) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if (deflateInit(&strm, level) != Z_OK)
+        return -1;
+
+    *checkpoint_count = 0;
+    strm.next_out = dst;
+    strm.avail_out = src_len;
+    size_t done = 0;
+    int32_t ret = Z_OK;
+    while (ret == Z_OK) {
+        size_t chunk = src_len - done;
+        int flush = Z_FINISH;
+        if (chunk > interval) {
+            chunk = interval;
+            flush = Z_FULL_FLUSH;
+        }
+
+        strm.next_in = (Bytef*)src + done;
+        strm.avail_in = chunk;
+        ret = deflate(&strm, flush);
+        if (strm.avail_in || (flush == Z_FULL_FLUSH && !strm.avail_out)) {
+            ret = Z_BUF_ERROR;  // doesn't fit, it wouldn't be worth storing compressed anyway
+            break;
+        }
+        done += chunk;
+
+        // the full flush byte aligns the output and forgets the history, a raw inflate can start right here
+        if (flush == Z_FULL_FLUSH) {
+            checkpoints[*checkpoint_count * 2] = done;
+            checkpoints[*checkpoint_count * 2 + 1] = strm.total_out;
+            (*checkpoint_count)++;
+        }
+    }
+
+    size_t dst_len = strm.total_out;
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END)
+        return -1;
+
+    return dst_len;
+}
+
+#define DICT_GRAM_SIZE    8
+#define DICT_SEGMENT_SIZE 64
+#define DICT_HASH_BITS    20
+
+typedef struct _dict_segment {
+    const uint8_t* data;
+    size_t len;
+    uint64_t score;
+} dict_segment_t;
+
+static uint32_t dict_hash_gram(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - DICT_HASH_BITS));
+}
+
+static uint64_t dict_score_segment(const uint32_t* freq, const uint8_t* data, size_t len) {
+    uint64_t score = 0;
+    for (size_t i = 0; i + DICT_GRAM_SIZE <= len; i++) {
+        uint32_t f = freq[dict_hash_gram(data + i)];
+        if (f > 1)
+            score += f;
+    }
+    return score;
+}
+
+static int compare_dict_segment(const void* a, const void* b) {
+    const dict_segment_t* sa = a;
+    const dict_segment_t* sb = b;
+    return (sa->score < sb->score) - (sa->score > sb->score);
+}
+
+size_t util_train_dictionary(const void* const* samples, const size_t* sample_sizes, size_t sample_count, void* dict, size_t dict_capacity) {
+    // count in how many samples each gram shows up, a gram repeated inside a single file
+    // is already handled by the compressor's own window
+    uint32_t* freq = calloc(1 << DICT_HASH_BITS, sizeof(uint32_t));
+    uint32_t* last_seen = calloc(1 << DICT_HASH_BITS, sizeof(uint32_t));
+    size_t segment_count = 0;
+    for (size_t s = 0; s < sample_count; s++) {
+        const uint8_t* data = samples[s];
+        for (size_t i = 0; i + DICT_GRAM_SIZE <= sample_sizes[s]; i++) {
+            uint32_t h = dict_hash_gram(data + i);
+            if (last_seen[h] != s + 1) {
+                last_seen[h] = s + 1;
+                freq[h]++;
+            }
+        }
+        segment_count += (sample_sizes[s] + DICT_SEGMENT_SIZE - 1) / DICT_SEGMENT_SIZE;
+    }
+    free(last_seen);
+
+    dict_segment_t* segments = malloc(segment_count * sizeof(dict_segment_t) + 1);
+    segment_count = 0;
+    for (size_t s = 0; s < sample_count; s++) {
+        for (size_t i = 0; i < sample_sizes[s]; i += DICT_SEGMENT_SIZE) {
+            dict_segment_t* seg = &segments[segment_count++];
+            seg->data = (const uint8_t*)samples[s] + i;
+            seg->len = sample_sizes[s] - i < DICT_SEGMENT_SIZE ? sample_sizes[s] - i : DICT_SEGMENT_SIZE;
+            seg->score = dict_score_segment(freq, seg->data, seg->len);
+        }
+    }
+    qsort(segments, segment_count, sizeof(dict_segment_t), compare_dict_segment);
+
+    // greedily take the best segments, forgetting the grams they cover so near duplicates lose their score,
+    // the best segment ends up at the end of the dictionary where matches are cheapest
+    size_t dict_len = 0;
+    uint8_t* out = dict;
+    for (size_t i = 0; i < segment_count && dict_len < dict_capacity; i++) {
+        dict_segment_t* seg = &segments[i];
+        uint64_t score = dict_score_segment(freq, seg->data, seg->len);
+        if (!score || score < seg->score / 2)
+            continue;
+
+        size_t len = seg->len;
+        if (len > dict_capacity - dict_len)
+            len = dict_capacity - dict_len;
+        memcpy(out + dict_capacity - dict_len - len, seg->data, len);
+        dict_len += len;
+
+        for (size_t j = 0; j + DICT_GRAM_SIZE <= seg->len; j++)
+            freq[dict_hash_gram(seg->data + j)] = 0;
+    }
+
+    memmove(out, out + dict_capacity - dict_len, dict_len);
+    free(segments);
+    free(freq);
+    return dict_len;
+}
+
 size_t util_decompress(const void* src, size_t src_len, void* dst, size_t dst_len)
 {
     int32_t ret;
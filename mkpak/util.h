@@ -4,23 +4,127 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <zlib.h>
 
 #define BUF_SIZ (512 * 1024)
 
+#define SOLID_BLOCK_SIZE_DEFAULT (64 * 1024)
+#define SOLID_THRESHOLD_DEFAULT  (4 * 1024)
+
+#define CHECKPOINT_INTERVAL_DEFAULT (1024 * 1024)   // files need at least two intervals to get checkpoints
+
+// Root file of a patch pak listing the "/path" of every removed entry, one per line. A removed directory
+// takes everything below it, and the list is applied before the patch's own entries. A patch without
+// any changes holds just an empty list.
+#define PATCH_DELETION_LIST ".pak_deleted"
+
+#define TARGET_ENDIAN_HOST   0
+#define TARGET_ENDIAN_BIG    1
+#define TARGET_ENDIAN_LITTLE 2
+
+#define DICTIONARY_SIZE_DEFAULT    (32 * 1024)   // zlib can't reach further back than its 32 KiB window
+#define DICTIONARY_MAX_FILE_SIZE   (64 * 1024)   // larger files have enough context of their own
+#define DICTIONARY_MAX_SAMPLES     4096
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef struct _make_pak_options {
+    bool compress;
+    bool verbose;
+    const char* order_file;     // access log from pak_set_access_log, file data is stored in that order
+    uint64_t solid_block_size;  // 0 disables solid blocks
+    uint64_t solid_threshold;   // files smaller than this go into solid blocks
+    uint64_t dictionary_size;   // 0 disables training a preset dictionary
+    bool no_policy;             // try Z_BEST_COMPRESSION on every file instead of asking policy_choose_level
+    int endian;                 // TARGET_ENDIAN_*, byte order of the tables in the written pak
+    uint64_t checkpoint_interval;   // 0 disables restart points in large compressed files
+    uint64_t shard_size;        // 0 keeps all file data in the pak, otherwise it's split into files of about this size
+    bool manifest;              // the input lists "<pak path>\t<source file>" lines instead of naming a directory or tar
+} make_pak_options_t;
+
+typedef struct _scan_dir scan_dir_t;
+
+typedef struct _scan_child {
+    const char* name;
+    scan_dir_t* dir;            // NULL for files
+} scan_child_t;
+
+struct _scan_dir {
+    char* path;                 // on disk, starting with the path passed to scan_tree
+    uint32_t depth;
+    scan_child_t* children;     // in readdir order
+    size_t child_count;
+    size_t child_capacity;
+};
+
+typedef struct _scan_tree {
+    scan_dir_t* root;
+    struct _scan_arena* arenas; // everything in the tree lives in these
+} scan_tree_t;
+
+// Lists everything below path on threads workers, 0 picks one per CPU. Symlinks are followed and
+// .git directories below the top level are left out. Returns NULL if path can't be opened.
+scan_tree_t* scan_tree(const char* path, int threads);
+void scan_free(scan_tree_t* tree);
+
+#define TAR_TYPE_FILE   0
+#define TAR_TYPE_DIR    1
+#define TAR_TYPE_OTHER  2       // devices, fifos and the like, they have no data
+#define TAR_TYPE_HARDLINK 3     // another name for the earlier entry at link
+#define TAR_TYPE_SYMLINK  4     // points at link, relative to the entry's directory
+
+#define TAR_NEXT_ERROR  -1      // damaged or truncated archive
+#define TAR_NEXT_END    0
+#define TAR_NEXT_ENTRY  1
+
+typedef struct _tar_entry {
+    char path[FILENAME_MAX];
+    char link[FILENAME_MAX];    // target of hard and symbolic links
+    uint64_t size;
+    int type;                   // TAR_TYPE_*
+} tar_entry_t;
+
+// Reads the next header of a ustar, GNU or pax archive, long names and sizes included. The data of
+// a file entry has to be consumed with tar_read_data before the next call. Returns TAR_NEXT_*, the
+// archive only ends cleanly at its zero blocks or at EOF between entries.
+int tar_next(FILE* in, tar_entry_t* entry);
+bool tar_read_data(FILE* in, const tar_entry_t* entry, void* buf);
+
 size_t util_compress(const void* src, size_t src_len, void* dst, int32_t level);
 
+// Like util_compress with a full flush every interval bytes of input. Each flush is a point inflate can
+// restart from, checkpoint_count (uncompressed, compressed) offset pairs are stored in checkpoints,
+// which needs room for src_len / interval of them.
+size_t util_compress_checkpoints(const void* src, size_t src_len, void* dst, int32_t level, size_t interval,
+                                 uint64_t* checkpoints, size_t* checkpoint_count);
+size_t util_compress_dict(const void* src, size_t src_len, void* dst, int32_t level, const void* dict, size_t dict_len);
+
+// Builds a zlib preset dictionary out of the content shared between samples, returns its size
+size_t util_train_dictionary(const void* const* samples, const size_t* sample_sizes, size_t sample_count, void* dict, size_t dict_capacity);
+
 size_t util_decompress(const void* src, size_t src_len, void* dst, size_t dst_len);
 
+// Picks a zlib level for a file by its extension, magic bytes, sampled entropy and size,
+// returns Z_NO_COMPRESSION for data that isn't worth compressing. reason may be NULL.
+int32_t policy_choose_level(const char* path, const void* buf, size_t len, const char** reason);
+
 void gen_random(char *s, const int len);
 
 void dump_pak(char* input, char* output, bool verbose);
-void make_pak(char* input, char* output, bool compress, bool verbose);
+void make_pak(char* input, char* output, const make_pak_options_t* options);
+// Builds a pak front to back so output can be a pipe. input is a directory or a manifest, "-" reads
+// a tar or the manifest from stdin. output "-" writes to stdout.
+void stream_pak(char* input, char* output, const make_pak_options_t* options);
+// Rewrites input, any version this build can read, as a pak of the current version
+bool convert_pak(char* input, char* output, const make_pak_options_t* options);
+// Writes a patch pak holding what was added or changed in new_input since old_input, plus a
+// PATCH_DELETION_LIST file of the removed paths. Files are compared by content hash or stored bytes
+// where both paks allow it and only decoded otherwise.
+bool diff_pak(char* old_input, char* new_input, char* output, const make_pak_options_t* options);
 void print_pak_info(char* input);
 
 #ifdef __cplusplus
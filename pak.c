@@ -1,6 +1,30 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // copy_file_range
+#endif
 #include "pak.h"
 #include <endian.h>
 #include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <zlib.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PAK_HAVE_AVX2
+#endif
+
+// The endian field is a byte order mark written in the file's order, so it reads as
+// PAK_ENDIAN_NATIVE when the file matches the host and as PAK_ENDIAN_SWAPPED otherwise
+#define PAK_ENDIAN_NATIVE  0xFEFF
+#define PAK_ENDIAN_SWAPPED 0xFFFE
 
 #if __BYTE_ORDER__ == __BIG_ENDIAN
 #define PAK_ENDIAN_BIG    0xFEFF
@@ -13,14 +37,195 @@
 //static pak_node_t* current_dir = NULL;
 
 static void build_node_tree(pak_handle_t* handle);
+static bool build_subtree_index(pak_handle_t* handle);
+static bool scheduler_on_worker(struct _pak_scheduler* sched);
 
-pak_handle_t* pak_open_read(const char* filename) {
+static pak_trace_callback default_trace = NULL;
+static void* default_trace_user_data = NULL;
+
+static uint64_t pak_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#ifdef PAK_ENABLE_STATS
+#define PAK_STAT_ADD(handle, field, n) __atomic_fetch_add(&(handle)->stats.field, (n), __ATOMIC_RELAXED)
+#define PAK_STAT_START(var) uint64_t var = pak_now_ns()
+#define PAK_STAT_ELAPSED(handle, field, start) PAK_STAT_ADD(handle, field, pak_now_ns() - (start))
+#define PAK_TRACE(handle, event, phase, path, bytes) \
+    do { if ((handle)->trace) (handle)->trace(handle, event, phase, path, bytes, (handle)->trace_user_data); } while (0)
+#else
+#define PAK_STAT_ADD(handle, field, n) ((void)(handle))
+#define PAK_STAT_START(var) ((void)0)
+#define PAK_STAT_ELAPSED(handle, field, start) ((void)(handle))
+#define PAK_TRACE(handle, event, phase, path, bytes) ((void)(handle), (void)(path))
+#endif
+
+// blocks and whole compressed entries share the decoded cache
+#define PAK_CACHE_KEY_BLOCK(index) ((uint64_t)(index))
+#define PAK_CACHE_KEY_ENTRY(index) ((uint64_t)(index) | (1ULL << 63))
+
+// Entry record used up to 0.3
+typedef struct _pak_entry_v1 {
+    uint8_t  flags;
+    uint64_t file_id;
+    int64_t string_offset;
+    int64_t data_offset_or_first_child;
+    int64_t data_size_or_child_count;
+    int64_t data_uncompressed_size;
+} __attribute__((packed)) pak_entry_v1_t;
+
+// 0.1 headers end right before the block table fields
+#define PAK_HEADER_SIZE_0_1 offsetof(pak_header_t, block_table_offset)
+
+// older minor versions are a prefix of the current header
+static size_t pak_header_size(uint32_t version) {
+    switch (PAK_VERSION_GET_MINOR(version)) {
+        case 1:
+            return PAK_HEADER_SIZE_0_1;
+        case 2:
+            return offsetof(pak_header_t, dictionary_offset);
+        case 3:
+        case 4:
+            return offsetof(pak_header_t, checkpoint_table_offset);
+        case 5:
+            return offsetof(pak_header_t, shard_count);
+        case 6:
+            return offsetof(pak_header_t, trailer);
+        case 7:
+            return offsetof(pak_header_t, hash_table_offset);
+        default:
+            return sizeof(pak_header_t);
+    }
+}
+
+static bool pak_pread(pak_handle_t* handle, int fd, void* buf, uint64_t size, uint64_t offset) {
+    PAK_STAT_START(start);
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t ret = pread(fd, (char*)buf + done, size - done, offset + done);
+        PAK_STAT_ADD(handle, syscalls, 1);
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    PAK_STAT_ADD(handle, bytes_read, done);
+    PAK_STAT_ELAPSED(handle, io_ns, start);
+    return done == size;
+}
+
+static bool pak_read_at(pak_handle_t* handle, void* buf, uint64_t size, uint64_t offset) {
+    return pak_pread(handle, fileno(handle->file), buf, size, offset);
+}
+
+bool pak_shard_path(const char* filename, uint32_t shard, char* buf, size_t size) {
+    assert(filename);
+    assert(buf);
+    int len = shard ? snprintf(buf, size, "%s.%03u", filename, shard) : snprintf(buf, size, "%s", filename);
+    return len >= 0 && (size_t)len < size;
+}
+
+static uint64_t shard_count(pak_handle_t* handle) {
+    return handle->header->shard_count ? handle->header->shard_count : 1;
+}
+
+// Shards other than 0 are opened the first time they're read from, -1 if that fails
+static int shard_fd(pak_handle_t* handle, uint16_t shard) {
+    if (shard >= shard_count(handle))
+        return -1;
+    int fd = __atomic_load_n(&handle->shard_fds[shard], __ATOMIC_ACQUIRE);
+    if (fd >= 0)
+        return fd;
+
+    pthread_mutex_lock(&handle->shard_lock);
+    fd = handle->shard_fds[shard];
+    char path[FILENAME_MAX];
+    if (fd < 0 && pak_shard_path(handle->filename, shard, path, sizeof(path))) {
+        fd = open(path, O_RDONLY);
+        __atomic_store_n(&handle->shard_fds[shard], fd, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&handle->shard_lock);
+    return fd;
+}
+
+// Where the data starts in the file of the shard, the others hold nothing but data
+static uint64_t shard_base(pak_handle_t* handle, uint16_t shard) {
+    return shard ? 0 : handle->header->data_offset;
+}
+
+// offset is relative to the data of the shard
+static bool pak_read_data(pak_handle_t* handle, uint16_t shard, void* buf, uint64_t size, uint64_t offset) {
+    int fd = shard_fd(handle, shard);
+    if (fd < 0)
+        return false;
+    return pak_pread(handle, fd, buf, size, shard_base(handle, shard) + offset);
+}
+
+static void pak_advise_data(pak_handle_t* handle, uint16_t shard, uint64_t offset, uint64_t size) {
+    int fd = shard_fd(handle, shard);
+    if (fd < 0)
+        return;
+    PAK_STAT_ADD(handle, syscalls, 1);
+    posix_fadvise(fd, shard_base(handle, shard) + offset, size, POSIX_FADV_WILLNEED);
+}
+
+static bool load_entry_table_v1(pak_handle_t* handle, uint64_t entry_table_size, bool swap) {
+    pak_entry_v1_t* v1 = malloc(entry_table_size);
+    fseek(handle->file, handle->header->entry_start, SEEK_SET);
+    if (fread(v1, 1, entry_table_size, handle->file) != entry_table_size) {
+        free(v1);
+        return false;
+    }
+
+    pak_entry_t* entries = malloc(handle->header->entry_count * sizeof(pak_entry_t));
+    for (uint64_t i = 0; i < handle->header->entry_count; i++) {
+        pak_entry_v1_t* src = &v1[i];
+        pak_entry_t* dst = &entries[i];
+        uint64_t string_offset = src->string_offset;
+        dst->flags = src->flags;
+        dst->shard = 0;
+        dst->data_offset_or_first_child = src->data_offset_or_first_child;
+        dst->data_size_or_child_count = src->data_size_or_child_count;
+        dst->data_uncompressed_size = src->data_uncompressed_size;
+        if (swap) {
+            string_offset = __builtin_bswap64(string_offset);
+            dst->data_offset_or_first_child = __builtin_bswap64(dst->data_offset_or_first_child);
+            dst->data_size_or_child_count = __builtin_bswap64(dst->data_size_or_child_count);
+            dst->data_uncompressed_size = __builtin_bswap64(dst->data_uncompressed_size);
+        }
+        dst->string_offset = string_offset;
+        if (string_offset >= handle->header->string_table_size) {
+            free(v1);
+            free(entries);
+            return false;
+        }
+    }
+
+    free(v1);
+    handle->entry_table_data = entries;
+    return true;
+}
+
+// Pooled handles leave the node tree for later, see ensure_node_tree
+static pak_handle_t* open_read(const char* filename, bool build_nodes) {
     pak_handle_t* handle = pak_alloc(sizeof(pak_handle_t));
     assert(handle);
     memset(handle, 0, sizeof(pak_handle_t));
     memset((bool*)&handle->is_readonly, 1, 1);
+    handle->trace = default_trace;
+    handle->trace_user_data = default_trace_user_data;
+    pthread_mutex_init(&handle->cache.lock, NULL);
+    pthread_mutex_init(&handle->columns_lock, NULL);
+    pthread_mutex_init(&handle->shard_lock, NULL);
+    pthread_mutex_init(&handle->nodes_lock, NULL);
+    PAK_STAT_START(start);
+    PAK_TRACE(handle, PAK_TRACE_OPEN, PAK_TRACE_BEGIN, filename, 0);
     handle->file = fopen(filename, "rb");
-    handle->filename = filename;
+    // shards are opened later on, by then the working directory may have changed
+    handle->filename = realpath(filename, NULL);
+    if (!handle->filename)
+        handle->filename = strdup(filename);
     handle->header = pak_create_header();
     handle->root = pak_create_node();
     handle->root->entry = pak_create_entry();
@@ -32,30 +237,108 @@ pak_handle_t* pak_open_read(const char* filename) {
     strcat(handle->root->filename, "\0");
 
     if (handle->file) {
-        if (fread(handle->header, 1, sizeof(pak_header_t), handle->file) != sizeof(pak_header_t))
+        if (fread(handle->header, 1, PAK_HEADER_SIZE_0_1, handle->file) != PAK_HEADER_SIZE_0_1)
+            goto fail;
+
+        // paks built for the other byte order are converted once here, never per access
+        bool swap = handle->header->endian == PAK_ENDIAN_SWAPPED;
+        if (!swap && handle->header->endian != PAK_ENDIAN_NATIVE)
             goto fail;
 
-        if (handle->header->magic != PAK_MAGIC || handle->header->version != PAK_VERSION)
+        uint32_t version = swap ? __builtin_bswap32(handle->header->version) : handle->header->version;
+        uint32_t magic = swap ? __builtin_bswap32(handle->header->magic) : handle->header->magic;
+        if (magic != PAK_MAGIC || PAK_VERSION_GET_MINOR(version) > PAK_VERSION_MINOR)
             goto fail;
 
-        uint64_t entry_table_size = handle->header->entry_count * sizeof(pak_entry_t);
-        handle->entry_table_data = malloc(entry_table_size);
-        fseek(handle->file, handle->header->entry_start, SEEK_SET);
-        if (fread(handle->entry_table_data, 1, entry_table_size, handle->file) != entry_table_size) {
-            free(handle->entry_table_data);
+        size_t remaining = pak_header_size(version) - PAK_HEADER_SIZE_0_1;
+        if (fread((char*)handle->header + PAK_HEADER_SIZE_0_1, 1, remaining, handle->file) != remaining)
             goto fail;
+        if (swap)
+            pak_swap_header(handle->header);
+
+        // streamed paks only know their tables once the data is written, the header follows them
+        if (PAK_VERSION_GET_MINOR(handle->header->version) >= 7 && handle->header->trailer) {
+            struct stat st;
+            if (fstat(fileno(handle->file), &st) || (uint64_t)st.st_size < PAK_TRAILER_SIZE * 2)
+                goto fail;
+            if (!pak_read_at(handle, handle->header, sizeof(pak_header_t), st.st_size - PAK_TRAILER_SIZE))
+                goto fail;
+            if (swap)
+                pak_swap_header(handle->header);
+            if (handle->header->magic != PAK_MAGIC || handle->header->version != version || handle->header->trailer)
+                goto fail;
+        }
+
+        uint64_t entry_table_size;
+        if (PAK_VERSION_GET_MINOR(handle->header->version) >= PAK_ENTRY_RECORD_V2_MINOR) {
+            entry_table_size = handle->header->entry_count * sizeof(pak_entry_t);
+            handle->entry_table_data = malloc(entry_table_size);
+            fseek(handle->file, handle->header->entry_start, SEEK_SET);
+            if (fread(handle->entry_table_data, 1, entry_table_size, handle->file) != entry_table_size)
+                goto fail;
+            if (swap)
+                pak_swap_entries(handle->entry_table_data, handle->header->entry_count);
+        } else {
+            entry_table_size = handle->header->entry_count * sizeof(pak_entry_v1_t);
+            if (!load_entry_table_v1(handle, entry_table_size, swap))
+                goto fail;
         }
 
         handle->string_table_data = malloc(handle->header->string_table_size);
         fseek(handle->file, handle->header->string_table_offset, SEEK_SET);
-        if (fread(handle->string_table_data, 1, handle->header->string_table_size, handle->file) != handle->header->string_table_size) {
-            free(handle->string_table_data);
+        if (fread(handle->string_table_data, 1, handle->header->string_table_size, handle->file) != handle->header->string_table_size)
             goto fail;
+
+        if (handle->header->block_count) {
+            uint64_t block_table_size = handle->header->block_count * sizeof(pak_block_t);
+            handle->block_table_data = malloc(block_table_size);
+            if (!pak_read_at(handle, handle->block_table_data, block_table_size, handle->header->block_table_offset))
+                goto fail;
+            if (swap)
+                pak_swap_blocks(handle->block_table_data, handle->header->block_count);
+        }
+
+        if (handle->header->dictionary_size) {
+            handle->dictionary_data = malloc(handle->header->dictionary_size);
+            if (!pak_read_at(handle, handle->dictionary_data, handle->header->dictionary_size, handle->header->dictionary_offset))
+                goto fail;
+        }
+
+        if (handle->header->checkpoint_count) {
+            uint64_t checkpoint_table_size = handle->header->checkpoint_count * sizeof(pak_checkpoint_t);
+            handle->checkpoint_table_data = malloc(checkpoint_table_size);
+            if (!pak_read_at(handle, handle->checkpoint_table_data, checkpoint_table_size, handle->header->checkpoint_table_offset))
+                goto fail;
+            if (swap)
+                pak_swap_checkpoints(handle->checkpoint_table_data, handle->header->checkpoint_count);
         }
+
+        if (PAK_VERSION_GET_MINOR(handle->header->version) >= 8 && handle->header->hash_table_offset) {
+            uint64_t hash_table_size = handle->header->entry_count * sizeof(uint64_t);
+            handle->hash_table_data = malloc(hash_table_size);
+            if (!pak_read_at(handle, handle->hash_table_data, hash_table_size, handle->header->hash_table_offset))
+                goto fail;
+            if (swap)
+                pak_swap_hashes(handle->hash_table_data, handle->header->entry_count);
+        }
+
+        handle->shard_fds = malloc(shard_count(handle) * sizeof(int));
+        handle->shard_fds[0] = fileno(handle->file);
+        for (uint64_t i = 1; i < shard_count(handle); i++)
+            handle->shard_fds[i] = -1;
         handle->root->entry->data_size_or_child_count = handle->header->entry_count;
 
-        build_node_tree(handle);
+        if (!build_subtree_index(handle))
+            goto fail;
+
+        if (build_nodes) {
+            build_node_tree(handle);
+            handle->nodes_built = true;
+        }
 
+        PAK_STAT_ADD(handle, bytes_read, pak_header_size(handle->header->version) + entry_table_size + handle->header->string_table_size);
+        PAK_STAT_ELAPSED(handle, open_ns, start);
+        PAK_TRACE(handle, PAK_TRACE_OPEN, PAK_TRACE_END, filename, 0);
         return handle;
     }
 
@@ -64,14 +347,26 @@ fail:
     return NULL;
 }
 
+pak_handle_t* pak_open_read(const char* filename) {
+    return open_read(filename, true);
+}
+
+pak_handle_t* pak_open_read_lazy(const char* filename) {
+    return open_read(filename, false);
+}
+
 pak_handle_t* pak_open_write(const char* filename) {
     pak_handle_t* handle = pak_alloc(sizeof(pak_handle_t));
     assert(handle);
     memset(handle, 0, sizeof(pak_handle_t));
+    pthread_mutex_init(&handle->cache.lock, NULL);
+    pthread_mutex_init(&handle->columns_lock, NULL);
+    pthread_mutex_init(&handle->shard_lock, NULL);
+    pthread_mutex_init(&handle->nodes_lock, NULL);
     handle->file = fopen(filename, "r+b");
     if (!handle->file)
         handle->file = fopen(filename, "wb");
-    handle->filename = filename;
+    handle->filename = strdup(filename);
     handle->root = NULL;
 
     if (handle->file)
@@ -79,23 +374,71 @@ pak_handle_t* pak_open_write(const char* filename) {
         handle->header = pak_create_header();
         return handle;
     }
+    free((void*)handle->filename);
+    pak_free(handle);
     return NULL;
 }
 
+pak_handle_t* pak_open_write_stream(FILE* file) {
+    assert(file);
+    pak_handle_t* handle = pak_alloc(sizeof(pak_handle_t));
+    assert(handle);
+    memset(handle, 0, sizeof(pak_handle_t));
+    pthread_mutex_init(&handle->cache.lock, NULL);
+    pthread_mutex_init(&handle->columns_lock, NULL);
+    pthread_mutex_init(&handle->shard_lock, NULL);
+    pthread_mutex_init(&handle->nodes_lock, NULL);
+    handle->file = file;
+    handle->is_stream = true;
+    handle->header = pak_create_header();
+    return handle;
+}
+
 void pak_close(pak_handle_t* handle) {
     assert(handle);
-    if (!handle->is_readonly)
-    {
-        fseek(handle->file, 0, SEEK_SET);
-        fwrite(handle->header, 1, sizeof(pak_header_t), handle->file);
+    assert(!handle->scheduler || !scheduler_on_worker(handle->scheduler));
+    if (handle->scheduler && scheduler_on_worker(handle->scheduler))
+        return;
+    if (!handle->is_readonly && !handle->is_stream)
+        pak_write_header(handle);
+
+    pak_scheduler_stop(handle);
+    pak_prefetch_cancel(handle);
+    if (handle->access_log)
+        fclose(handle->access_log);
+    for (int i = 0; i < PAK_CACHE_SLOTS; i++)
+        free(handle->cache.slots[i].data);
+    pthread_mutex_destroy(&handle->cache.lock);
+    if (handle->columns) {
+        free(handle->columns->flags);
+        free(handle->columns->sizes);
+        free(handle->columns->offsets);
+        free(handle->columns->name_hashes);
+        free(handle->columns->shards);
+        pak_free(handle->columns);
     }
-
+    pthread_mutex_destroy(&handle->columns_lock);
+    if (handle->shard_fds) {
+        for (uint64_t i = 1; i < shard_count(handle); i++) {
+            if (handle->shard_fds[i] >= 0)
+                close(handle->shard_fds[i]);
+        }
+        free(handle->shard_fds);
+    }
+    pthread_mutex_destroy(&handle->shard_lock);
+    pthread_mutex_destroy(&handle->nodes_lock);
     free(handle->entry_table_data);
     free(handle->string_table_data);
+    free(handle->block_table_data);
+    free(handle->dictionary_data);
+    free(handle->checkpoint_table_data);
+    free(handle->hash_table_data);
+    free(handle->subtree_end);
     if (handle->root)
         pak_free_node(handle->root);
     if (handle->file)
         fclose(handle->file);
+    free((void*)handle->filename);
     pak_free(handle);
 }
 
@@ -112,7 +455,16 @@ pak_header_t* pak_create_header() {
 
     ret->magic = PAK_MAGIC;
     ret->version = PAK_VERSION;
-    ret->endian = 0xFEFF;
+    ret->endian = PAK_ENDIAN_NATIVE;
+    ret->block_table_offset = 0;
+    ret->block_count = 0;
+    ret->dictionary_offset = 0;
+    ret->dictionary_size = 0;
+    ret->checkpoint_table_offset = 0;
+    ret->checkpoint_count = 0;
+    ret->shard_count = 0;
+    ret->trailer = 0;
+    ret->hash_table_offset = 0;
 
     return ret;
 }
@@ -150,12 +502,115 @@ int32_t pak_get_endian(pak_handle_t* handle) {
         case PAK_ENDIAN_BIG:
             return BigEndian;
         case PAK_ENDIAN_LITTLE:
-            return BigEndian;
+            return LittleEndian;
     }
 
     return -1;
 }
 
+bool pak_is_native_endian(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->endian == PAK_ENDIAN_NATIVE;
+}
+
+// The byte order mark is left alone, see PAK_ENDIAN_NATIVE
+void pak_swap_header(pak_header_t* header) {
+    assert(header);
+    header->magic = __builtin_bswap32(header->magic);
+    header->version = __builtin_bswap32(header->version);
+    header->entry_start = __builtin_bswap64(header->entry_start);
+    header->entry_count = __builtin_bswap64(header->entry_count);
+    header->string_table_offset = __builtin_bswap64(header->string_table_offset);
+    header->string_table_size = __builtin_bswap64(header->string_table_size);
+    header->data_offset = __builtin_bswap64(header->data_offset);
+    header->block_table_offset = __builtin_bswap64(header->block_table_offset);
+    header->block_count = __builtin_bswap64(header->block_count);
+    header->dictionary_offset = __builtin_bswap64(header->dictionary_offset);
+    header->dictionary_size = __builtin_bswap64(header->dictionary_size);
+    header->checkpoint_table_offset = __builtin_bswap64(header->checkpoint_table_offset);
+    header->checkpoint_count = __builtin_bswap64(header->checkpoint_count);
+    header->shard_count = __builtin_bswap64(header->shard_count);
+    header->trailer = __builtin_bswap64(header->trailer);
+    header->hash_table_offset = __builtin_bswap64(header->hash_table_offset);
+}
+
+void pak_swap_entries(pak_entry_t* entries, uint64_t count) {
+    assert(entries || !count);
+    for (uint64_t i = 0; i < count; i++) {
+        pak_entry_t* entry = &entries[i];
+        entry->string_offset = __builtin_bswap32(entry->string_offset);
+        entry->flags = __builtin_bswap16(entry->flags);
+        entry->shard = __builtin_bswap16(entry->shard);
+        entry->data_offset_or_first_child = __builtin_bswap64(entry->data_offset_or_first_child);
+        entry->data_size_or_child_count = __builtin_bswap64(entry->data_size_or_child_count);
+        entry->data_uncompressed_size = __builtin_bswap64(entry->data_uncompressed_size);
+    }
+}
+
+void pak_swap_blocks(pak_block_t* blocks, uint64_t count) {
+    assert(blocks || !count);
+    for (uint64_t i = 0; i < count; i++) {
+        blocks[i].data_offset = __builtin_bswap64(blocks[i].data_offset);
+        blocks[i].data_size = __builtin_bswap64(blocks[i].data_size);
+        blocks[i].data_uncompressed_size = __builtin_bswap64(blocks[i].data_uncompressed_size);
+    }
+}
+
+void pak_swap_checkpoints(pak_checkpoint_t* checkpoints, uint64_t count) {
+    assert(checkpoints || !count);
+    for (uint64_t i = 0; i < count; i++) {
+        checkpoints[i].entry_index = __builtin_bswap64(checkpoints[i].entry_index);
+        checkpoints[i].uncompressed_offset = __builtin_bswap64(checkpoints[i].uncompressed_offset);
+        checkpoints[i].compressed_offset = __builtin_bswap64(checkpoints[i].compressed_offset);
+    }
+}
+
+void pak_swap_hashes(uint64_t* hashes, uint64_t count) {
+    assert(hashes || !count);
+    for (uint64_t i = 0; i < count; i++)
+        hashes[i] = __builtin_bswap64(hashes[i]);
+}
+
+bool pak_write_header(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    pak_header_t header = *handle->header;
+    if (!pak_is_native_endian(handle))
+        pak_swap_header(&header);
+    fseek(handle->file, 0, SEEK_SET);
+    return fwrite(&header, 1, sizeof(pak_header_t), handle->file) == sizeof(pak_header_t);
+}
+
+static bool write_padded_header(pak_handle_t* handle, const pak_header_t* src, uint64_t trailer) {
+    char buf[PAK_TRAILER_SIZE];
+    pak_clear(buf, sizeof(buf));
+    pak_header_t* header = (pak_header_t*)buf;
+    *header = *src;
+    header->trailer = trailer;
+    if (!pak_is_native_endian(handle))
+        pak_swap_header(header);
+    return fwrite(buf, 1, sizeof(buf), handle->file) == sizeof(buf);
+}
+
+bool pak_write_placeholder(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    pak_header_t placeholder;
+    memset(&placeholder, 0, sizeof(pak_header_t));
+    placeholder.magic = handle->header->magic;
+    placeholder.version = handle->header->version;
+    placeholder.endian = handle->header->endian;
+    placeholder.data_offset = handle->header->data_offset;
+    return write_padded_header(handle, &placeholder, 1);
+}
+
+bool pak_write_trailer(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return write_padded_header(handle, handle->header, 0);
+}
+
 void pak_set_string_table_offset(pak_handle_t* handle, uint64_t val) {
     assert(handle);
     assert(handle->header);
@@ -222,6 +677,105 @@ uint64_t pak_get_data_offset(pak_handle_t* handle) {
     return handle->header->data_offset;
 }
 
+void pak_set_block_table_offset(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    assert(val > 0);
+    handle->header->block_table_offset = val;
+}
+
+uint64_t pak_get_block_table_offset(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->block_table_offset;
+}
+
+void pak_set_block_count(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    handle->header->block_count = val;
+}
+
+uint64_t pak_get_block_count(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->block_count;
+}
+
+void pak_set_dictionary_offset(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    assert(val > 0);
+    handle->header->dictionary_offset = val;
+}
+
+uint64_t pak_get_dictionary_offset(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->dictionary_offset;
+}
+
+void pak_set_dictionary_size(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    handle->header->dictionary_size = val;
+}
+
+uint64_t pak_get_dictionary_size(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->dictionary_size;
+}
+
+void pak_set_checkpoint_table_offset(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    assert(val > 0);
+    handle->header->checkpoint_table_offset = val;
+}
+
+uint64_t pak_get_checkpoint_table_offset(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->checkpoint_table_offset;
+}
+
+void pak_set_checkpoint_count(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    handle->header->checkpoint_count = val;
+}
+
+uint64_t pak_get_checkpoint_count(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->checkpoint_count;
+}
+
+void pak_set_shard_count(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    handle->header->shard_count = val;
+}
+
+uint64_t pak_get_shard_count(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return shard_count(handle);
+}
+
+void pak_set_hash_table_offset(pak_handle_t* handle, uint64_t val) {
+    assert(handle);
+    assert(handle->header);
+    handle->header->hash_table_offset = val;
+}
+
+uint64_t pak_get_hash_table_offset(pak_handle_t* handle) {
+    assert(handle);
+    assert(handle->header);
+    return handle->header->hash_table_offset;
+}
+
 pak_entry_t* pak_get_entry_from_index(pak_handle_t* handle, uint64_t index) {
     assert(handle);
     assert(handle->header);
@@ -238,94 +792,508 @@ const char* pak_get_string_from_index(pak_handle_t* handle, uint64_t index) {
 int64_t pak_get_index_from_entry(pak_handle_t* handle, pak_entry_t* entry) {
     assert(handle);
     assert(handle->header);
+    // entries handed out by the library point into the table
+    if ((char*)entry >= (char*)handle->entry_table_data &&
+        (char*)entry < (char*)handle->entry_table_data + handle->header->entry_count * sizeof(pak_entry_t))
+        return ((char*)entry - (char*)handle->entry_table_data) / sizeof(pak_entry_t);
+
     uint64_t index = 0;
     while (index < handle->header->entry_count) {
-        uint32_t offset = sizeof(pak_entry_t) * index;
+        uint64_t offset = sizeof(pak_entry_t) * index;
         if (!memcmp(handle->entry_table_data + offset, entry, sizeof(pak_entry_t))) {
             return index;
         }
+        index++;
     }
 
     return -1;
 }
 
-pak_entry_t* pak_create_entry() {
-    pak_entry_t* ret = NULL;
-    ret = pak_alloc(sizeof(pak_entry_t));
-    assert(ret);
-    pak_clear(ret, sizeof(pak_entry_t));
+// subtree_end[i] is one past the last descendant of entry i, which makes it the index of its next sibling
+static bool build_subtree_index(pak_handle_t* handle) {
+    uint64_t count = handle->header->entry_count;
+    handle->subtree_end = malloc((count ? count : 1) * sizeof(uint64_t));
+    uint64_t* open_dirs = malloc((count ? count : 1) * sizeof(uint64_t));
+    int64_t* remaining = malloc((count ? count : 1) * sizeof(int64_t));
+    uint64_t depth = 0;
+
+    for (uint64_t i = 0; i < count; i++) {
+        pak_entry_t* entry = pak_get_entry_from_index(handle, i);
+        if (PAK_ENTRY_IS_DIR(entry) && entry->data_size_or_child_count > 0) {
+            open_dirs[depth] = i;
+            remaining[depth] = entry->data_size_or_child_count;
+            depth++;
+            continue;
+        }
 
-    return ret;
-}
+        // a leaf completes its parent once it's the last child, which may complete the grandparent and so on
+        handle->subtree_end[i] = i + 1;
+        while (depth > 0 && --remaining[depth - 1] == 0) {
+            handle->subtree_end[open_dirs[depth - 1]] = i + 1;
+            depth--;
+        }
+    }
 
-void pak_free_entry(pak_entry_t* entry) {
-    assert(entry);
-    pak_free(entry);
+    free(open_dirs);
+    free(remaining);
+    return depth == 0;
 }
 
+static bool entry_name_equals(pak_handle_t* handle, uint64_t index, const char* name, size_t len) {
+    const char* entry_name = pak_get_string_from_index(handle, index);
+    return !strncmp(entry_name, name, len) && entry_name[len] == '\0';
+}
 
-pak_node_t* build_node_tree_recursive(pak_handle_t* handle, pak_node_t* parent, pak_node_t* current_node, uint64_t* current_idx) {
-    assert(handle);
-    pak_node_t* tmp = pak_create_node();
-    tmp->entry = pak_get_entry_from_index(handle, *current_idx);
-    strcpy(tmp->filename, pak_get_string_from_index(handle, *current_idx));
-    tmp->is_dir = PAK_ENTRY_IS_DIR(tmp->entry);
-    (*current_idx)++;
+// FNV-1a
+uint32_t pak_hash_name(const char* name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    if (parent && (!parent->child))
-        parent->child = tmp;
+// MurmurHash64A, words are read little endian so every host agrees
+uint64_t pak_hash_data(const void* data, size_t len) {
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const unsigned char* pos = data;
+    const unsigned char* end = pos + (len & ~(size_t)7);
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ (len * m);
+    for (; pos != end; pos += 8) {
+        uint64_t word;
+        memcpy(&word, pos, sizeof(word));
+        word = le64toh(word) * m;
+        word ^= word >> 47;
+        hash = (hash ^ (word * m)) * m;
+    }
+    if (len & 7) {
+        uint64_t tail = 0;
+        for (size_t i = len & 7; i; i--)
+            tail = (tail << 8) | pos[i - 1];
+        hash = (hash ^ tail) * m;
+    }
+    hash ^= hash >> 47;
+    hash *= m;
+    return hash ^ (hash >> 47);
+}
 
-    if (parent)
-        tmp->parent = parent;
+bool pak_get_entry_hash(pak_handle_t* handle, uint64_t index, uint64_t* hash) {
+    assert(handle);
+    assert(hash);
+    if (!handle->hash_table_data || index >= handle->header->entry_count ||
+        PAK_ENTRY_IS_DIR(pak_get_entry_from_index(handle, index)))
+        return false;
+    *hash = handle->hash_table_data[index];
+    return true;
+}
 
-    if (current_node != parent)
-        current_node->next = tmp;
+static void* alloc_column(uint64_t count, size_t size) {
+    void* ret = NULL;
+    if (posix_memalign(&ret, 32, (count * size + 31) & ~31ULL))
+        return NULL;
+    return ret;
+}
 
-    tmp->prev = current_node;
+static pak_columns_t* build_columns(pak_handle_t* handle) {
+    uint64_t count = handle->header->entry_count;
+    pak_columns_t* columns = pak_alloc(sizeof(pak_columns_t));
+    assert(columns);
+    columns->flags = alloc_column(count, sizeof(uint16_t));
+    columns->sizes = alloc_column(count, sizeof(uint64_t));
+    columns->offsets = alloc_column(count, sizeof(uint64_t));
+    columns->name_hashes = alloc_column(count, sizeof(uint32_t));
+    columns->shards = alloc_column(count, sizeof(uint16_t));
+    if (!columns->flags || !columns->sizes || !columns->offsets || !columns->name_hashes || !columns->shards) {
+        free(columns->flags);
+        free(columns->sizes);
+        free(columns->offsets);
+        free(columns->name_hashes);
+        free(columns->shards);
+        pak_free(columns);
+        return NULL;
+    }
 
-    current_node = tmp;
-    if (tmp->is_dir) {
-        int64_t tmpIdx = 0;
-        while ((tmpIdx++) < tmp->entry->data_size_or_child_count) {
-            current_node = build_node_tree_recursive(handle, tmp, current_node, current_idx);
-        }
+    for (uint64_t i = 0; i < count; i++) {
+        pak_entry_t* entry = pak_get_entry_from_index(handle, i);
+        const char* name = (const char*)handle->string_table_data + entry->string_offset;
+        columns->flags[i] = entry->flags;
+        columns->shards[i] = entry->shard;
+        columns->sizes[i] = pak_get_entry_size(entry);
+        columns->name_hashes[i] = pak_hash_name(name, strlen(name));
+        if (PAK_ENTRY_IS_DIR(entry))
+            columns->offsets[i] = 0;
+        else if ((entry->flags & PAK_ENTRY_FLAGS_SOLID) && entry->data_offset_or_first_child < handle->header->block_count)
+            columns->offsets[i] = handle->block_table_data[entry->data_offset_or_first_child].data_offset;
+        else
+            columns->offsets[i] = entry->data_offset_or_first_child;
     }
-    current_node = tmp;
-    return current_node;
+    return columns;
 }
 
-void build_node_tree(pak_handle_t *handle) {
+const pak_columns_t* pak_get_columns(pak_handle_t* handle) {
     assert(handle);
-    assert(handle->header);
+    pak_columns_t* columns = __atomic_load_n(&handle->columns, __ATOMIC_ACQUIRE);
+    if (columns)
+        return columns;
+
+    pthread_mutex_lock(&handle->columns_lock);
+    columns = handle->columns;
+    if (!columns && handle->entry_table_data) {
+        columns = build_columns(handle);
+        __atomic_store_n(&handle->columns, columns, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&handle->columns_lock);
+    return columns;
+}
 
-    pak_node_t* current_node = handle->root;
-    uint64_t current_idx = 0;
-    while (current_idx < handle->header->entry_count) {
-        pak_node_t* tmp = pak_create_node();
+static inline bool query_matches(const pak_columns_t* columns, const pak_query_t* query, uint64_t i) {
+    return (columns->flags[i] & query->flags_mask) == query->flags_value &&
+           columns->sizes[i] >= query->min_size && columns->sizes[i] <= query->max_size;
+}
 
-        tmp->entry = pak_get_entry_from_index(handle, current_idx);
-        strcpy(tmp->filename, pak_get_string_from_index(handle, current_idx));
-        tmp->is_dir = PAK_ENTRY_IS_DIR(tmp->entry);
-        current_idx++;
+#ifdef PAK_HAVE_AVX2
+// Bit i of the result is set if entry first + i matches, 4 entries per step.
+// Unsigned 64 bit compares are done as signed ones with the sign bit flipped.
+__attribute__((target("avx2")))
+static uint32_t query_match_mask_avx2(const pak_columns_t* columns, const pak_query_t* query, uint64_t first) {
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i mask = _mm256_set1_epi64x(query->flags_mask);
+    const __m256i value = _mm256_set1_epi64x(query->flags_value);
+    const __m256i min = _mm256_set1_epi64x(query->min_size ^ (uint64_t)INT64_MIN);
+    const __m256i max = _mm256_set1_epi64x(query->max_size ^ (uint64_t)INT64_MIN);
+
+    uint32_t ret = 0;
+    for (int step = 0; step < 8; step++) {
+        uint64_t i = first + step * 4;
+        __m256i flags = _mm256_cvtepu16_epi64(_mm_loadl_epi64((const __m128i*)(columns->flags + i)));
+        __m256i sizes = _mm256_xor_si256(_mm256_load_si256((const __m256i*)(columns->sizes + i)), sign);
+        __m256i ok = _mm256_cmpeq_epi64(_mm256_and_si256(flags, mask), value);
+        ok = _mm256_andnot_si256(_mm256_cmpgt_epi64(min, sizes), ok);
+        ok = _mm256_andnot_si256(_mm256_cmpgt_epi64(sizes, max), ok);
+        ret |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(ok)) << (step * 4);
+    }
+    return ret;
+}
+#endif
 
-        current_node->next = tmp;
-        tmp->prev = current_node;
-        current_node = tmp;
+// Bit i of the result is set if entry first + i matches, covers 32 entries
+static uint32_t query_match_mask(const pak_columns_t* columns, const pak_query_t* query, uint64_t first) {
+#ifdef PAK_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return query_match_mask_avx2(columns, query, first);
+#endif
+    uint32_t ret = 0;
+    for (int i = 0; i < 32; i++) {
+        if (query_matches(columns, query, first + i))
+            ret |= 1u << i;
+    }
+    return ret;
+}
 
-        if (tmp->is_dir) {
-            int64_t tmpIdx = 0;
-            while ((tmpIdx++) < tmp->entry->data_size_or_child_count) {
-                current_node = build_node_tree_recursive(handle, tmp, current_node, &current_idx);
-            }
-            current_node = tmp;
+uint64_t pak_query(pak_handle_t* handle, const pak_query_t* query, uint64_t* indices, uint64_t capacity) {
+    assert(handle);
+    assert(query);
+    const pak_columns_t* columns = pak_get_columns(handle);
+    if (!columns)
+        return 0;
+
+    uint64_t count = handle->header->entry_count;
+    uint64_t found = 0;
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        uint32_t bits = query_match_mask(columns, query, i);
+        while (bits) {
+            if (indices && found < capacity)
+                indices[found] = i + __builtin_ctz(bits);
+            found++;
+            bits &= bits - 1;
         }
     }
-
-    current_node->next = NULL;
+    for (; i < count; i++) {
+        if (query_matches(columns, query, i)) {
+            if (indices && found < capacity)
+                indices[found] = i;
+            found++;
+        }
+    }
+    return found;
 }
 
-pak_node_t* find_recursive(pak_node_t* node, const char* filename, char* curpath) {
-    assert(node);
+uint64_t pak_query_size(pak_handle_t* handle, const pak_query_t* query) {
+    assert(handle);
+    assert(query);
+    const pak_columns_t* columns = pak_get_columns(handle);
+    if (!columns)
+        return 0;
+
+    uint64_t count = handle->header->entry_count;
+    uint64_t total = 0;
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        uint32_t bits = query_match_mask(columns, query, i);
+        if (bits == UINT32_MAX) {
+            // the common "everything matches" case stays a straight sum the compiler vectorizes
+            for (int j = 0; j < 32; j++)
+                total += columns->sizes[i + j];
+            continue;
+        }
+        while (bits) {
+            total += columns->sizes[i + __builtin_ctz(bits)];
+            bits &= bits - 1;
+        }
+    }
+    for (; i < count; i++) {
+        if (query_matches(columns, query, i))
+            total += columns->sizes[i];
+    }
+    return total;
+}
+
+int64_t pak_find_index_n(pak_handle_t* handle, const char* path, size_t len) {
+    assert(handle);
+    assert(handle->subtree_end);
+    uint64_t first = 0;
+    uint64_t end = handle->header->entry_count;
+    int64_t found = -1;
+    size_t pos = 0;
+
+    while (pos < len) {
+        while (pos < len && path[pos] == '/')
+            pos++;
+        if (pos == len)
+            break;
+
+        size_t name_len = 0;
+        while (pos + name_len < len && path[pos + name_len] != '/')
+            name_len++;
+
+        found = -1;
+        const pak_columns_t* columns = __atomic_load_n(&handle->columns, __ATOMIC_ACQUIRE);
+        if (columns) {
+            // with the column view built, siblings are rejected by hash without touching their names
+            uint32_t hash = pak_hash_name(path + pos, name_len);
+            for (uint64_t i = first; i < end; i = handle->subtree_end[i]) {
+                if (columns->name_hashes[i] == hash && entry_name_equals(handle, i, path + pos, name_len)) {
+                    found = i;
+                    break;
+                }
+            }
+        } else {
+            for (uint64_t i = first; i < end; i = handle->subtree_end[i]) {
+                if (entry_name_equals(handle, i, path + pos, name_len)) {
+                    found = i;
+                    break;
+                }
+            }
+        }
+        if (found < 0)
+            return -1;
+
+        pos += name_len;
+        first = found + 1;
+        end = handle->subtree_end[found];
+    }
+
+    return found;
+}
+
+int64_t pak_find_index(pak_handle_t* handle, const char* path) {
+    assert(path);
+    return pak_find_index_n(handle, path, strlen(path));
+}
+
+static bool path_is_root(const char* path) {
+    while (*path == '/')
+        path++;
+    return *path == '\0';
+}
+
+bool pak_opendir(pak_handle_t* handle, const char* path, pak_dir_t* dir) {
+    assert(handle);
+    assert(dir);
+    dir->handle = handle;
+    if (!path || path_is_root(path)) {
+        dir->next = 0;
+        dir->end = handle->header->entry_count;
+        dir->parent = -1;
+        return true;
+    }
+
+    int64_t index = pak_find_index(handle, path);
+    if (index < 0)
+        return false;
+    return pak_opendir_index(handle, index, dir);
+}
+
+bool pak_opendir_index(pak_handle_t* handle, uint64_t index, pak_dir_t* dir) {
+    assert(handle);
+    assert(dir);
+    if (index >= handle->header->entry_count || !PAK_ENTRY_IS_DIR(pak_get_entry_from_index(handle, index)))
+        return false;
+
+    dir->handle = handle;
+    dir->next = index + 1;
+    dir->end = handle->subtree_end[index];
+    dir->parent = index;
+    return true;
+}
+
+bool pak_readdir(pak_dir_t* dir, pak_dirent_t* ent) {
+    assert(dir);
+    assert(ent);
+    if (dir->next >= dir->end)
+        return false;
+
+    ent->index = dir->next;
+    ent->parent = dir->parent;
+    ent->entry = pak_get_entry_from_index(dir->handle, dir->next);
+    ent->name = pak_get_string_from_index(dir->handle, dir->next);
+    ent->is_dir = PAK_ENTRY_IS_DIR(ent->entry);
+    dir->next = dir->handle->subtree_end[dir->next];
+    return true;
+}
+
+static int walk_recursive(pak_handle_t* handle, pak_dir_t* dir, char* path, size_t path_len, const char* pattern,
+                          pak_walk_callback callback, void* user_data) {
+    pak_dirent_t ent;
+    while (pak_readdir(dir, &ent)) {
+        size_t name_len = strlen(ent.name);
+        if (path_len + name_len + 2 > FILENAME_MAX)
+            continue;
+
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, ent.name, name_len + 1);
+
+        if (!pattern || !fnmatch(pattern, path, 0)) {
+            int ret = callback(handle, path, &ent, user_data);
+            if (ret)
+                return ret;
+        }
+
+        if (ent.is_dir) {
+            pak_dir_t child;
+            pak_opendir_index(handle, ent.index, &child);
+            int ret = walk_recursive(handle, &child, path, path_len + 1 + name_len, pattern, callback, user_data);
+            if (ret)
+                return ret;
+        }
+        path[path_len] = '\0';
+    }
+    return 0;
+}
+
+int pak_walk(pak_handle_t* handle, const char* root, const char* pattern, pak_walk_callback callback, void* user_data) {
+    assert(handle);
+    assert(callback);
+    pak_dir_t dir;
+    if (!pak_opendir(handle, root, &dir))
+        return -1;
+
+    // paths are built in place, the callback sees "/<root>/<name>"
+    char path[FILENAME_MAX] = {'\0'};
+    size_t path_len = 0;
+    if (root && !path_is_root(root)) {
+        if (root[0] != '/')
+            path[path_len++] = '/';
+        strncpy(path + path_len, root, FILENAME_MAX - path_len - 1);
+        path_len = strlen(path);
+        while (path_len > 0 && path[path_len - 1] == '/')
+            path[--path_len] = '\0';
+    }
+
+    return walk_recursive(handle, &dir, path, path_len, pattern, callback, user_data);
+}
+
+pak_entry_t* pak_create_entry() {
+    pak_entry_t* ret = NULL;
+    ret = pak_alloc(sizeof(pak_entry_t));
+    assert(ret);
+    pak_clear(ret, sizeof(pak_entry_t));
+    ret->shard = 0;
+
+    return ret;
+}
+
+void pak_free_entry(pak_entry_t* entry) {
+    assert(entry);
+    pak_free(entry);
+}
+
+
+pak_node_t* build_node_tree_recursive(pak_handle_t* handle, pak_node_t* parent, pak_node_t* current_node, uint64_t* current_idx) {
+    assert(handle);
+    pak_node_t* tmp = pak_create_node();
+    tmp->entry = pak_get_entry_from_index(handle, *current_idx);
+    strcpy(tmp->filename, pak_get_string_from_index(handle, *current_idx));
+    tmp->is_dir = PAK_ENTRY_IS_DIR(tmp->entry);
+    (*current_idx)++;
+
+    if (parent && (!parent->child))
+        parent->child = tmp;
+
+    if (parent)
+        tmp->parent = parent;
+
+    if (current_node != parent)
+        current_node->next = tmp;
+
+    tmp->prev = current_node;
+
+    current_node = tmp;
+    if (tmp->is_dir) {
+        uint64_t tmpIdx = 0;
+        while ((tmpIdx++) < tmp->entry->data_size_or_child_count) {
+            current_node = build_node_tree_recursive(handle, tmp, current_node, current_idx);
+        }
+    }
+    current_node = tmp;
+    return current_node;
+}
+
+void build_node_tree(pak_handle_t *handle) {
+    assert(handle);
+    assert(handle->header);
+
+    pak_node_t* current_node = handle->root;
+    uint64_t current_idx = 0;
+    while (current_idx < handle->header->entry_count) {
+        pak_node_t* tmp = pak_create_node();
+
+        tmp->entry = pak_get_entry_from_index(handle, current_idx);
+        strcpy(tmp->filename, pak_get_string_from_index(handle, current_idx));
+        tmp->is_dir = PAK_ENTRY_IS_DIR(tmp->entry);
+        current_idx++;
+
+        current_node->next = tmp;
+        tmp->prev = current_node;
+        current_node = tmp;
+
+        if (tmp->is_dir) {
+            uint64_t tmpIdx = 0;
+            while ((tmpIdx++) < tmp->entry->data_size_or_child_count) {
+                current_node = build_node_tree_recursive(handle, tmp, current_node, &current_idx);
+            }
+            current_node = tmp;
+        }
+    }
+
+    current_node->next = NULL;
+}
+
+static void ensure_node_tree(pak_handle_t* handle) {
+    if (__atomic_load_n(&handle->nodes_built, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&handle->nodes_lock);
+    if (!handle->nodes_built && handle->root && handle->entry_table_data) {
+        build_node_tree(handle);
+        __atomic_store_n(&handle->nodes_built, true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&handle->nodes_lock);
+}
+
+pak_node_t* find_recursive(pak_node_t* node, const char* filename, char* curpath) {
+    assert(node);
     assert(curpath);
     pak_node_t* ret = NULL;
     char tmp[FILENAME_MAX];
@@ -353,8 +1321,23 @@ pak_node_t* find_recursive(pak_node_t* node, const char* filename, char* curpath
     return ret;
 }
 
+#ifdef PAK_ENABLE_STATS
+static void pak_find_done(pak_handle_t* handle, const char* path, pak_node_t* found, uint64_t start) {
+    PAK_STAT_ADD(handle, lookups, 1);
+    if (!found)
+        PAK_STAT_ADD(handle, lookup_misses, 1);
+    PAK_STAT_ELAPSED(handle, lookup_ns, start);
+    PAK_TRACE(handle, PAK_TRACE_FIND, PAK_TRACE_END, path, 0);
+}
+#else
+#define pak_find_done(handle, path, found, start) ((void)0)
+#endif
+
 pak_node_t* pak_find_file(pak_handle_t* handle, const char* filepath) {
     assert(handle);
+    ensure_node_tree(handle);
+    PAK_STAT_START(start);
+    PAK_TRACE(handle, PAK_TRACE_FIND, PAK_TRACE_BEGIN, filepath, 0);
     pak_node_t* node = handle->root;
     pak_node_t* ret = NULL;
     char curpath[FILENAME_MAX] = {'\0'};
@@ -366,12 +1349,16 @@ pak_node_t* pak_find_file(pak_handle_t* handle, const char* filepath) {
         node = node->next;
     }
 
+    pak_find_done(handle, filepath, (ret && !ret->is_dir) ? ret : NULL, start);
     return ret;
 }
 
 
 pak_node_t* pak_find_dir(pak_handle_t* handle, const char* path) {
     assert(handle);
+    ensure_node_tree(handle);
+    PAK_STAT_START(start);
+    PAK_TRACE(handle, PAK_TRACE_FIND, PAK_TRACE_BEGIN, path, 0);
     pak_node_t* node = handle->root;
     pak_node_t* ret = NULL;
     char curpath[FILENAME_MAX] = {'\0'};
@@ -384,11 +1371,15 @@ pak_node_t* pak_find_dir(pak_handle_t* handle, const char* path) {
         node = node->next;
     }
 
+    pak_find_done(handle, path, (ret && ret->is_dir) ? ret : NULL, start);
     return ret;
 }
 
 pak_node_t* pak_find(pak_handle_t* handle, const char* filepath) {
     assert(handle);
+    ensure_node_tree(handle);
+    PAK_STAT_START(start);
+    PAK_TRACE(handle, PAK_TRACE_FIND, PAK_TRACE_BEGIN, filepath, 0);
     pak_node_t* node = handle->root;
     pak_node_t* ret = NULL;
     char curpath[FILENAME_MAX] = {'\0'};
@@ -400,6 +1391,7 @@ pak_node_t* pak_find(pak_handle_t* handle, const char* filepath) {
         node = node->next;
     }
 
+    pak_find_done(handle, filepath, ret, start);
     return ret;
 }
 
@@ -413,10 +1405,46 @@ void pak_free_file(pak_file_t* file) {
     pak_free(file);
 }
 
+// Builds "/dir/name" for an entry by descending through the subtrees that hold it
+static bool entry_path(pak_handle_t* handle, uint64_t index, char* buf, size_t size) {
+    size_t len = 0;
+    uint64_t i = 0;
+    uint64_t end = handle->header->entry_count;
+    while (i < end) {
+        if (index >= handle->subtree_end[i]) {
+            i = handle->subtree_end[i];
+            continue;
+        }
+
+        int n = snprintf(buf + len, size - len, "/%s", pak_get_string_from_index(handle, i));
+        if (n < 0 || (size_t)n >= size - len)
+            return false;
+        len += n;
+        if (i == index)
+            return true;
+        end = handle->subtree_end[i];
+        i++;
+    }
+    return false;
+}
+
+// paks built with an order file store the next files to be loaded right after this one
+static void advise_file(pak_handle_t* handle, pak_entry_t* entry) {
+    if (entry->flags & PAK_ENTRY_FLAGS_SOLID) {
+        if ((uint64_t)entry->data_offset_or_first_child < handle->header->block_count) {
+            pak_block_t* block = &handle->block_table_data[entry->data_offset_or_first_child];
+            pak_advise_data(handle, entry->shard, block->data_offset, block->data_size + PAK_READAHEAD_WINDOW);
+        }
+    } else if (!PAK_ENTRY_IS_DIR(entry)) {
+        pak_advise_data(handle, entry->shard, entry->data_offset_or_first_child,
+                        entry->data_size_or_child_count + PAK_READAHEAD_WINDOW);
+    }
+}
+
 pak_file_t* pak_open_file(pak_handle_t* handle, const char* filepath) {
     assert(handle);
     char tmppath[FILENAME_MAX] = {'\0'};
-    if (filepath[0] != '/');
+    if (filepath[0] != '/')
         strcat(tmppath, "/");
     strcat(tmppath, filepath);
 
@@ -429,77 +1457,1814 @@ pak_file_t* pak_open_file(pak_handle_t* handle, const char* filepath) {
         return NULL;
     }
 
+    ret->entry = ret->node->entry;
+    ret->index = pak_get_index_from_entry(handle, ret->entry);
     strcpy((char*)ret->filepath, tmppath);
+    PAK_STAT_ADD(handle, files_opened, 1);
+
+    if (handle->access_log) {
+        fprintf(handle->access_log, "%s\n", tmppath);
+        fflush(handle->access_log);
+    }
+
+    advise_file(handle, ret->entry);
     return ret;
 }
 
-void pak_close_file(pak_file_t* handle) {
+pak_file_t* pak_open_index(pak_handle_t* handle, uint64_t index) {
     assert(handle);
-    pak_free_file(handle);
-}
+    if (index >= handle->header->entry_count)
+        return NULL;
 
-uint32_t pak_file_read_uint(pak_file_t* file) {
-    assert(file);
-    pak_handle_t* handle = file->handle;
-    uint32_t ret;
-    fseek(handle->file, handle->header->data_offset + file->node->entry->data_offset_or_first_child + file->position, SEEK_SET);
-    fread(&ret, 1, sizeof(uint32_t), handle->file);
+    pak_file_t* ret = pak_create_file();
+    ret->handle = handle;
+    ret->entry = pak_get_entry_from_index(handle, index);
+    ret->index = index;
+    PAK_STAT_ADD(handle, files_opened, 1);
+
+    if (handle->access_log) {
+        char path[FILENAME_MAX];
+        if (entry_path(handle, index, path, sizeof(path))) {
+            fprintf(handle->access_log, "%s\n", path);
+            fflush(handle->access_log);
+        }
+    }
 
+    advise_file(handle, ret->entry);
     return ret;
 }
 
-pak_node_t* pak_create_node() {
-    pak_node_t* ret = pak_alloc(sizeof(pak_node_t));
-    assert(ret);
-    memset(ret, 0, sizeof(pak_node_t));
-    ret->child = NULL;
-    ret->entry = NULL;
-    ret->is_dir = false;
-    ret->next = NULL;
-    ret->prev = NULL;
-    ret->parent = NULL;
-    return ret;
+// Where the bytes of an entry stored as is start in its shard's data, directly or in an uncompressed
+// solid block. False for directories and compressed data.
+static bool stored_offset(pak_handle_t* handle, const pak_entry_t* entry, uint64_t* offset) {
+    if (PAK_ENTRY_IS_DIR(entry))
+        return false;
+    *offset = entry->data_offset_or_first_child;
+    if (entry->flags & PAK_ENTRY_FLAGS_SOLID) {
+        if (*offset >= handle->header->block_count)
+            return false;
+        pak_block_t* block = &handle->block_table_data[*offset];
+        if (block->data_size != block->data_uncompressed_size)
+            return false;
+        *offset = block->data_offset + entry->data_uncompressed_size;
+        return true;
+    }
+    return !(entry->flags & PAK_ENTRY_FLAGS_COMPRESSED);
 }
 
-void pak_free_node(pak_node_t* node) {
-    assert(node);
-    if (node->next && node->next != node)
-        pak_free_node(node->next);
-    if (node->is_dir && node->child)
-        pak_free_node(node->child);
-    node->next = NULL;
-    node->child = NULL;
+bool pak_map_index(pak_handle_t* handle, uint64_t index, pak_mapping_t* mapping) {
+    assert(handle);
+    assert(mapping);
+    memset(mapping, 0, sizeof(pak_mapping_t));
+    if (index >= handle->header->entry_count)
+        return false;
 
-    pak_free(node);
+    pak_entry_t* entry = pak_get_entry_from_index(handle, index);
+    uint64_t offset;
+    if (!stored_offset(handle, entry, &offset))
+        return false;
+
+    int fd = shard_fd(handle, entry->shard);
+    if (fd < 0)
+        return false;
+    uint64_t size = pak_get_entry_size(entry);
+    if (!size) {
+        mapping->data = "";
+        return true;
+    }
+
+    uint64_t start = shard_base(handle, entry->shard) + offset;
+    uint64_t aligned = start & ~((uint64_t)sysconf(_SC_PAGESIZE) - 1);
+    size_t length = size + (start - aligned);
+    PAK_STAT_ADD(handle, syscalls, 1);
+    void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (base == MAP_FAILED)
+        return false;
+
+    mapping->base = base;
+    mapping->length = length;
+    mapping->data = (char*)base + (start - aligned);
+    mapping->size = size;
+    return true;
 }
 
+void pak_unmap(pak_mapping_t* mapping) {
+    assert(mapping);
+    if (mapping->base)
+        munmap(mapping->base, mapping->length);
+    memset(mapping, 0, sizeof(pak_mapping_t));
+}
 
-size_t pak_file_seek(pak_file_t* file, int64_t offset, int whence) {
-    assert(file);
+bool pak_set_access_log(pak_handle_t* handle, const char* filename) {
+    assert(handle);
+    if (handle->access_log) {
+        fclose(handle->access_log);
+        handle->access_log = NULL;
+    }
 
-    switch (whence) {
-        case SEEK_SET: {
-            if (!(offset >= 0 && offset <= file->node->entry->data_size_or_child_count))
-                return -1;
+    if (!filename)
+        return true;
+
+    handle->access_log = fopen(filename, "a");
+    return handle->access_log != NULL;
+}
+
+// The counters are bumped with relaxed atomic adds from any thread, so they're read and cleared one
+// uint64_t at a time as well
+_Static_assert(sizeof(pak_stats_t) % sizeof(uint64_t) == 0, "pak_stats_t holds only uint64_t counters");
+
+void pak_get_stats(pak_handle_t* handle, pak_stats_t* stats) {
+    assert(handle);
+    assert(stats);
+    const uint64_t* from = (const uint64_t*)&handle->stats;
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(pak_stats_t) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+void pak_reset_stats(pak_handle_t* handle) {
+    assert(handle);
+    uint64_t* counters = (uint64_t*)&handle->stats;
+    for (size_t i = 0; i < sizeof(pak_stats_t) / sizeof(uint64_t); i++)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
 
-            file->position = offset;
+void pak_set_default_trace_callback(pak_trace_callback callback, void* user_data) {
+    default_trace = callback;
+    default_trace_user_data = user_data;
+}
+
+void pak_set_trace_callback(pak_handle_t* handle, pak_trace_callback callback, void* user_data) {
+    assert(handle);
+    handle->trace = callback;
+    handle->trace_user_data = user_data;
+}
+
+
+// Copies part of a cached buffer while holding the lock, so eviction can't free it underneath us
+static bool pak_cache_copy(pak_cache_t* cache, uint64_t key, uint64_t offset, void* buf, uint64_t size) {
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < PAK_CACHE_SLOTS; i++) {
+        pak_cache_slot_t* slot = &cache->slots[i];
+        if (slot->data && slot->key == key) {
+            if (offset + size <= slot->size) {
+                slot->last_use = ++cache->tick;
+                memcpy(buf, (char*)slot->data + offset, size);
+                found = true;
+            }
             break;
         }
-        case SEEK_CUR: {
-            if (!(file->position + offset >= 0 && file->position + offset <= file->node->entry->data_size_or_child_count))
-                return -1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+// takes ownership of data, evicting the least recently used slot if needed
+static void pak_cache_insert(pak_cache_t* cache, uint64_t key, void* data, uint64_t size) {
+    pthread_mutex_lock(&cache->lock);
+    pak_cache_slot_t* slot = &cache->slots[0];
+    for (int i = 0; i < PAK_CACHE_SLOTS; i++) {
+        if (cache->slots[i].data && cache->slots[i].key == key) {
+            // another thread decoded the same thing first
+            pthread_mutex_unlock(&cache->lock);
+            free(data);
+            return;
+        }
+        if (!cache->slots[i].data) {
+            if (slot->data)
+                slot = &cache->slots[i];
+            continue;
+        }
+        if (slot->data && cache->slots[i].last_use < slot->last_use)
+            slot = &cache->slots[i];
+    }
+
+    free(slot->data);
+    slot->key = key;
+    slot->data = data;
+    slot->size = size;
+    slot->last_use = ++cache->tick;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Inflates src_len bytes stored at offset in the shard straight into dst, the compressed side goes through
+// a small per thread scratch buffer. Streams built with the archive dictionary get it handed to them.
+static bool pak_inflate_at(pak_handle_t* handle, uint16_t shard, uint64_t offset, uint64_t src_len, void* dst, uint64_t dst_len) {
+    static __thread uint8_t scratch[PAK_SCRATCH_SIZE];
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if (inflateInit(&strm) != Z_OK)
+        return false;
+
+    PAK_TRACE(handle, PAK_TRACE_DECOMPRESS, PAK_TRACE_BEGIN, NULL, 0);
+    strm.next_out = dst;
+    uint64_t out_left = dst_len;        // avail_out is 32 bit, refill it as it drains
+    uint64_t consumed = 0;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        if (!strm.avail_out && out_left) {
+            strm.avail_out = out_left > UINT32_MAX ? UINT32_MAX : out_left;
+            out_left -= strm.avail_out;
+        }
+        if (!strm.avail_in) {
+            uint64_t chunk = src_len - consumed;
+            if (!chunk)
+                break;
+            if (chunk > PAK_SCRATCH_SIZE)
+                chunk = PAK_SCRATCH_SIZE;
+            if (!pak_read_data(handle, shard, scratch, chunk, offset + consumed))
+                break;
+            consumed += chunk;
+            strm.next_in = scratch;
+            strm.avail_in = chunk;
+        }
 
-            file->position += offset;
+        PAK_STAT_START(start);
+        ret = inflate(&strm, Z_NO_FLUSH);
+        PAK_STAT_ELAPSED(handle, decompress_ns, start);
+        if (ret == Z_NEED_DICT && handle->dictionary_data)
+            ret = inflateSetDictionary(&strm, handle->dictionary_data, handle->header->dictionary_size);
+        if (ret != Z_OK && ret != Z_STREAM_END)
             break;
+        if (ret == Z_OK && !strm.avail_out && !out_left && strm.avail_in)
+            break;  // more output than the entry claims
+    }
+
+    bool ok = (ret == Z_STREAM_END && strm.total_out == dst_len);
+    PAK_STAT_ADD(handle, bytes_decompressed, strm.total_out);
+    PAK_TRACE(handle, PAK_TRACE_DECOMPRESS, PAK_TRACE_END, NULL, strm.total_out);
+    inflateEnd(&strm);
+    return ok;
+}
+
+// Resumable inflate over one compressed entry, pak_file_t keeps one between reads
+typedef struct _pak_stream {
+    z_stream strm;
+    bool active;
+    uint64_t entry_index;
+    uint64_t position;                  // decoded offset of the next byte inflate produces
+    uint64_t in_offset;                 // next compressed byte to load, relative to the entry's stored data
+    uint8_t in[PAK_SCRATCH_SIZE];
+} pak_stream_t;
+
+// Last checkpoint of the entry at or before offset, NULL if there is none
+static const pak_checkpoint_t* find_checkpoint(pak_handle_t* handle, uint64_t entry_index, uint64_t offset) {
+    const pak_checkpoint_t* table = handle->checkpoint_table_data;
+    uint64_t lo = 0;
+    uint64_t hi = handle->header->checkpoint_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (table[mid].entry_index < entry_index ||
+            (table[mid].entry_index == entry_index && table[mid].uncompressed_offset <= offset))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo && table[lo - 1].entry_index == entry_index)
+        return &table[lo - 1];
+    return NULL;
+}
+
+static void stream_end(pak_stream_t* stream) {
+    if (stream->active)
+        inflateEnd(&stream->strm);
+    stream->active = false;
+}
+
+// Starts decoding at the checkpoint, or at the beginning of the entry's zlib stream if there is none
+static bool stream_start(pak_stream_t* stream, uint64_t entry_index, const pak_checkpoint_t* checkpoint) {
+    stream_end(stream);
+    memset(&stream->strm, 0, sizeof(z_stream));
+    int ret = checkpoint ? inflateInit2(&stream->strm, -MAX_WBITS) : inflateInit(&stream->strm);
+    if (ret != Z_OK)
+        return false;
+
+    stream->active = true;
+    stream->entry_index = entry_index;
+    stream->position = checkpoint ? checkpoint->uncompressed_offset : 0;
+    stream->in_offset = checkpoint ? checkpoint->compressed_offset : 0;
+    return true;
+}
+
+// Produces the next size decoded bytes into dst, dst NULL throws them away
+static bool stream_inflate(pak_handle_t* handle, pak_stream_t* stream, pak_entry_t* entry, uint8_t* dst, uint64_t size) {
+    static __thread uint8_t discard[PAK_SCRATCH_SIZE];
+    uint64_t data_start = entry->data_offset_or_first_child;
+    z_stream* strm = &stream->strm;
+
+    while (size) {
+        uint64_t chunk = size;
+        if (!dst && chunk > PAK_SCRATCH_SIZE)
+            chunk = PAK_SCRATCH_SIZE;
+        if (chunk > UINT32_MAX)
+            chunk = UINT32_MAX;
+        strm->next_out = dst ? dst : discard;
+        strm->avail_out = chunk;
+
+        while (strm->avail_out) {
+            if (!strm->avail_in) {
+                uint64_t load = entry->data_size_or_child_count - stream->in_offset;
+                if (!load)
+                    return false;
+                if (load > PAK_SCRATCH_SIZE)
+                    load = PAK_SCRATCH_SIZE;
+                if (!pak_read_data(handle, entry->shard, stream->in, load, data_start + stream->in_offset))
+                    return false;
+                stream->in_offset += load;
+                strm->next_in = stream->in;
+                strm->avail_in = load;
+            }
+
+            PAK_STAT_START(start);
+            int ret = inflate(strm, Z_NO_FLUSH);
+            PAK_STAT_ELAPSED(handle, decompress_ns, start);
+            if (ret == Z_NEED_DICT && handle->dictionary_data)
+                ret = inflateSetDictionary(strm, handle->dictionary_data, handle->header->dictionary_size);
+            if (ret == Z_STREAM_END && strm->avail_out)
+                return false;   // the entry is shorter than it claims
+            if (ret != Z_OK && ret != Z_STREAM_END)
+                return false;
         }
-        case SEEK_END: {
-            if (!((int64_t)(file->node->entry->data_size_or_child_count - offset) >= 0 && (int64_t)(file->node->entry->data_size_or_child_count - offset) <= file->node->entry->data_size_or_child_count))
-                return -1;
 
-            file->position = file->node->entry->data_size_or_child_count - offset;
+        PAK_STAT_ADD(handle, bytes_decompressed, chunk);
+        stream->position += chunk;
+        size -= chunk;
+        if (dst)
+            dst += chunk;
+    }
+    return true;
+}
+
+// Moving backwards, or forward past a checkpoint, restarts at the closest checkpoint,
+// anything else carries on from where the last read stopped
+static int64_t stream_read(pak_handle_t* handle, pak_stream_t* stream, uint64_t entry_index, pak_entry_t* entry,
+                           void* buf, uint64_t offset, uint64_t size) {
+    const pak_checkpoint_t* checkpoint = find_checkpoint(handle, entry_index, offset);
+    uint64_t restart = checkpoint ? checkpoint->uncompressed_offset : 0;
+    if (!stream->active || stream->entry_index != entry_index || offset < stream->position || restart > stream->position) {
+        if (!stream_start(stream, entry_index, checkpoint))
+            return -1;
+    }
+
+    PAK_TRACE(handle, PAK_TRACE_DECOMPRESS, PAK_TRACE_BEGIN, NULL, 0);
+    bool ok = stream_inflate(handle, stream, entry, NULL, offset - stream->position) &&
+              stream_inflate(handle, stream, entry, buf, size);
+    PAK_TRACE(handle, PAK_TRACE_DECOMPRESS, PAK_TRACE_END, NULL, ok ? size : 0);
+    if (!ok) {
+        stream_end(stream);
+        return -1;
+    }
+    return size;
+}
+
+static bool pak_cache_contains(pak_cache_t* cache, uint64_t key) {
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < PAK_CACHE_SLOTS; i++) {
+        if (cache->slots[i].data && cache->slots[i].key == key) {
+            found = true;
             break;
         }
     }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+// Returns a malloced copy of the decoded block, blocks live in the shard of the entries packed in them
+static void* decode_block(pak_handle_t* handle, uint16_t shard, uint64_t index) {
+    pak_block_t* block = &handle->block_table_data[index];
+    void* data = malloc(block->data_uncompressed_size);
+    bool ok;
+    if (block->data_size == block->data_uncompressed_size)
+        ok = pak_read_data(handle, shard, data, block->data_size, block->data_offset);
+    else
+        ok = pak_inflate_at(handle, shard, block->data_offset, block->data_size, data, block->data_uncompressed_size);
+
+    if (!ok) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Copies part of a decoded solid block, decoding it into the cache if needed
+static bool pak_read_block(pak_handle_t* handle, uint16_t shard, uint64_t index, uint64_t offset, void* buf, uint64_t size) {
+    if (index >= handle->header->block_count)
+        return false;
+
+    if (pak_cache_copy(&handle->cache, PAK_CACHE_KEY_BLOCK(index), offset, buf, size)) {
+        PAK_STAT_ADD(handle, cache_hits, 1);
+        return true;
+    }
+    PAK_STAT_ADD(handle, cache_misses, 1);
+
+    pak_block_t* block = &handle->block_table_data[index];
+    if (offset + size > block->data_uncompressed_size)
+        return false;
+
+    void* data = decode_block(handle, shard, index);
+    if (!data)
+        return false;
+
+    memcpy(buf, (char*)data + offset, size);
+    pak_cache_insert(&handle->cache, PAK_CACHE_KEY_BLOCK(index), data, block->data_uncompressed_size);
+    return true;
+}
+
+uint64_t pak_get_entry_size(const pak_entry_t* entry) {
+    assert(entry);
+    if (PAK_ENTRY_IS_DIR(entry))
+        return 0;
+    if ((entry->flags & (PAK_ENTRY_FLAGS_COMPRESSED | PAK_ENTRY_FLAGS_SOLID)) == PAK_ENTRY_FLAGS_COMPRESSED)
+        return entry->data_uncompressed_size;
+    return entry->data_size_or_child_count;
+}
+
+uint64_t pak_get_node_size(pak_node_t* node) {
+    assert(node);
+    if (node->is_dir)
+        return 0;
+    return pak_get_entry_size(node->entry);
+}
+
+static bool entry_is_deflated(const pak_entry_t* entry) {
+    return (entry->flags & (PAK_ENTRY_FLAGS_COMPRESSED | PAK_ENTRY_FLAGS_SOLID | PAK_ENTRY_FLAGS_DIR)) == PAK_ENTRY_FLAGS_COMPRESSED;
+}
+
+// Reads a whole non-solid entry from the archive, bypassing the cache
+static bool load_entry(pak_handle_t* handle, pak_entry_t* entry, void* buf) {
+    uint64_t data_start = entry->data_offset_or_first_child;
+    if (entry->flags & PAK_ENTRY_FLAGS_COMPRESSED)
+        return pak_inflate_at(handle, entry->shard, data_start, entry->data_size_or_child_count, buf, pak_get_entry_size(entry));
+    return pak_read_data(handle, entry->shard, buf, pak_get_entry_size(entry), data_start);
+}
+
+static int64_t read_range(pak_handle_t* handle, pak_entry_t* entry, void* buf, uint64_t offset, uint64_t size);
+
+static int64_t read_entry(pak_handle_t* handle, pak_entry_t* entry, void* buf, uint64_t buf_size) {
+    uint64_t size = pak_get_entry_size(entry);
+    if (PAK_ENTRY_IS_DIR(entry) || buf_size < size)
+        return -1;
+
+    if ((entry->flags & PAK_ENTRY_FLAGS_SOLID) || entry_is_deflated(entry))
+        return read_range(handle, entry, buf, 0, size);
+
+    return load_entry(handle, entry, buf) ? (int64_t)size : -1;
+}
+
+static int64_t read_range(pak_handle_t* handle, pak_entry_t* entry, void* buf, uint64_t offset, uint64_t size) {
+    if (PAK_ENTRY_IS_DIR(entry))
+        return -1;
+
+    uint64_t entry_size = pak_get_entry_size(entry);
+    if (offset >= entry_size)
+        return 0;
+    if (size > entry_size - offset)
+        size = entry_size - offset;
+
+    if (entry->flags & PAK_ENTRY_FLAGS_SOLID) {
+        if (!pak_read_block(handle, entry->shard, entry->data_offset_or_first_child, entry->data_uncompressed_size + offset, buf, size))
+            return -1;
+        return size;
+    }
+
+    if (entry->flags & PAK_ENTRY_FLAGS_COMPRESSED) {
+        // a prefetch or an earlier partial read may have left the decoded entry in the cache
+        int64_t index = pak_get_index_from_entry(handle, entry);
+        uint64_t key = PAK_CACHE_KEY_ENTRY(index);
+        if (pak_cache_copy(&handle->cache, key, offset, buf, size)) {
+            PAK_STAT_ADD(handle, cache_hits, 1);
+            return size;
+        }
+        PAK_STAT_ADD(handle, cache_misses, 1);
+
+        if (offset == 0 && size == entry_size)
+            return load_entry(handle, entry, buf) ? (int64_t)size : -1;
+
+        // entries too big to keep decoded restart from the closest checkpoint instead
+        if (entry_size > PAK_CACHE_MAX_ENTRY_SIZE) {
+            pak_stream_t* stream = malloc(sizeof(pak_stream_t));
+            stream->active = false;
+            int64_t ret = stream_read(handle, stream, index, entry, buf, offset, size);
+            stream_end(stream);
+            free(stream);
+            return ret;
+        }
+
+        // partial reads of a compressed stream have to decode everything in front of them,
+        // keep the result around for the next read of the same entry
+        void* data = malloc(entry_size);
+        if (!load_entry(handle, entry, data)) {
+            free(data);
+            return -1;
+        }
+
+        memcpy(buf, (char*)data + offset, size);
+        pak_cache_insert(&handle->cache, key, data, entry_size);
+        return size;
+    }
+
+    if (!pak_read_data(handle, entry->shard, buf, size, entry->data_offset_or_first_child + offset))
+        return -1;
+    return size;
+}
+
+int64_t pak_read_entry(pak_handle_t* handle, pak_node_t* node, void* buf, uint64_t buf_size) {
+    assert(handle);
+    assert(node);
+    if (node->is_dir)
+        return -1;
+    PAK_STAT_ADD(handle, reads, 1);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_BEGIN, node->filename, 0);
+    int64_t ret = read_entry(handle, node->entry, buf, buf_size);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_END, node->filename, ret > 0 ? ret : 0);
+    return ret;
+}
+
+int64_t pak_read_node(pak_handle_t* handle, pak_node_t* node, void* buf, uint64_t offset, uint64_t size) {
+    assert(handle);
+    assert(node);
+    if (node->is_dir)
+        return -1;
+    PAK_STAT_ADD(handle, reads, 1);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_BEGIN, node->filename, 0);
+    int64_t ret = read_range(handle, node->entry, buf, offset, size);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_END, node->filename, ret > 0 ? ret : 0);
+    return ret;
+}
+
+int64_t pak_read_index(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size) {
+    assert(handle);
+    if (index >= handle->header->entry_count)
+        return -1;
+    const char* name = pak_get_string_from_index(handle, index);
+    PAK_STAT_ADD(handle, reads, 1);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_BEGIN, name, 0);
+    int64_t ret = read_range(handle, pak_get_entry_from_index(handle, index), buf, offset, size);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_END, name, ret > 0 ? ret : 0);
+    return ret;
+}
+
+#define PAK_COPY_CHUNK (1 << 30)     // sendfile moves a little under 2 GiB per call
+
+static bool write_all(int fd, const void* buf, uint64_t size) {
+    while (size) {
+        ssize_t ret = write(fd, buf, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        buf = (const char*)buf + ret;
+        size -= ret;
+    }
+    return true;
+}
+
+// Moves size bytes at offset in in_fd to out_fd's position without a trip through userspace.
+// copy_file_range only works between files, where it can share extents, sendfile covers sockets and
+// pipes. Returns how much was moved, the caller copies whatever is left by hand.
+static uint64_t copy_in_kernel(pak_handle_t* handle, int in_fd, uint64_t offset, int out_fd, uint64_t size) {
+    bool use_sendfile = false;
+    uint64_t done = 0;
+    while (done < size) {
+        size_t chunk = size - done > PAK_COPY_CHUNK ? PAK_COPY_CHUNK : size - done;
+        ssize_t ret;
+        if (use_sendfile) {
+            off_t in_offset = offset + done;
+            ret = sendfile(out_fd, in_fd, &in_offset, chunk);
+        } else {
+            loff_t in_offset = offset + done;
+            ret = copy_file_range(in_fd, &in_offset, out_fd, NULL, chunk, 0);
+        }
+        PAK_STAT_ADD(handle, syscalls, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0 && !use_sendfile) {
+            use_sendfile = true;
+            continue;
+        }
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+    PAK_STAT_ADD(handle, bytes_read, done);
+    return done;
+}
+
+static int64_t copy_range(pak_handle_t* handle, uint64_t index, pak_entry_t* entry, int fd, uint64_t offset, uint64_t size) {
+    uint64_t done = 0;
+    uint64_t stored;
+    if (stored_offset(handle, entry, &stored)) {
+        int in_fd = shard_fd(handle, entry->shard);
+        if (in_fd < 0)
+            return -1;
+        done = copy_in_kernel(handle, in_fd, shard_base(handle, entry->shard) + stored + offset, fd, size);
+        if (done == size)
+            return size;
+    }
+
+    // compressed data, and fds the kernel won't copy to, go through a buffer
+    uint8_t* buf = malloc(PAK_SCRATCH_SIZE);
+    pak_stream_t* stream = NULL;
+    if (entry_is_deflated(entry) && !pak_cache_contains(&handle->cache, PAK_CACHE_KEY_ENTRY(index))) {
+        stream = malloc(sizeof(pak_stream_t));
+        stream->active = false;
+    }
+    bool ok = true;
+    while (ok && done < size) {
+        uint64_t chunk = size - done > PAK_SCRATCH_SIZE ? PAK_SCRATCH_SIZE : size - done;
+        int64_t ret = stream ? stream_read(handle, stream, index, entry, buf, offset + done, chunk)
+                             : read_range(handle, entry, buf, offset + done, chunk);
+        ok = ret == (int64_t)chunk && write_all(fd, buf, chunk);
+        done += chunk;
+    }
+    if (stream) {
+        stream_end(stream);
+        free(stream);
+    }
+    free(buf);
+    return ok ? (int64_t)size : -1;
+}
+
+int64_t pak_read_stored(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size) {
+    assert(handle);
+    assert(buf || !size);
+    if (index >= handle->header->entry_count)
+        return -1;
+    pak_entry_t* entry = pak_get_entry_from_index(handle, index);
+    if (PAK_ENTRY_IS_DIR(entry) || (entry->flags & PAK_ENTRY_FLAGS_SOLID))
+        return -1;
+
+    uint64_t stored_size = entry->data_size_or_child_count;
+    if (offset >= stored_size)
+        return 0;
+    if (size > stored_size - offset)
+        size = stored_size - offset;
+    if (!pak_read_data(handle, entry->shard, buf, size, entry->data_offset_or_first_child + offset))
+        return -1;
+    return size;
+}
+
+int64_t pak_copy_index(pak_handle_t* handle, uint64_t index, int fd, uint64_t offset, uint64_t size) {
+    assert(handle);
+    if (index >= handle->header->entry_count)
+        return -1;
+    pak_entry_t* entry = pak_get_entry_from_index(handle, index);
+    if (PAK_ENTRY_IS_DIR(entry))
+        return -1;
+
+    uint64_t entry_size = pak_get_entry_size(entry);
+    if (offset >= entry_size)
+        return 0;
+    if (size > entry_size - offset)
+        size = entry_size - offset;
+
+    const char* name = pak_get_string_from_index(handle, index);
+    PAK_STAT_ADD(handle, reads, 1);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_BEGIN, name, 0);
+    int64_t ret = copy_range(handle, index, entry, fd, offset, size);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_END, name, ret > 0 ? ret : 0);
+    return ret;
+}
+
+typedef struct _pak_range {
+    uint16_t shard;
+    uint64_t offset;
+    uint64_t size;
+} pak_range_t;
+
+static int compare_ranges(const void* a, const void* b) {
+    const pak_range_t* ra = a;
+    const pak_range_t* rb = b;
+    if (ra->shard != rb->shard)
+        return ra->shard < rb->shard ? -1 : 1;
+    if (ra->offset != rb->offset)
+        return ra->offset < rb->offset ? -1 : 1;
+    return 0;
+}
+
+static bool prefetch_cancelled(pak_prefetch_t* prefetch) {
+    return __atomic_load_n(&prefetch->cancel, __ATOMIC_RELAXED);
+}
+
+// Hints the data of every entry in one pass over the file, then decodes what fits in the cache
+static void* prefetch_thread(void* arg) {
+    pak_prefetch_t* prefetch = arg;
+    pak_handle_t* handle = prefetch->handle;
+
+    pak_range_t* ranges = malloc(prefetch->count * sizeof(pak_range_t));
+    uint64_t range_count = 0;
+    for (uint64_t i = 0; i < prefetch->count; i++) {
+        pak_entry_t* entry = pak_get_entry_from_index(handle, prefetch->indices[i]);
+        if (entry->flags & PAK_ENTRY_FLAGS_SOLID) {
+            if ((uint64_t)entry->data_offset_or_first_child >= handle->header->block_count)
+                continue;
+            pak_block_t* block = &handle->block_table_data[entry->data_offset_or_first_child];
+            ranges[range_count].shard = entry->shard;
+            ranges[range_count].offset = block->data_offset;
+            ranges[range_count].size = block->data_size;
+        } else {
+            ranges[range_count].shard = entry->shard;
+            ranges[range_count].offset = entry->data_offset_or_first_child;
+            ranges[range_count].size = entry->data_size_or_child_count;
+        }
+        range_count++;
+    }
+
+    qsort(ranges, range_count, sizeof(pak_range_t), compare_ranges);
+    uint64_t i = 0;
+    while (i < range_count && !prefetch_cancelled(prefetch)) {
+        uint16_t shard = ranges[i].shard;
+        uint64_t start = ranges[i].offset;
+        uint64_t end = start + ranges[i].size;
+        for (i++; i < range_count && ranges[i].shard == shard && ranges[i].offset <= end + PAK_PREFETCH_MERGE_GAP; i++) {
+            if (ranges[i].offset + ranges[i].size > end)
+                end = ranges[i].offset + ranges[i].size;
+        }
+        pak_advise_data(handle, shard, start, end - start);
+    }
+    free(ranges);
+
+    if (!(prefetch->flags & PAK_PREFETCH_DECODE))
+        return NULL;
+
+    // decoding more than the cache holds would only evict what we just decoded
+    int decoded = 0;
+    for (uint64_t i = 0; i < prefetch->count && decoded < PAK_CACHE_SLOTS && !prefetch_cancelled(prefetch); i++) {
+        pak_entry_t* entry = pak_get_entry_from_index(handle, prefetch->indices[i]);
+        uint64_t key;
+        uint64_t size;
+        void* data;
+        if (entry->flags & PAK_ENTRY_FLAGS_SOLID) {
+            uint64_t block = entry->data_offset_or_first_child;
+            key = PAK_CACHE_KEY_BLOCK(block);
+            if (block >= handle->header->block_count || pak_cache_contains(&handle->cache, key))
+                continue;
+            data = decode_block(handle, entry->shard, block);
+            size = handle->block_table_data[block].data_uncompressed_size;
+        } else if (entry_is_deflated(entry)) {
+            key = PAK_CACHE_KEY_ENTRY(prefetch->indices[i]);
+            size = pak_get_entry_size(entry);
+            if (size > PAK_CACHE_MAX_ENTRY_SIZE || pak_cache_contains(&handle->cache, key))
+                continue;
+            data = malloc(size);
+            if (!load_entry(handle, entry, data)) {
+                free(data);
+                data = NULL;
+            }
+        } else {
+            continue;
+        }
+
+        if (data) {
+            pak_cache_insert(&handle->cache, key, data, size);
+            decoded++;
+        }
+    }
+    return NULL;
+}
+
+static bool add_prefetch_index(pak_handle_t* handle, uint64_t** indices, uint64_t* count, uint64_t* capacity, uint64_t index) {
+    if (PAK_ENTRY_IS_DIR(pak_get_entry_from_index(handle, index)))
+        return true;
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        uint64_t* grown = realloc(*indices, *capacity * sizeof(uint64_t));
+        if (!grown)
+            return false;
+        *indices = grown;
+    }
+    (*indices)[(*count)++] = index;
+    return true;
+}
+
+// takes ownership of indices
+static bool start_prefetch(pak_handle_t* handle, uint64_t* indices, uint64_t count, int flags) {
+    pak_prefetch_cancel(handle);
+    if (!count) {
+        free(indices);
+        return true;
+    }
+
+    pak_prefetch_t* prefetch = pak_alloc(sizeof(pak_prefetch_t));
+    assert(prefetch);
+    memset(prefetch, 0, sizeof(pak_prefetch_t));
+    prefetch->handle = handle;
+    prefetch->indices = indices;
+    prefetch->count = count;
+    prefetch->flags = flags;
+    if (pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch)) {
+        free(indices);
+        pak_free(prefetch);
+        return false;
+    }
+    handle->prefetch = prefetch;
+    return true;
+}
+
+bool pak_prefetch_indices(pak_handle_t* handle, const uint64_t* indices, size_t count, int flags) {
+    assert(handle);
+    uint64_t* copy = NULL;
+    uint64_t copy_count = 0;
+    uint64_t capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (indices[i] >= handle->header->entry_count)
+            continue;
+        if (!add_prefetch_index(handle, &copy, &copy_count, &capacity, indices[i])) {
+            free(copy);
+            return false;
+        }
+    }
+    return start_prefetch(handle, copy, copy_count, flags);
+}
+
+bool pak_prefetch(pak_handle_t* handle, const char** paths, size_t count, int flags) {
+    assert(handle);
+    assert(paths || !count);
+    uint64_t* indices = NULL;
+    uint64_t index_count = 0;
+    uint64_t capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        int64_t index = pak_find_index(handle, paths[i]);
+        if (index < 0)
+            continue;
+        if (!add_prefetch_index(handle, &indices, &index_count, &capacity, index)) {
+            free(indices);
+            return false;
+        }
+    }
+    return start_prefetch(handle, indices, index_count, flags);
+}
+
+bool pak_prefetch_subtree(pak_handle_t* handle, const char* path, int flags) {
+    assert(handle);
+    uint64_t first = 0;
+    uint64_t end = handle->header->entry_count;
+    if (path && !path_is_root(path)) {
+        int64_t index = pak_find_index(handle, path);
+        if (index < 0)
+            return false;
+        first = index;
+        end = handle->subtree_end[index];
+    }
+
+    uint64_t* indices = NULL;
+    uint64_t index_count = 0;
+    uint64_t capacity = 0;
+    for (uint64_t i = first; i < end; i++) {
+        if (!add_prefetch_index(handle, &indices, &index_count, &capacity, i)) {
+            free(indices);
+            return false;
+        }
+    }
+    return start_prefetch(handle, indices, index_count, flags);
+}
+
+void pak_prefetch_wait(pak_handle_t* handle) {
+    assert(handle);
+    pak_prefetch_t* prefetch = handle->prefetch;
+    if (!prefetch)
+        return;
+    pthread_join(prefetch->thread, NULL);
+    free(prefetch->indices);
+    pak_free(prefetch);
+    handle->prefetch = NULL;
+}
+
+void pak_prefetch_cancel(pak_handle_t* handle) {
+    assert(handle);
+    if (handle->prefetch)
+        __atomic_store_n(&handle->prefetch->cancel, 1, __ATOMIC_RELAXED);
+    pak_prefetch_wait(handle);
+}
+
+typedef struct _pak_request {
+    uint64_t id;
+    uint64_t index;
+    uint8_t* buf;
+    uint64_t offset;                    // in the decoded data, where the next piece starts
+    uint64_t size;                      // left to read
+    uint64_t done;
+    uint64_t key;                       // shard and position in it of the next piece, queues are sorted by it
+    pak_priority priority;
+    uint64_t deadline;
+    uint64_t submitted;
+    uint64_t dispatched;                // 0 until the first piece is picked up
+    pak_stream_t* stream;               // inflate state of a compressed entry, kept between pieces
+    pak_request_callback callback;
+    void* user_data;
+} pak_request_t;
+
+typedef struct _pak_queue {
+    pak_request_t** items;
+    size_t count;
+    size_t capacity;
+    size_t deadlines;                   // queued requests that have one
+} pak_queue_t;
+
+typedef struct _pak_scheduler {
+    pak_handle_t* handle;
+    pthread_t* threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // on CLOCK_MONOTONIC so workers can sleep until a deadline comes due
+    pak_queue_t queues[PAK_PRIORITY_COUNT];
+    uint64_t head;                      // key right after the last piece, each class is swept upwards from it
+    uint64_t inflight;                  // bytes being read right now
+    int in_callback;                    // workers running a request's callback
+    uint64_t max_inflight;
+    uint64_t next_id;
+    bool stopping;
+    pak_scheduler_stats_t stats[PAK_PRIORITY_COUNT];
+} pak_scheduler_t;
+
+static uint64_t request_key(pak_handle_t* handle, const pak_entry_t* entry, uint64_t offset) {
+    uint64_t pos;
+    if (stored_offset(handle, entry, &pos))
+        pos += offset;
+    else if ((entry->flags & PAK_ENTRY_FLAGS_SOLID) && entry->data_offset_or_first_child < handle->header->block_count)
+        pos = handle->block_table_data[entry->data_offset_or_first_child].data_offset;
+    else
+        pos = entry->data_offset_or_first_child;
+    return ((uint64_t)entry->shard << 48) | (pos & ((1ULL << 48) - 1));
+}
+
+// Stored data and compressed entries are read a piece at a time, solid blocks are decoded in one go
+static uint64_t request_piece(pak_handle_t* handle, const pak_request_t* req) {
+    pak_entry_t* entry = pak_get_entry_from_index(handle, req->index);
+    if (req->size > PAK_SCHEDULER_CHUNK && !(entry->flags & PAK_ENTRY_FLAGS_SOLID))
+        return PAK_SCHEDULER_CHUNK;
+    return req->size;
+}
+
+// First item with a key of at least key
+static size_t queue_lower_bound(const pak_queue_t* queue, uint64_t key) {
+    size_t lo = 0;
+    size_t hi = queue->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (queue->items[mid]->key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void queue_insert(pak_queue_t* queue, pak_request_t* req) {
+    if (queue->count == queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+        queue->items = realloc(queue->items, queue->capacity * sizeof(pak_request_t*));
+    }
+    // after the requests with the same key, so they keep their submit order
+    size_t pos = queue_lower_bound(queue, req->key + 1);
+    if (req->key == UINT64_MAX)
+        pos = queue->count;
+    memmove(queue->items + pos + 1, queue->items + pos, (queue->count - pos) * sizeof(pak_request_t*));
+    queue->items[pos] = req;
+    queue->count++;
+    if (req->deadline)
+        queue->deadlines++;
+}
+
+static pak_request_t* queue_remove(pak_queue_t* queue, size_t pos) {
+    pak_request_t* req = queue->items[pos];
+    memmove(queue->items + pos, queue->items + pos + 1, (queue->count - pos - 1) * sizeof(pak_request_t*));
+    queue->count--;
+    if (req->deadline)
+        queue->deadlines--;
+    return req;
+}
+
+// Called with the lock held, NULL if nothing may start right now. *wake is set to when the earliest
+// deadline comes due, 0 if there is none.
+static pak_request_t* scheduler_pick(pak_scheduler_t* sched, uint64_t now, uint64_t* wake) {
+    pak_queue_t* due_queue = NULL;
+    size_t due_pos = 0;
+    uint64_t due = UINT64_MAX;
+    for (int p = 0; p < PAK_PRIORITY_COUNT; p++) {
+        pak_queue_t* queue = &sched->queues[p];
+        for (size_t i = 0; queue->deadlines && i < queue->count; i++) {
+            uint64_t deadline = queue->items[i]->deadline;
+            if (deadline && deadline < due) {
+                due = deadline;
+                due_queue = queue;
+                due_pos = i;
+            }
+        }
+    }
+    *wake = 0;
+    if (due_queue && due <= now + PAK_SCHEDULER_DEADLINE_SLACK)
+        return queue_remove(due_queue, due_pos);
+    if (due_queue)
+        *wake = due - PAK_SCHEDULER_DEADLINE_SLACK;
+
+    for (int p = 0; p < PAK_PRIORITY_COUNT; p++) {
+        pak_queue_t* queue = &sched->queues[p];
+        if (!queue->count)
+            continue;
+
+        // one sweep up the file, then back to its start
+        size_t pos = queue_lower_bound(queue, sched->head);
+        if (pos == queue->count)
+            pos = 0;
+
+        // the budget is shared, less urgent classes wait behind this one
+        uint64_t piece = request_piece(sched->handle, queue->items[pos]);
+        if (p != PAK_PRIORITY_URGENT && sched->max_inflight && sched->inflight &&
+            sched->inflight + piece > sched->max_inflight)
+            return NULL;
+        return queue_remove(queue, pos);
+    }
+    return NULL;
+}
+
+static bool scheduler_serve(pak_handle_t* handle, pak_request_t* req, uint64_t piece) {
+    pak_entry_t* entry = pak_get_entry_from_index(handle, req->index);
+    uint64_t pos;
+    bool ok;
+    if (stored_offset(handle, entry, &pos)) {
+        ok = pak_read_data(handle, entry->shard, req->buf + req->done, piece, pos + req->offset);
+    } else if (entry_is_deflated(entry) && (req->stream || piece < req->size) &&
+               !pak_cache_contains(&handle->cache, PAK_CACHE_KEY_ENTRY(req->index))) {
+        // reads that fit one piece go through read_range and its cache, longer ones keep decoding where they stopped
+        if (!req->stream) {
+            req->stream = malloc(sizeof(pak_stream_t));
+            req->stream->active = false;
+        }
+        ok = stream_read(handle, req->stream, req->index, entry, req->buf + req->done, req->offset, piece) == (int64_t)piece;
+    } else {
+        ok = read_range(handle, entry, req->buf + req->done, req->offset, piece) == (int64_t)piece;
+    }
+    if (!ok)
+        return false;
+
+    req->offset += piece;
+    req->done += piece;
+    req->size -= piece;
+    req->key += piece;
+    return true;
+}
+
+static void request_free(pak_request_t* req) {
+    if (req->stream) {
+        stream_end(req->stream);
+        free(req->stream);
+    }
+    free(req);
+}
+
+static void scheduler_record(pak_scheduler_t* sched, pak_request_t* req, bool ok, uint64_t now) {
+    pak_scheduler_stats_t* stats = &sched->stats[req->priority];
+    if (!ok) {
+        stats->failed++;
+        return;
+    }
+    uint64_t latency = now - req->submitted;
+    stats->completed++;
+    stats->bytes += req->done;
+    stats->wait_ns += req->dispatched - req->submitted;
+    stats->latency_ns += latency;
+    if (latency > stats->max_latency_ns)
+        stats->max_latency_ns = latency;
+    if (req->deadline && now > req->deadline)
+        stats->deadline_misses++;
+
+    uint64_t us = latency / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= PAK_SCHEDULER_HISTOGRAM_BUCKETS)
+        bucket = PAK_SCHEDULER_HISTOGRAM_BUCKETS - 1;
+    stats->histogram[bucket]++;
+}
+
+static void* scheduler_thread(void* arg) {
+    pak_scheduler_t* sched = arg;
+    pak_handle_t* handle = sched->handle;
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stopping) {
+        uint64_t now = pak_now_ns();
+        uint64_t wake;
+        pak_request_t* req = scheduler_pick(sched, now, &wake);
+        if (!req) {
+            if (wake) {
+                struct timespec ts = {wake / 1000000000ULL, wake % 1000000000ULL};
+                pthread_cond_timedwait(&sched->cond, &sched->lock, &ts);
+            } else {
+                pthread_cond_wait(&sched->cond, &sched->lock);
+            }
+            continue;
+        }
+
+        if (!req->dispatched)
+            req->dispatched = now;
+        uint64_t piece = request_piece(handle, req);
+        sched->inflight += piece;
+        pthread_mutex_unlock(&sched->lock);
+
+        bool ok = scheduler_serve(handle, req, piece);
+
+        pthread_mutex_lock(&sched->lock);
+        sched->inflight -= piece;
+        sched->head = req->key;
+        pthread_cond_broadcast(&sched->cond);
+        if (ok && req->size) {
+            // back in line, the next pick decides whether this request carries on
+            for (int p = 0; p < (int)req->priority; p++) {
+                if (sched->queues[p].count) {
+                    sched->stats[req->priority].preempted++;
+                    break;
+                }
+            }
+            queue_insert(&sched->queues[req->priority], req);
+            continue;
+        }
+
+        scheduler_record(sched, req, ok, pak_now_ns());
+        sched->in_callback++;
+        pthread_mutex_unlock(&sched->lock);
+        req->callback(handle, req->id, req->buf, ok ? (int64_t)req->done : -1, req->user_data);
+        request_free(req);
+        pthread_mutex_lock(&sched->lock);
+        sched->in_callback--;
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+bool pak_scheduler_start(pak_handle_t* handle, int threads, uint64_t max_inflight) {
+    assert(handle);
+    if (handle->scheduler || threads <= 0)
+        return false;
+
+    pak_scheduler_t* sched = pak_alloc(sizeof(pak_scheduler_t));
+    assert(sched);
+    memset(sched, 0, sizeof(pak_scheduler_t));
+    sched->handle = handle;
+    sched->max_inflight = max_inflight;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    handle->scheduler = sched;
+    sched->threads = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&sched->threads[i], NULL, scheduler_thread, sched))
+            break;
+        sched->thread_count++;
+    }
+    if (!sched->thread_count) {
+        pak_scheduler_stop(handle);
+        return false;
+    }
+    return true;
+}
+
+// True on one of sched's workers, which can't join itself
+static bool scheduler_on_worker(pak_scheduler_t* sched) {
+    for (int i = 0; i < sched->thread_count; i++) {
+        if (pthread_equal(sched->threads[i], pthread_self()))
+            return true;
+    }
+    return false;
+}
+
+void pak_scheduler_stop(pak_handle_t* handle) {
+    assert(handle);
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched)
+        return;
+    assert(!scheduler_on_worker(sched));
+    if (scheduler_on_worker(sched))
+        return;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    for (int i = 0; i < sched->thread_count; i++)
+        pthread_join(sched->threads[i], NULL);
+
+    for (int p = 0; p < PAK_PRIORITY_COUNT; p++) {
+        pak_queue_t* queue = &sched->queues[p];
+        for (size_t i = 0; i < queue->count; i++) {
+            pak_request_t* req = queue->items[i];
+            req->callback(handle, req->id, req->buf, -1, req->user_data);
+            request_free(req);
+        }
+        free(queue->items);
+    }
+    pthread_mutex_destroy(&sched->lock);
+    pthread_cond_destroy(&sched->cond);
+    free(sched->threads);
+    pak_free(sched);
+    handle->scheduler = NULL;
+}
+
+uint64_t pak_submit(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size,
+                    pak_priority priority, uint64_t deadline, pak_request_callback callback, void* user_data) {
+    assert(handle);
+    assert(callback);
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched || index >= handle->header->entry_count || priority >= PAK_PRIORITY_COUNT)
+        return 0;
+    pak_entry_t* entry = pak_get_entry_from_index(handle, index);
+    if (PAK_ENTRY_IS_DIR(entry))
+        return 0;
+
+    uint64_t entry_size = pak_get_entry_size(entry);
+    if (offset > entry_size)
+        offset = entry_size;
+    if (size > entry_size - offset)
+        size = entry_size - offset;
+
+    pak_request_t* req = malloc(sizeof(pak_request_t));
+    memset(req, 0, sizeof(pak_request_t));
+    req->index = index;
+    req->buf = buf;
+    req->offset = offset;
+    req->size = size;
+    req->key = request_key(handle, entry, offset);
+    req->priority = priority;
+    req->deadline = deadline;
+    req->submitted = pak_now_ns();
+    req->callback = callback;
+    req->user_data = user_data;
+    PAK_STAT_ADD(handle, reads, 1);
+
+    pthread_mutex_lock(&sched->lock);
+    req->id = ++sched->next_id;
+    queue_insert(&sched->queues[priority], req);
+    sched->stats[priority].submitted++;
+    pthread_cond_signal(&sched->cond);
+    pthread_mutex_unlock(&sched->lock);
+    return req->id;
+}
+
+bool pak_cancel(pak_handle_t* handle, uint64_t id) {
+    assert(handle);
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched)
+        return false;
+
+    pak_request_t* found = NULL;
+    pthread_mutex_lock(&sched->lock);
+    for (int p = 0; p < PAK_PRIORITY_COUNT && !found; p++) {
+        pak_queue_t* queue = &sched->queues[p];
+        for (size_t i = 0; i < queue->count; i++) {
+            // a request that already had a piece read is left to finish
+            if (queue->items[i]->id == id && !queue->items[i]->dispatched) {
+                found = queue_remove(queue, i);
+                sched->stats[p].cancelled++;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    if (found)
+        request_free(found);
+    return found != NULL;
+}
+
+void pak_get_scheduler_stats(pak_handle_t* handle, pak_priority priority, pak_scheduler_stats_t* stats) {
+    assert(handle);
+    assert(stats);
+    assert(priority < PAK_PRIORITY_COUNT);
+    memset(stats, 0, sizeof(pak_scheduler_stats_t));
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched)
+        return;
+    pthread_mutex_lock(&sched->lock);
+    memcpy(stats, &sched->stats[priority], sizeof(pak_scheduler_stats_t));
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void pak_reset_scheduler_stats(pak_handle_t* handle) {
+    assert(handle);
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched)
+        return;
+    pthread_mutex_lock(&sched->lock);
+    memset(sched->stats, 0, sizeof(sched->stats));
+    pthread_mutex_unlock(&sched->lock);
+}
+
+// Idle archives sit in one of two LRU lists, most recently released at the head. LOADING and PARKING
+// slots are in neither, whoever asks for them waits on the pool's cond.
+typedef enum { POOL_COLD, POOL_LOADING, POOL_OPEN, POOL_PARKING, POOL_PARKED } pool_state;
+
+typedef struct _pak_pool_slot {
+    char* filename;
+    // the file the index was loaded from, a parked archive is only reused if it's still the same
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    pak_handle_t* handle;
+    pool_state state;
+    uint32_t users;
+    uint64_t index_bytes;
+    struct _pak_pool_slot* prev;
+    struct _pak_pool_slot* next;
+} pak_pool_slot_t;
+
+typedef struct _pak_pool_list {
+    pak_pool_slot_t* head;
+    pak_pool_slot_t* tail;
+} pak_pool_list_t;
+
+struct _pak_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                // a load finished
+    pak_pool_slot_t** slots;            // by id, NULL once removed
+    uint64_t slot_count;
+    uint64_t max_open;
+    uint64_t max_index_bytes;
+    pak_pool_list_t idle_open;
+    pak_pool_list_t parked;
+    pak_pool_stats_t stats;
+};
+
+// Archives trimmed under the pool's lock, they're parked or closed once it has been released. Both
+// stop the scheduler, whose callbacks may call back into the pool.
+typedef struct _pool_trimmed {
+    pak_pool_slot_t* parking;           // chained through next
+    pak_handle_t** closing;
+    size_t closing_count;
+} pool_trimmed_t;
+
+static void pool_push(pak_pool_list_t* list, pak_pool_slot_t* slot) {
+    slot->prev = NULL;
+    slot->next = list->head;
+    if (list->head)
+        list->head->prev = slot;
+    else
+        list->tail = slot;
+    list->head = slot;
+}
+
+static void pool_unlink(pak_pool_list_t* list, pak_pool_slot_t* slot) {
+    if (slot->prev)
+        slot->prev->next = slot->next;
+    else
+        list->head = slot->next;
+    if (slot->next)
+        slot->next->prev = slot->prev;
+    else
+        list->tail = slot->prev;
+    slot->prev = slot->next = NULL;
+}
+
+// What an archive keeps in memory while it's loaded, the decoded cache aside
+static uint64_t handle_index_bytes(pak_handle_t* handle) {
+    pak_header_t* header = handle->header;
+    uint64_t bytes = sizeof(pak_handle_t) + sizeof(pak_header_t) + header->string_table_size + header->dictionary_size +
+                     header->entry_count * (sizeof(pak_entry_t) + sizeof(uint64_t)) +
+                     header->block_count * sizeof(pak_block_t) + header->checkpoint_count * sizeof(pak_checkpoint_t);
+    if (handle->hash_table_data)
+        bytes += header->entry_count * sizeof(uint64_t);
+    if (__atomic_load_n(&handle->nodes_built, __ATOMIC_ACQUIRE))
+        bytes += (header->entry_count + 1) * sizeof(pak_node_t);
+    if (__atomic_load_n(&handle->columns, __ATOMIC_ACQUIRE))
+        bytes += header->entry_count * (2 * sizeof(uint16_t) + 2 * sizeof(uint64_t) + sizeof(uint32_t));
+    return bytes;
+}
+
+static bool pool_same_file(const pak_pool_slot_t* slot, const struct stat* st) {
+    return st->st_dev == slot->dev && st->st_ino == slot->ino && st->st_size == slot->size &&
+           st->st_mtim.tv_sec == slot->mtime.tv_sec && st->st_mtim.tv_nsec == slot->mtime.tv_nsec;
+}
+
+static void pool_remember_file(pak_pool_slot_t* slot, const struct stat* st) {
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtim;
+}
+
+// Closes every file of an idle handle and drops its decoded cache, the tables stay
+static void pool_park(pak_handle_t* handle) {
+    pak_scheduler_stop(handle);
+    pak_prefetch_cancel(handle);
+    for (uint64_t i = 1; i < shard_count(handle); i++) {
+        if (handle->shard_fds[i] >= 0)
+            close(handle->shard_fds[i]);
+        handle->shard_fds[i] = -1;
+    }
+    handle->shard_fds[0] = -1;
+    fclose(handle->file);
+    handle->file = NULL;
+
+    pthread_mutex_lock(&handle->cache.lock);
+    for (int i = 0; i < PAK_CACHE_SLOTS; i++) {
+        free(handle->cache.slots[i].data);
+        memset(&handle->cache.slots[i], 0, sizeof(pak_cache_slot_t));
+    }
+    pthread_mutex_unlock(&handle->cache.lock);
+}
+
+static bool pool_unpark(pak_pool_slot_t* slot) {
+    FILE* file = fopen(slot->filename, "rb");
+    if (!file)
+        return false;
+    struct stat st;
+    if (fstat(fileno(file), &st) || !pool_same_file(slot, &st)) {
+        fclose(file);
+        return false;
+    }
+    slot->handle->file = file;
+    slot->handle->shard_fds[0] = fileno(file);
+    return true;
+}
+
+// Requests still queued, being read or in their callback. Parking would fail them, or stop the
+// scheduler from its own worker.
+static bool scheduler_busy(pak_handle_t* handle) {
+    pak_scheduler_t* sched = handle->scheduler;
+    if (!sched)
+        return false;
+    pthread_mutex_lock(&sched->lock);
+    bool busy = sched->inflight > 0 || sched->in_callback > 0;
+    for (int p = 0; p < PAK_PRIORITY_COUNT; p++)
+        busy = busy || sched->queues[p].count > 0;
+    pthread_mutex_unlock(&sched->lock);
+    return busy;
+}
+
+// Both run under the pool's lock and only pick idle archives, oldest first. The work is left to
+// pool_finish_trim.
+static void pool_trim_open(pak_pool_t* pool, pool_trimmed_t* trimmed) {
+    pak_pool_slot_t* slot = pool->idle_open.tail;
+    while (pool->max_open && pool->stats.open > pool->max_open && slot) {
+        pak_pool_slot_t* prev = slot->prev;
+        if (!scheduler_busy(slot->handle)) {
+            pool_unlink(&pool->idle_open, slot);
+            slot->state = POOL_PARKING;
+            slot->next = trimmed->parking;
+            trimmed->parking = slot;
+            pool->stats.open--;
+            pool->stats.parked++;
+            pool->stats.parks++;
+        }
+        slot = prev;
+    }
+}
+
+static void pool_trim_index(pak_pool_t* pool, pool_trimmed_t* trimmed) {
+    pak_pool_slot_t* open = pool->idle_open.tail;
+    while (pool->max_index_bytes && pool->stats.index_bytes > pool->max_index_bytes) {
+        pak_pool_slot_t* slot = pool->parked.tail;
+        if (slot) {
+            pool_unlink(&pool->parked, slot);
+            pool->stats.parked--;
+        } else {
+            while (open && scheduler_busy(open->handle))
+                open = open->prev;
+            if (!open)
+                break;
+            slot = open;
+            open = open->prev;
+            pool_unlink(&pool->idle_open, slot);
+            pool->stats.open--;
+        }
+        if (!(trimmed->closing_count & (trimmed->closing_count - 1)))
+            trimmed->closing = realloc(trimmed->closing, (trimmed->closing_count ? trimmed->closing_count * 2 : 1) * sizeof(pak_handle_t*));
+        trimmed->closing[trimmed->closing_count++] = slot->handle;
+        slot->handle = NULL;
+        slot->state = POOL_COLD;
+        pool->stats.index_bytes -= slot->index_bytes;
+        slot->index_bytes = 0;
+        pool->stats.unloads++;
+    }
+}
+
+// Called without the pool's lock. Parked archives become candidates for unloading, which may close more.
+static void pool_finish_trim(pak_pool_t* pool, pool_trimmed_t* trimmed) {
+    while (trimmed->parking || trimmed->closing_count) {
+        for (size_t i = 0; i < trimmed->closing_count; i++)
+            pak_close(trimmed->closing[i]);
+        trimmed->closing_count = 0;
+        if (!trimmed->parking)
+            break;
+
+        for (pak_pool_slot_t* slot = trimmed->parking; slot; slot = slot->next)
+            pool_park(slot->handle);
+        pthread_mutex_lock(&pool->lock);
+        while (trimmed->parking) {
+            pak_pool_slot_t* slot = trimmed->parking;
+            trimmed->parking = slot->next;
+            slot->state = POOL_PARKED;
+            pool_push(&pool->parked, slot);
+        }
+        pool_trim_index(pool, trimmed);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(trimmed->closing);
+    trimmed->closing = NULL;
+}
+
+pak_pool_t* pak_pool_create(uint64_t max_open, uint64_t max_index_bytes) {
+    pak_pool_t* pool = pak_alloc(sizeof(pak_pool_t));
+    assert(pool);
+    memset(pool, 0, sizeof(pak_pool_t));
+    pool->max_open = max_open;
+    pool->max_index_bytes = max_index_bytes;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    return pool;
+}
+
+void pak_pool_destroy(pak_pool_t* pool) {
+    assert(pool);
+    for (uint64_t id = 0; id < pool->slot_count; id++) {
+        pak_pool_slot_t* slot = pool->slots[id];
+        if (!slot)
+            continue;
+        assert(!slot->users);
+        if (slot->handle)
+            pak_close(slot->handle);
+        free(slot->filename);
+        free(slot);
+    }
+    free(pool->slots);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    pak_free(pool);
+}
+
+int64_t pak_pool_add(pak_pool_t* pool, const char* filename) {
+    assert(pool);
+    assert(filename);
+    struct stat st;
+    if (stat(filename, &st) || !S_ISREG(st.st_mode))
+        return -1;
+
+    pak_pool_slot_t* slot = calloc(1, sizeof(pak_pool_slot_t));
+    // like pak_open_read, the working directory may change before the archive is loaded
+    slot->filename = realpath(filename, NULL);
+    if (!slot->filename)
+        slot->filename = strdup(filename);
+
+    pthread_mutex_lock(&pool->lock);
+    // ids are never reused, 8 bytes per archive ever added
+    if (!(pool->slot_count & (pool->slot_count - 1)))
+        pool->slots = realloc(pool->slots, (pool->slot_count ? pool->slot_count * 2 : 1) * sizeof(pak_pool_slot_t*));
+    int64_t id = pool->slot_count++;
+    pool->slots[id] = slot;
+    pool->stats.archives++;
+    pthread_mutex_unlock(&pool->lock);
+    return id;
+}
+
+bool pak_pool_remove(pak_pool_t* pool, uint64_t id) {
+    assert(pool);
+    pthread_mutex_lock(&pool->lock);
+    pak_pool_slot_t* slot = id < pool->slot_count ? pool->slots[id] : NULL;
+    if (!slot || slot->users || slot->state == POOL_LOADING || slot->state == POOL_PARKING) {
+        pthread_mutex_unlock(&pool->lock);
+        return false;
+    }
+    if (slot->state == POOL_OPEN) {
+        pool_unlink(&pool->idle_open, slot);
+        pool->stats.open--;
+    } else if (slot->state == POOL_PARKED) {
+        pool_unlink(&pool->parked, slot);
+        pool->stats.parked--;
+    }
+    pool->stats.index_bytes -= slot->index_bytes;
+    pool->stats.archives--;
+    pool->slots[id] = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (slot->handle)
+        pak_close(slot->handle);
+    free(slot->filename);
+    free(slot);
+    return true;
+}
+
+pak_handle_t* pak_pool_acquire(pak_pool_t* pool, uint64_t id) {
+    assert(pool);
+    pthread_mutex_lock(&pool->lock);
+    pak_pool_slot_t* slot;
+    while ((slot = id < pool->slot_count ? pool->slots[id] : NULL) != NULL &&
+           (slot->state == POOL_LOADING || slot->state == POOL_PARKING))
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    if (!slot) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    if (slot->state == POOL_OPEN) {
+        if (!slot->users)
+            pool_unlink(&pool->idle_open, slot);
+        slot->users++;
+        pool->stats.hits++;
+        pthread_mutex_unlock(&pool->lock);
+        return slot->handle;
+    }
+
+    // the file is opened outside the lock, others asking for this archive wait on cond
+    pool_state state = slot->state;
+    if (state == POOL_PARKED) {
+        pool_unlink(&pool->parked, slot);
+        pool->stats.parked--;
+    }
+    slot->state = POOL_LOADING;
+    pool->stats.open++;
+    pool_trimmed_t trimmed = {NULL, NULL, 0};
+    pool_trim_open(pool, &trimmed);
+    pthread_mutex_unlock(&pool->lock);
+
+    bool unparked = state == POOL_PARKED && pool_unpark(slot);
+    pak_handle_t* stale = state == POOL_PARKED && !unparked ? slot->handle : NULL;
+    pak_handle_t* handle = slot->handle;
+    if (!unparked) {
+        if (stale)
+            pak_close(stale);
+        handle = open_read(slot->filename, false);
+        struct stat st;
+        if (handle && !fstat(fileno(handle->file), &st)) {
+            pool_remember_file(slot, &st);
+        } else if (handle) {
+            pak_close(handle);
+            handle = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (stale) {
+        pool->stats.index_bytes -= slot->index_bytes;
+        slot->index_bytes = 0;
+        pool->stats.unloads++;
+    }
+    slot->handle = handle;
+    if (handle) {
+        slot->state = POOL_OPEN;
+        slot->users = 1;
+        if (unparked) {
+            pool->stats.unparks++;
+        } else {
+            slot->index_bytes = handle_index_bytes(handle);
+            pool->stats.index_bytes += slot->index_bytes;
+            pool->stats.loads++;
+        }
+        pool_trim_index(pool, &trimmed);
+    } else {
+        slot->state = POOL_COLD;
+        pool->stats.open--;
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    pool_finish_trim(pool, &trimmed);
+    return handle;
+}
+
+void pak_pool_release(pak_pool_t* pool, uint64_t id) {
+    assert(pool);
+    pthread_mutex_lock(&pool->lock);
+    pak_pool_slot_t* slot = id < pool->slot_count ? pool->slots[id] : NULL;
+    assert(slot && slot->users);
+    pool_trimmed_t trimmed = {NULL, NULL, 0};
+    if (--slot->users == 0) {
+        // node trees and columns may have been built while it was in use
+        uint64_t bytes = handle_index_bytes(slot->handle);
+        pool->stats.index_bytes += bytes - slot->index_bytes;
+        slot->index_bytes = bytes;
+        pool_push(&pool->idle_open, slot);
+        pool_trim_open(pool, &trimmed);
+        pool_trim_index(pool, &trimmed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pool_finish_trim(pool, &trimmed);
+}
+
+void pak_pool_get_stats(pak_pool_t* pool, pak_pool_stats_t* stats) {
+    assert(pool);
+    assert(stats);
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Compressed entries are decoded through the file's own stream unless they already sit in the cache
+static int64_t file_read_at(pak_file_t* file, void* buf, uint64_t offset, uint64_t size) {
+    pak_handle_t* handle = file->handle;
+    pak_entry_t* entry = file->entry;
+    if (!entry_is_deflated(entry))
+        return read_range(handle, entry, buf, offset, size);
+
+    uint64_t entry_size = pak_get_entry_size(entry);
+    if (offset >= entry_size)
+        return 0;
+    if (size > entry_size - offset)
+        size = entry_size - offset;
+
+    if (pak_cache_copy(&handle->cache, PAK_CACHE_KEY_ENTRY(file->index), offset, buf, size)) {
+        PAK_STAT_ADD(handle, cache_hits, 1);
+        return size;
+    }
+
+    if (!file->stream) {
+        file->stream = malloc(sizeof(pak_stream_t));
+        ((pak_stream_t*)file->stream)->active = false;
+    }
+    return stream_read(handle, file->stream, file->index, entry, buf, offset, size);
+}
+
+static inline const char* file_name(pak_file_t* file) {
+    return file->node ? file->node->filename : pak_get_string_from_index(file->handle, file->index);
+}
+
+int64_t pak_file_read(pak_file_t* file, void* buf, uint64_t size) {
+    assert(file);
+    if (PAK_ENTRY_IS_DIR(file->entry))
+        return -1;
+    pak_handle_t* handle = file->handle;
+    PAK_STAT_ADD(handle, reads, 1);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_BEGIN, file_name(file), 0);
+    int64_t ret = file_read_at(file, buf, file->position, size);
+    PAK_TRACE(handle, PAK_TRACE_READ, PAK_TRACE_END, file_name(file), ret > 0 ? ret : 0);
+    if (ret > 0)
+        file->position += ret;
+    return ret;
+}
+
+void pak_close_file(pak_file_t* handle) {
+    assert(handle);
+    if (handle->stream) {
+        stream_end(handle->stream);
+        free(handle->stream);
+    }
+    pak_free_file(handle);
+}
+
+// Reads at the current position without moving it
+uint32_t pak_file_read_uint(pak_file_t* file) {
+    assert(file);
+    uint32_t ret = 0;
+    if (!PAK_ENTRY_IS_DIR(file->entry))
+        file_read_at(file, &ret, file->position, sizeof(uint32_t));
+    return ret;
+}
+
+int64_t pak_file_tell(pak_file_t* file) {
+    assert(file);
+    return file->position;
+}
+
+pak_node_t* pak_create_node() {
+    pak_node_t* ret = pak_alloc(sizeof(pak_node_t));
+    assert(ret);
+    memset(ret, 0, sizeof(pak_node_t));
+    ret->child = NULL;
+    ret->entry = NULL;
+    ret->is_dir = false;
+    ret->next = NULL;
+    ret->prev = NULL;
+    ret->parent = NULL;
+    return ret;
+}
+
+void pak_free_node(pak_node_t* node) {
+    assert(node);
+    if (node->next && node->next != node)
+        pak_free_node(node->next);
+    if (node->is_dir && node->child)
+        pak_free_node(node->child);
+    node->next = NULL;
+    node->child = NULL;
+
+    pak_free(node);
+}
+
+size_t pak_file_seek(pak_file_t* file, int64_t offset, int whence) {
+    assert(file);
+    int64_t size = pak_get_entry_size(file->entry);
+    int64_t position;
+
+    switch (whence) {
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = file->position + offset;
+            break;
+        case SEEK_END:
+            position = size + offset;
+            break;
+        default:
+            return -1;
+    }
+
+    if (position < 0 || position > size)
+        return -1;
 
+    // the stream itself only moves on the next read, so seeking around is free
+    file->position = position;
     return file->position;
 }
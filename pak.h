@@ -6,21 +6,41 @@
 #include <memory.h>
 #include <malloc.h>
 #include <endian.h>
+#include <pthread.h>
 
 #define MAKEFOURCC(a, b, c, d) (((uint32_t)a) | (((uint32_t)b) << 8) | (((uint32_t)c) << 16) | (((uint32_t)d) << 24))
 
 #define PAK_VERSION_MAJOR 0
-#define PAK_VERSION_MINOR 1
+#define PAK_VERSION_MINOR 8
 #define PAK_VERSION_PATCH 0
 #define PAK_VERSION MAKEFOURCC(PAK_VERSION_MAJOR, PAK_VERSION_MINOR, PAK_VERSION_PATCH, 0)
+#define PAK_VERSION_GET_MAJOR(version) ((version) & 0xFF)
+#define PAK_VERSION_GET_MINOR(version) (((version) >> 8) & 0xFF)
 #define PAK_MAGIC MAKEFOURCC('P', 'A', 'K', '0' + PAK_VERSION_MAJOR)
 
 #define PAK_ENTRY_FLAGS_DIR        (1 << 0)
 #define PAK_ENTRY_FLAGS_COMPRESSED (1 << 1)
 #define PAK_ENTRY_FLAGS_WRITEABLE  (1 << 2)
+#define PAK_ENTRY_FLAGS_SOLID      (1 << 3)
 
 #define PAK_ENTRY_IS_DIR(ent) (((ent)->flags & PAK_ENTRY_FLAGS_DIR) == PAK_ENTRY_FLAGS_DIR)
 
+// How far past the end of an opened file we ask the kernel to read ahead, data is laid out in load order
+#define PAK_READAHEAD_WINDOW (1024 * 1024)
+
+// Size of the per thread buffer compressed data is streamed through
+#define PAK_SCRATCH_SIZE (64 * 1024)
+
+// Number of decoded solid blocks and compressed entries kept around per handle
+#define PAK_CACHE_SLOTS 16
+// Partially read compressed entries up to this size stay decoded in the cache
+#define PAK_CACHE_MAX_ENTRY_SIZE (16 * 1024 * 1024)
+
+// Also decode prefetched solid blocks and compressed entries into the cache, at most PAK_CACHE_SLOTS of them
+#define PAK_PREFETCH_DECODE (1 << 0)
+// Prefetched ranges closer than this are hinted as one
+#define PAK_PREFETCH_MERGE_GAP (64 * 1024)
+
 #define pak_alloc(size) malloc(size)
 #define pak_clear(buf, size) memset((void*)buf, 0xFF, size)
 #define pak_free(buf) free((void*)buf)
@@ -36,16 +56,57 @@ typedef struct _pak_header {
     uint64_t  string_table_offset;
     uint64_t  string_table_size;
     uint64_t  data_offset;
+    // 0.2
+    uint64_t  block_table_offset;
+    uint64_t  block_count;
+    // 0.3
+    uint64_t  dictionary_offset;        // zlib preset dictionary, streams that need it request it through their header
+    uint64_t  dictionary_size;
+    // 0.5
+    uint64_t  checkpoint_table_offset;  // restart points inside large compressed entries, see pak_checkpoint_t
+    uint64_t  checkpoint_count;
+    // 0.6
+    uint64_t  shard_count;              // data split over this many files, see pak_shard_path, 0 or 1 means just this one
+    // 0.7
+    uint64_t  trailer;                  // non zero if this is a placeholder, the real header is at the end of the file
+    // 0.8
+    uint64_t  hash_table_offset;        // pak_hash_data of every entry's decoded data, 0 for directories. 0 if there's no table
 } __attribute__((packed)) pak_header_t;
 
+// Paks written to a pipe can't go back to fill in the header. They start with a placeholder, put their
+// tables after the data and end with the header padded to this size.
+#define PAK_TRAILER_SIZE ((sizeof(pak_header_t) + 31) & ~(size_t)31)
+
+// Entry record since 0.4, 32 bytes and naturally aligned so two fit a cache line and the fields
+// a lookup needs share the first 8 bytes. 0.1-0.3 paks used a packed 41 byte record, it's
+// converted to this one when the pak is opened. An entry's id is its index in the table.
 typedef struct _pak_entry {
-    uint8_t  flags;
-    uint64_t file_id;                   // Simply an index of the file.
-    int64_t string_offset;             // relative to string_table_offset specified in the header
-    int64_t data_offset_or_first_child;// relative to data_offset specified in the header unless it's a directory, then it's the index to the first entry
-    int64_t data_size_or_child_count;  // if directory child count, otherwise datasize
-    int64_t data_uncompressed_size;    // if flags has it's compressed bit set, check this value, otherwise assume it's uncompressed
-} __attribute__((packed)) pak_entry_t;
+    uint32_t string_offset;             // relative to string_table_offset specified in the header
+    uint16_t flags;
+    uint16_t shard;                     // file holding the data, offsets in other shards than 0 are relative to their start
+    uint64_t data_offset_or_first_child;// relative to data_offset specified in the header unless it's a directory, then it's the index to the first entry
+    uint64_t data_size_or_child_count;  // if directory child count, otherwise datasize
+    uint64_t data_uncompressed_size;    // if flags has it's compressed bit set, check this value, otherwise assume it's uncompressed
+} pak_entry_t;
+
+#define PAK_ENTRY_RECORD_V2_MINOR 4
+
+// Small files may be concatenated into a shared compressed block, such entries have PAK_ENTRY_FLAGS_SOLID set,
+// data_offset_or_first_child is the index of the block, data_uncompressed_size the offset of the file inside
+// the decompressed block and data_size_or_child_count the size of the file.
+typedef struct _pak_block {
+    uint64_t data_offset;              // relative to data_offset specified in the header
+    uint64_t data_size;                // stored size, equals data_uncompressed_size if the block isn't compressed
+    uint64_t data_uncompressed_size;
+} __attribute__((packed)) pak_block_t;
+
+// Large compressed entries are deflated with a full flush every so often, inflate can start over at
+// any of those points without the data in front of it. The table is sorted by entry and offset.
+typedef struct _pak_checkpoint {
+    uint64_t entry_index;
+    uint64_t uncompressed_offset;       // relative to the start of the entry's decoded data
+    uint64_t compressed_offset;         // relative to the start of the entry's stored data, a raw deflate stream starts here
+} __attribute__((packed)) pak_checkpoint_t;
 
 typedef struct _pak_node pak_node_t;
 
@@ -61,32 +122,199 @@ struct _pak_node {
     bool is_dir;
 };
 
-typedef struct _pak_handle {
+// Counters are only updated when the library is built with PAK_ENABLE_STATS
+typedef struct _pak_stats {
+    uint64_t lookups;
+    uint64_t lookup_misses;
+    uint64_t files_opened;
+    uint64_t reads;                     // pak_read_entry/pak_read_node calls
+    uint64_t bytes_read;                // from the archive file
+    uint64_t bytes_decompressed;
+    uint64_t syscalls;                  // reads and readahead hints issued against the archive file
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t open_ns;
+    uint64_t lookup_ns;
+    uint64_t io_ns;
+    uint64_t decompress_ns;
+} pak_stats_t;
+
+typedef enum { PAK_TRACE_OPEN, PAK_TRACE_FIND, PAK_TRACE_READ, PAK_TRACE_DECOMPRESS } pak_trace_event;
+typedef enum { PAK_TRACE_BEGIN, PAK_TRACE_END } pak_trace_phase;
+
+typedef struct _pak_handle pak_handle_t;
+
+// Classes of reads queued with pak_submit, lower values are served first
+typedef enum { PAK_PRIORITY_URGENT, PAK_PRIORITY_NORMAL, PAK_PRIORITY_BULK, PAK_PRIORITY_COUNT } pak_priority;
+
+// Reads go in pieces of this size, a more urgent request can get in between two of them
+#define PAK_SCHEDULER_CHUNK (256 * 1024)
+// Nanoseconds before its deadline a request is served ahead of every queue
+#define PAK_SCHEDULER_DEADLINE_SLACK (2 * 1000 * 1000)
+#define PAK_SCHEDULER_HISTOGRAM_BUCKETS 24
+
+// Per class, kept whether or not the library is built with PAK_ENABLE_STATS
+typedef struct _pak_scheduler_stats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    uint64_t cancelled;                 // by pak_cancel
+    uint64_t preempted;                 // pieces after which a more urgent request was waiting
+    uint64_t deadline_misses;           // completed after their deadline
+    uint64_t bytes;
+    uint64_t wait_ns;                   // submit to first piece, summed over completed requests
+    uint64_t latency_ns;                // submit to callback, summed over completed requests
+    uint64_t max_latency_ns;
+    uint64_t histogram[PAK_SCHEDULER_HISTOGRAM_BUCKETS];    // bucket i counts latencies under 2^i us, the last one the rest
+} pak_scheduler_stats_t;
+
+// Archives registered with a pool, see pak_pool_create
+typedef struct _pak_pool pak_pool_t;
+
+typedef struct _pak_pool_stats {
+    uint64_t archives;                  // registered
+    uint64_t open;                      // file open and index loaded, or being loaded
+    uint64_t parked;                    // index loaded, file closed
+    uint64_t index_bytes;               // tables and node trees of the open and parked archives
+    uint64_t hits;                      // acquires of an archive that was open
+    uint64_t unparks;                   // acquires that only reopened the file
+    uint64_t loads;                     // acquires that read the index from the file
+    uint64_t parks;
+    uint64_t unloads;
+} pak_pool_stats_t;
+
+// Runs on a worker thread once a request is done, result is the number of bytes read or -1
+typedef void (*pak_request_callback)(pak_handle_t* handle, uint64_t id, void* buf, int64_t result, void* user_data);
+
+// path is the archive for open, the requested path for find and the file name for read, NULL for decompress.
+// bytes is only set at the end of read and decompress
+typedef void (*pak_trace_callback)(pak_handle_t* handle, pak_trace_event event, pak_trace_phase phase,
+                                   const char* path, uint64_t bytes, void* user_data);
+
+typedef struct _pak_cache_slot {
+    uint64_t key;
+    uint64_t last_use;
+    void* data;
+    uint64_t size;
+} pak_cache_slot_t;
+
+typedef struct _pak_cache {
+    pak_cache_slot_t slots[PAK_CACHE_SLOTS];
+    uint64_t tick;
+    pthread_mutex_t lock;
+} pak_cache_t;
+
+typedef struct _pak_prefetch {
+    pak_handle_t* handle;
+    pthread_t thread;
+    uint64_t* indices;                  // entries to warm up, in the order they were asked for
+    uint64_t count;
+    int flags;
+    int cancel;
+} pak_prefetch_t;
+
+// Column view of the entry table for scans over every entry, index i describes entry i.
+// Arrays are 32 byte aligned.
+typedef struct _pak_columns {
+    uint16_t* flags;
+    uint64_t* sizes;                    // decoded size, 0 for directories
+    uint64_t* offsets;                  // start of the stored data relative to data_offset, the block's for solid entries
+    uint16_t* shards;
+    uint32_t* name_hashes;              // pak_hash_name of the entry's own name
+} pak_columns_t;
+
+// Entries match if (flags & flags_mask) == flags_value and min_size <= size <= max_size,
+// PAK_QUERY_INIT matches every entry
+typedef struct _pak_query {
+    uint16_t flags_mask;
+    uint16_t flags_value;
+    uint64_t min_size;
+    uint64_t max_size;
+} pak_query_t;
+
+#define PAK_QUERY_INIT { 0, 0, 0, UINT64_MAX }
+
+struct _pak_handle {
     FILE* file;
     const char* filename;
     pak_header_t* header;
     void* entry_table_data;
     void* string_table_data;
+    pak_block_t* block_table_data;
+    void* dictionary_data;
+    pak_checkpoint_t* checkpoint_table_data;
+    uint64_t* hash_table_data;          // NULL for paks from before 0.8
+    uint64_t* subtree_end;              // per entry, the index right after its last descendant
     // set internally
     const bool    is_readonly;
 
     pak_node_t* root;
-} pak_handle_t;
+    bool nodes_built;                   // pooled handles build the node tree on their first node lookup
+    pthread_mutex_t nodes_lock;
+    FILE* access_log;                   // if set, every path opened with pak_open_file is appended to it
+    pak_cache_t cache;                  // decoded solid blocks and compressed entries
+    pak_prefetch_t* prefetch;           // running background warm up, if any
+    struct _pak_scheduler* scheduler;   // request queues and their workers, see pak_scheduler_start
+    pak_columns_t* columns;             // built on first use, see pak_get_columns
+    pthread_mutex_t columns_lock;
+    int* shard_fds;                     // -1 until the shard is first read from, shard 0 is file
+    pthread_mutex_t shard_lock;
+    bool is_stream;                     // written front to back, the header goes at the end, see pak_write_trailer
+    pak_stats_t stats;
+    pak_trace_callback trace;
+    void* trace_user_data;
+};
+
+typedef struct _pak_dir {
+    pak_handle_t* handle;
+    uint64_t next;
+    uint64_t end;
+    int64_t parent;                     // -1 for the root
+} pak_dir_t;
+
+// name points into the string table and stays valid until the handle is closed
+typedef struct _pak_dirent {
+    uint64_t index;
+    int64_t parent;                     // index of the containing directory, -1 for the root
+    const pak_entry_t* entry;
+    const char* name;
+    bool is_dir;
+} pak_dirent_t;
+
+// Return non zero to stop the walk, pak_walk passes it on
+typedef int (*pak_walk_callback)(pak_handle_t* handle, const char* path, const pak_dirent_t* ent, void* user_data);
 
 typedef struct _pak_file {
     pak_handle_t* handle;
-    pak_node_t* node;
-    int64_t position;
-    const char filepath[FILENAME_MAX];
+    pak_node_t* node;                   // NULL for files opened with pak_open_index
+    pak_entry_t* entry;
+    uint64_t index;
+    int64_t position;                   // in the decoded data
+    const char filepath[FILENAME_MAX];  // empty for files opened with pak_open_index
+    void* stream;                       // inflate state of compressed entries, kept between reads so they can resume
 } pak_file_t;
 
+// Stored bytes of an entry mapped straight from the archive, see pak_map_index
+typedef struct _pak_mapping {
+    const void* data;
+    uint64_t size;
+    void* base;                         // page aligned start of the mapping, for pak_unmap
+    size_t length;
+} pak_mapping_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 pak_handle_t* pak_open_read(const char* filename);
+// Leaves the node tree until the first pak_find_file, pak_find_dir or pak_find. Index lookups and
+// directory iteration never need it, it costs a few KiB per entry.
+pak_handle_t* pak_open_read_lazy(const char* filename);
 
 pak_handle_t*  pak_open_write(const char* filename);
+// Writes to file front to back, which may be a pipe. Nothing is written on close, the caller starts
+// with pak_write_placeholder and ends with pak_write_trailer.
+pak_handle_t*  pak_open_write_stream(FILE* file);
 
 size_t pak_seek(pak_handle_t* handle, uint64_t offset, int whence);
 
@@ -97,8 +325,23 @@ void pak_free_header(pak_header_t* header);
 
 uint32_t pak_get_version(pak_handle_t* handle);
 
+// Byte order the pak is written in, paks for the other order are converted when they're opened
 void pak_set_endian(pak_handle_t* handle, int endian);
 int32_t pak_get_endian(pak_handle_t* handle);
+bool pak_is_native_endian(pak_handle_t* handle);
+
+// In place conversion between the host's byte order and the other one
+void pak_swap_header(pak_header_t* header);
+void pak_swap_entries(pak_entry_t* entries, uint64_t count);
+void pak_swap_blocks(pak_block_t* blocks, uint64_t count);
+void pak_swap_checkpoints(pak_checkpoint_t* checkpoints, uint64_t count);
+void pak_swap_hashes(uint64_t* hashes, uint64_t count);
+
+// Writes the header at the start of the file in the pak's byte order
+bool pak_write_header(pak_handle_t* handle);
+// Write PAK_TRAILER_SIZE bytes at the current position, the placeholder only tells readers to look at the end
+bool pak_write_placeholder(pak_handle_t* handle);
+bool pak_write_trailer(pak_handle_t* handle);
 
 void pak_set_entry_start(pak_handle_t* handle, uint64_t val);
 uint64_t pak_get_entry_start(pak_handle_t* handle);
@@ -115,18 +358,165 @@ uint64_t pak_get_string_table_size(pak_handle_t* header);
 void pak_set_data_offset(pak_handle_t* handle, uint64_t val);
 uint64_t pak_get_data_offset(pak_handle_t* handle);
 
+void pak_set_block_table_offset(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_block_table_offset(pak_handle_t* handle);
+
+void pak_set_block_count(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_block_count(pak_handle_t* handle);
+
+void pak_set_dictionary_offset(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_dictionary_offset(pak_handle_t* handle);
+
+void pak_set_dictionary_size(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_dictionary_size(pak_handle_t* handle);
+
+void pak_set_checkpoint_table_offset(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_checkpoint_table_offset(pak_handle_t* handle);
+
+void pak_set_checkpoint_count(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_checkpoint_count(pak_handle_t* handle);
+
+void pak_set_shard_count(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_shard_count(pak_handle_t* handle);
+
+void pak_set_hash_table_offset(pak_handle_t* handle, uint64_t val);
+uint64_t pak_get_hash_table_offset(pak_handle_t* handle);
+
+// Shard 0 is the pak itself, the others sit next to it as <pak>.001, <pak>.002 and so on.
+// Returns false if the name doesn't fit.
+bool pak_shard_path(const char* filename, uint32_t shard, char* buf, size_t size);
+
 int64_t pak_get_index_from_entry(pak_handle_t* handle, pak_entry_t* entry);
+pak_entry_t* pak_get_entry_from_index(pak_handle_t* handle, uint64_t index);
+const char* pak_get_string_from_index(pak_handle_t* handle, uint64_t index);
+
+// Resolves a path straight from the entry and string tables without allocating, path doesn't need
+// to be NUL terminated. Returns the entry index or -1, the root has no entry and is never found.
+int64_t pak_find_index(pak_handle_t* handle, const char* path);
+int64_t pak_find_index_n(pak_handle_t* handle, const char* path, size_t len);
+
+// Directory iteration, NULL, "" and "/" open the root. pak_dir_t lives wherever the caller puts it.
+bool pak_opendir(pak_handle_t* handle, const char* path, pak_dir_t* dir);
+bool pak_opendir_index(pak_handle_t* handle, uint64_t index, pak_dir_t* dir);
+bool pak_readdir(pak_dir_t* dir, pak_dirent_t* ent);
+
+// Builds the column view the first time it's asked for, NULL if it couldn't be allocated
+const pak_columns_t* pak_get_columns(pak_handle_t* handle);
+uint32_t pak_hash_name(const char* name, size_t len);
+// Content hash kept in the hash table, the same on every host
+uint64_t pak_hash_data(const void* data, size_t len);
+// false if the pak has no hash table or index is a directory
+bool pak_get_entry_hash(pak_handle_t* handle, uint64_t index, uint64_t* hash);
+
+// Returns the number of matching entries and stores the first capacity of their indices, indices may be NULL
+uint64_t pak_query(pak_handle_t* handle, const pak_query_t* query, uint64_t* indices, uint64_t capacity);
+// Sum of the decoded sizes of the matching entries
+uint64_t pak_query_size(pak_handle_t* handle, const pak_query_t* query);
+
+// Depth first walk below root, calling callback for every entry whose full path matches the
+// fnmatch pattern (NULL matches everything, '*' also matches '/'). Returns -1 if root doesn't exist.
+int pak_walk(pak_handle_t* handle, const char* root, const char* pattern, pak_walk_callback callback, void* user_data);
 
 pak_node_t* pak_find_file(pak_handle_t* handle, const char* filepath);
 pak_node_t* pak_find_dir(pak_handle_t* handle, const char* path);
 pak_node_t* pak_find(pak_handle_t* handle, const char* filepath);
 
 pak_file_t* pak_open_file(pak_handle_t*, const char* filepath);
+// Like pak_open_file for an index from pak_find_index, skips the path copy and the node tree
+pak_file_t* pak_open_index(pak_handle_t* handle, uint64_t index);
 void pak_close_file(pak_file_t* handle);
 
+// Maps the data of an entry that's stored as is, directly or in an uncompressed solid block. Returns false
+// for directories and compressed data, which have to be read instead. The mapping outlives the handle.
+bool pak_map_index(pak_handle_t* handle, uint64_t index, pak_mapping_t* mapping);
+void pak_unmap(pak_mapping_t* mapping);
+
 uint32_t pak_file_read_uint(pak_file_t* file);
 
+// Size of the decoded contents of node
+uint64_t pak_get_node_size(pak_node_t* node);
+uint64_t pak_get_entry_size(const pak_entry_t* entry);
+
+// Decodes the whole of node straight into buf, which has to hold at least pak_get_node_size bytes.
+// Returns the number of bytes written or -1 on error.
+int64_t pak_read_entry(pak_handle_t* handle, pak_node_t* node, void* buf, uint64_t buf_size);
+
+// Reads up to size bytes of the decoded contents of node starting at offset,
+// returns the number of bytes read or -1 on error.
+int64_t pak_read_node(pak_handle_t* handle, pak_node_t* node, void* buf, uint64_t offset, uint64_t size);
+int64_t pak_read_index(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size);
+
+// Writes up to size bytes of index's decoded contents from offset to fd, which has to be blocking.
+// Data stored as is stays in the kernel, copy_file_range when fd is a file (sharing extents where the
+// filesystem can) and sendfile for sockets and pipes, compressed data is decoded through a buffer.
+// Returns the number of bytes written or -1 on error, fd's position moves past what was written.
+int64_t pak_copy_index(pak_handle_t* handle, uint64_t index, int fd, uint64_t offset, uint64_t size);
+// Reads up to size bytes of index's data as it's stored, compressed or not, from offset. -1 for directories
+// and solid entries, which have no stored bytes of their own.
+int64_t pak_read_stored(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size);
+int64_t pak_file_read(pak_file_t* file, void* buf, uint64_t size);
+
+// Positions are in decoded bytes, SEEK_END counts from the end like fseek
 size_t pak_file_seek(pak_file_t* file, int64_t offset, int whence);
+int64_t pak_file_tell(pak_file_t* file);
+
+void pak_get_stats(pak_handle_t* handle, pak_stats_t* stats);
+void pak_reset_stats(pak_handle_t* handle);
+
+// The default callback is picked up by handles opened afterwards, it's the only way to see PAK_TRACE_OPEN
+void pak_set_default_trace_callback(pak_trace_callback callback, void* user_data);
+void pak_set_trace_callback(pak_handle_t* handle, pak_trace_callback callback, void* user_data);
+
+// Records every path passed to pak_open_file in load order, suitable for mkpak --order-file.
+// Passing NULL stops recording.
+bool pak_set_access_log(pak_handle_t* handle, const char* filename);
+
+// Warms up the given files on a background thread: the kernel is asked to read their data in,
+// and with PAK_PREFETCH_DECODE the first few compressed ones are decoded into the cache.
+// Missing paths are skipped. Starting a prefetch cancels the one still running on the handle.
+bool pak_prefetch(pak_handle_t* handle, const char** paths, size_t count, int flags);
+// Same as pak_prefetch for every file below path
+bool pak_prefetch_subtree(pak_handle_t* handle, const char* path, int flags);
+bool pak_prefetch_indices(pak_handle_t* handle, const uint64_t* indices, size_t count, int flags);
+// Blocks until the running prefetch is done
+void pak_prefetch_wait(pak_handle_t* handle);
+void pak_prefetch_cancel(pak_handle_t* handle);
+
+// Starts threads workers serving requests from pak_submit. Requests close to their deadline go first,
+// then the most urgent class with anything queued, in file order. Reads other than urgent ones wait
+// while max_inflight bytes are being read, 0 means no limit.
+bool pak_scheduler_start(pak_handle_t* handle, int threads, uint64_t max_inflight);
+// Lets the pieces being read finish, requests still queued get a result of -1. pak_close calls it.
+// Neither may be called from a request callback, which runs on a worker stop has to join.
+void pak_scheduler_stop(pak_handle_t* handle);
+// Queues a read of up to size bytes of index's decoded contents from offset, like pak_read_index.
+// deadline is a CLOCK_MONOTONIC time in ns, 0 for none. Returns the request's id, 0 if it can't be queued.
+uint64_t pak_submit(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size,
+                    pak_priority priority, uint64_t deadline, pak_request_callback callback, void* user_data);
+// Takes a request out of its queue without calling its callback, false once it's being read
+bool pak_cancel(pak_handle_t* handle, uint64_t id);
+void pak_get_scheduler_stats(pak_handle_t* handle, pak_priority priority, pak_scheduler_stats_t* stats);
+void pak_reset_scheduler_stats(pak_handle_t* handle);
+
+// Keeps at most max_open archives with their file open and up to max_index_bytes of loaded indices,
+// 0 for no limit. Idle archives past the first limit are parked: their index stays, the file is closed
+// and their scheduler and prefetch are stopped. Past the second one they're unloaded, least recently
+// released first. Archives in use, or whose scheduler still has requests queued or being read, aren't
+// picked. Parking and unloading happen outside the pool's lock, so callbacks may use the pool.
+pak_pool_t* pak_pool_create(uint64_t max_open, uint64_t max_index_bytes);
+// Every archive has to be released first
+void pak_pool_destroy(pak_pool_t* pool);
+// Registers filename without loading it, returns its id or -1 if it doesn't exist
+int64_t pak_pool_add(pak_pool_t* pool, const char* filename);
+// false while the archive is acquired
+bool pak_pool_remove(pak_pool_t* pool, uint64_t id);
+// The handle stays usable until the matching pak_pool_release, NULL if the archive can't be opened.
+// A parked archive whose file changed since is loaded again. Once parked or unloaded an archive comes
+// back without a scheduler, call pak_scheduler_start again if it's needed. Pooled handles build their
+// node tree on the first pak_find_file, pak_find_dir or pak_find, index lookups never need it.
+pak_handle_t* pak_pool_acquire(pak_pool_t* pool, uint64_t id);
+void pak_pool_release(pak_pool_t* pool, uint64_t id);
+void pak_pool_get_stats(pak_pool_t* pool, pak_pool_stats_t* stats);
 
 pak_entry_t* pak_create_entry();
 void pak_free_entry(pak_entry_t* entry);
@@ -0,0 +1,409 @@
+#ifndef PAK_HPP
+#define PAK_HPP
+
+// C++ layer over pak.h, nothing in here allocates apart from opening archives and files and
+// reading whole entries with co_await Archive::read.
+// Lookups go through pak_find_index_n and directories through pak_readdir, neither of
+// which copies names, so paths can be string_views into anything.
+
+#include "pak.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string_view>
+#include <utility>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define PAK_HPP_HAS_SPAN 1
+#endif
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define PAK_HPP_HAS_COROUTINES 1
+#endif
+
+namespace pak {
+
+class Archive;
+
+#ifdef PAK_HPP_HAS_COROUTINES
+// Where a coroutine waiting on a read carries on. post is called on a scheduler worker and should only
+// hand the coroutine over, an empty Executor resumes it right there.
+struct Executor {
+    void (*post)(void* context, std::coroutine_handle<> coroutine) = nullptr;
+    void* context = nullptr;
+
+    void resume(std::coroutine_handle<> coroutine) const {
+        if (post)
+            post(context, coroutine);
+        else
+            coroutine.resume();
+    }
+};
+
+// Wraps anything with a post(std::coroutine_handle<>) member, target has to outlive the reads
+template <typename T>
+Executor make_executor(T& target) noexcept {
+    return {[](void* context, std::coroutine_handle<> coroutine) { static_cast<T*>(context)->post(coroutine); },
+            &target};
+}
+
+// See pak_submit
+struct ReadOptions {
+    pak_priority priority = PAK_PRIORITY_NORMAL;
+    uint64_t deadline = 0;
+    Executor executor;
+};
+
+// co_await yields the number of bytes read or -1, like pak_read_index. The read goes through the
+// handle's scheduler (see Archive::start_scheduler), without one it's done in place before resuming.
+class ReadAwaitable {
+public:
+    ReadAwaitable() noexcept = default;
+    ReadAwaitable(pak_handle_t* handle, uint64_t index, void* buf, uint64_t offset, uint64_t size,
+                  const ReadOptions& options) noexcept
+        : handle_(handle), index_(index), buf_(buf), offset_(offset), size_(size), options_(options) {}
+
+    bool await_ready() const noexcept { return handle_ == nullptr; }
+    bool await_suspend(std::coroutine_handle<> coroutine) noexcept {
+        coroutine_ = coroutine;
+        // once queued the callback may already have resumed the coroutine, this is gone
+        if (pak_submit(handle_, index_, buf_, offset_, size_, options_.priority, options_.deadline, complete, this))
+            return true;
+        result_ = pak_read_index(handle_, index_, buf_, offset_, size_);
+        return false;
+    }
+    int64_t await_resume() const noexcept { return result_; }
+
+private:
+    static void complete(pak_handle_t*, uint64_t, void*, int64_t result, void* user_data) {
+        ReadAwaitable* self = static_cast<ReadAwaitable*>(user_data);
+        Executor executor = self->options_.executor;
+        std::coroutine_handle<> coroutine = self->coroutine_;
+        self->result_ = result;
+        executor.resume(coroutine);
+    }
+
+    pak_handle_t* handle_ = nullptr;
+    uint64_t index_ = 0;
+    void* buf_ = nullptr;
+    uint64_t offset_ = 0;
+    uint64_t size_ = 0;
+    ReadOptions options_;
+    std::coroutine_handle<> coroutine_;
+    int64_t result_ = -1;
+};
+#endif
+
+// Cheap to copy view of one entry, valid until its archive is closed
+class Entry {
+public:
+    Entry() noexcept = default;
+    Entry(pak_handle_t* handle, uint64_t index) noexcept : handle_(handle), index_(index) {}
+
+    explicit operator bool() const noexcept { return handle_ != nullptr; }
+
+    uint64_t index() const noexcept { return index_; }
+    const pak_entry_t* raw() const noexcept { return pak_get_entry_from_index(handle_, index_); }
+    std::string_view name() const noexcept { return pak_get_string_from_index(handle_, index_); }
+    bool is_dir() const noexcept { return PAK_ENTRY_IS_DIR(raw()); }
+    bool is_compressed() const noexcept { return raw()->flags & PAK_ENTRY_FLAGS_COMPRESSED; }
+    // decoded size, 0 for directories
+    uint64_t size() const noexcept { return pak_get_entry_size(raw()); }
+
+    // Returns the number of bytes read or -1, like pak_read_index
+    int64_t read(void* buf, uint64_t offset, uint64_t size) const noexcept {
+        return pak_read_index(handle_, index_, buf, offset, size);
+    }
+#ifdef PAK_HPP_HAS_SPAN
+    int64_t read(std::span<std::byte> buf, uint64_t offset = 0) const noexcept {
+        return read(buf.data(), offset, buf.size());
+    }
+#endif
+#ifdef PAK_HPP_HAS_COROUTINES
+    // co_await entry.read_at(offset, buf, size)
+    ReadAwaitable read_at(uint64_t offset, void* buf, uint64_t size, const ReadOptions& options = {}) const noexcept {
+        return ReadAwaitable(handle_, index_, buf, offset, size, options);
+    }
+#ifdef PAK_HPP_HAS_SPAN
+    ReadAwaitable read_at(uint64_t offset, std::span<std::byte> buf, const ReadOptions& options = {}) const noexcept {
+        return read_at(offset, buf.data(), buf.size(), options);
+    }
+#endif
+#endif
+    // Writes the contents to a blocking fd, see pak_copy_index
+    int64_t copy_to(int fd, uint64_t offset = 0, uint64_t size = UINT64_MAX) const noexcept {
+        return pak_copy_index(handle_, index_, fd, offset, size);
+    }
+
+    friend bool operator==(const Entry& a, const Entry& b) noexcept {
+        return a.handle_ == b.handle_ && a.index_ == b.index_;
+    }
+    friend bool operator!=(const Entry& a, const Entry& b) noexcept { return !(a == b); }
+
+private:
+    pak_handle_t* handle_ = nullptr;
+    uint64_t index_ = 0;
+};
+
+// Direct children of a directory, for (pak::Entry e : archive.dir("maps")) ...
+class Dir {
+public:
+    class iterator {
+    public:
+        using value_type = Entry;
+        using difference_type = std::ptrdiff_t;
+        using reference = Entry;
+        using pointer = void;
+        using iterator_category = std::input_iterator_tag;
+
+        iterator() noexcept = default;
+        explicit iterator(const pak_dir_t& dir) noexcept : dir_(dir), done_(false) { ++*this; }
+
+        Entry operator*() const noexcept { return Entry(dir_.handle, ent_.index); }
+        iterator& operator++() noexcept {
+            done_ = done_ || !pak_readdir(&dir_, &ent_);
+            return *this;
+        }
+        void operator++(int) noexcept { ++*this; }
+
+        friend bool operator==(const iterator& a, const iterator& b) noexcept {
+            return a.done_ == b.done_ && (a.done_ || a.ent_.index == b.ent_.index);
+        }
+        friend bool operator!=(const iterator& a, const iterator& b) noexcept { return !(a == b); }
+
+    private:
+        pak_dir_t dir_ = {};
+        pak_dirent_t ent_ = {};
+        bool done_ = true;
+    };
+
+    Dir() noexcept = default;
+    explicit Dir(const pak_dir_t& dir) noexcept : dir_(dir), valid_(true) {}
+
+    // false if the path didn't name a directory, iterating it yields nothing
+    explicit operator bool() const noexcept { return valid_; }
+
+    iterator begin() const noexcept { return valid_ ? iterator(dir_) : iterator(); }
+    iterator end() const noexcept { return iterator(); }
+
+private:
+    pak_dir_t dir_ = {};
+    bool valid_ = false;
+};
+
+// Stored bytes of an entry mapped from the archive, see pak_map_index
+class Mapping {
+public:
+    Mapping() noexcept { std::memset(&mapping_, 0, sizeof(mapping_)); }
+    explicit Mapping(const pak_mapping_t& mapping) noexcept : mapping_(mapping) {}
+    ~Mapping() { pak_unmap(&mapping_); }
+
+    Mapping(Mapping&& other) noexcept : Mapping() { std::swap(mapping_, other.mapping_); }
+    Mapping& operator=(Mapping&& other) noexcept {
+        std::swap(mapping_, other.mapping_);
+        return *this;
+    }
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+
+    // false for entries that have to be decoded, read those instead
+    explicit operator bool() const noexcept { return mapping_.data != nullptr; }
+
+    const std::byte* data() const noexcept { return static_cast<const std::byte*>(mapping_.data); }
+    uint64_t size() const noexcept { return mapping_.size; }
+#ifdef PAK_HPP_HAS_SPAN
+    std::span<const std::byte> bytes() const noexcept { return {data(), static_cast<size_t>(size())}; }
+#endif
+
+private:
+    pak_mapping_t mapping_;
+};
+
+// Sequential reader over one entry, compressed entries keep their inflate state between reads
+class File {
+public:
+    File() noexcept = default;
+    explicit File(pak_file_t* file) noexcept : file_(file) {}
+    ~File() {
+        if (file_)
+            pak_close_file(file_);
+    }
+
+    File(File&& other) noexcept : file_(std::exchange(other.file_, nullptr)) {}
+    File& operator=(File&& other) noexcept {
+        std::swap(file_, other.file_);
+        return *this;
+    }
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    explicit operator bool() const noexcept { return file_ != nullptr; }
+    pak_file_t* get() const noexcept { return file_; }
+
+    Entry entry() const noexcept { return Entry(file_->handle, file_->index); }
+    uint64_t size() const noexcept { return pak_get_entry_size(file_->entry); }
+    int64_t tell() const noexcept { return pak_file_tell(file_); }
+    // whence is SEEK_SET, SEEK_CUR or SEEK_END, returns the new position or -1
+    int64_t seek(int64_t offset, int whence = SEEK_SET) noexcept {
+        return static_cast<int64_t>(pak_file_seek(file_, offset, whence));
+    }
+
+    int64_t read(void* buf, uint64_t size) noexcept { return pak_file_read(file_, buf, size); }
+#ifdef PAK_HPP_HAS_SPAN
+    int64_t read(std::span<std::byte> buf) noexcept { return read(buf.data(), buf.size()); }
+#endif
+#ifdef PAK_HPP_HAS_COROUTINES
+    // Awaitable read that leaves the position alone
+    ReadAwaitable read_at(uint64_t offset, void* buf, uint64_t size, const ReadOptions& options = {}) const noexcept {
+        return entry().read_at(offset, buf, size, options);
+    }
+#ifdef PAK_HPP_HAS_SPAN
+    ReadAwaitable read_at(uint64_t offset, std::span<std::byte> buf, const ReadOptions& options = {}) const noexcept {
+        return read_at(offset, buf.data(), buf.size(), options);
+    }
+#endif
+#endif
+
+private:
+    pak_file_t* file_ = nullptr;
+};
+
+#ifdef PAK_HPP_HAS_COROUTINES
+// Decoded contents of a whole entry from co_await Archive::read, false if the read failed
+class Contents {
+public:
+    Contents() noexcept = default;
+    ~Contents() { std::free(data_); }
+
+    Contents(Contents&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+    Contents& operator=(Contents&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    Contents(const Contents&) = delete;
+    Contents& operator=(const Contents&) = delete;
+
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+
+    const std::byte* data() const noexcept { return data_; }
+    uint64_t size() const noexcept { return size_; }
+#ifdef PAK_HPP_HAS_SPAN
+    std::span<const std::byte> bytes() const noexcept { return {data_, static_cast<size_t>(size_)}; }
+#endif
+
+private:
+    friend class ContentsAwaitable;
+
+    explicit Contents(uint64_t size) noexcept
+        : data_(static_cast<std::byte*>(std::malloc(size ? size : 1))), size_(data_ ? size : 0) {}
+
+    std::byte* data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+class ContentsAwaitable {
+public:
+    ContentsAwaitable(const Entry& entry, const ReadOptions& options) noexcept
+        : contents_(entry && !entry.is_dir() ? Contents(entry.size()) : Contents()),
+          read_(contents_ ? entry.read_at(0, contents_.data_, contents_.size_, options) : ReadAwaitable()) {}
+
+    bool await_ready() const noexcept { return read_.await_ready(); }
+    bool await_suspend(std::coroutine_handle<> coroutine) noexcept { return read_.await_suspend(coroutine); }
+    Contents await_resume() noexcept {
+        if (read_.await_resume() != static_cast<int64_t>(contents_.size()))
+            return Contents();
+        return std::move(contents_);
+    }
+
+private:
+    Contents contents_;
+    ReadAwaitable read_;
+};
+#endif
+
+// Owns a handle from pak_open_read, check it with operator bool after opening
+class Archive {
+public:
+    Archive() noexcept = default;
+    explicit Archive(const char* path) noexcept : handle_(pak_open_read(path)) {}
+    explicit Archive(pak_handle_t* handle) noexcept : handle_(handle) {}
+    ~Archive() {
+        if (handle_)
+            pak_close(handle_);
+    }
+
+    Archive(Archive&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Archive& operator=(Archive&& other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    Archive(const Archive&) = delete;
+    Archive& operator=(const Archive&) = delete;
+
+    explicit operator bool() const noexcept { return handle_ != nullptr; }
+    pak_handle_t* get() const noexcept { return handle_; }
+    pak_handle_t* release() noexcept { return std::exchange(handle_, nullptr); }
+
+    uint64_t entry_count() const noexcept { return pak_get_entry_count(handle_); }
+    Entry entry(uint64_t index) const noexcept {
+        return index < entry_count() ? Entry(handle_, index) : Entry();
+    }
+
+    // An empty Entry if nothing matches, the root isn't an entry either
+    Entry find(std::string_view path) const noexcept {
+        int64_t index = pak_find_index_n(handle_, path.data(), path.size());
+        return index < 0 ? Entry() : Entry(handle_, static_cast<uint64_t>(index));
+    }
+
+    Dir root() const noexcept {
+        pak_dir_t dir;
+        return pak_opendir(handle_, nullptr, &dir) ? Dir(dir) : Dir();
+    }
+    Dir dir(const Entry& entry) const noexcept {
+        pak_dir_t dir;
+        return entry && pak_opendir_index(handle_, entry.index(), &dir) ? Dir(dir) : Dir();
+    }
+    Dir dir(std::string_view path) const noexcept {
+        if (path.find_first_not_of('/') == std::string_view::npos)
+            return root();
+        return dir(find(path));
+    }
+
+    File open(const Entry& entry) const noexcept {
+        return entry && !entry.is_dir() ? File(pak_open_index(handle_, entry.index())) : File();
+    }
+    File open(std::string_view path) const noexcept { return open(find(path)); }
+
+    Mapping map(const Entry& entry) const noexcept {
+        pak_mapping_t mapping;
+        return entry && pak_map_index(handle_, entry.index(), &mapping) ? Mapping(mapping) : Mapping();
+    }
+    Mapping map(std::string_view path) const noexcept { return map(find(path)); }
+
+    // Workers for pak_submit and the awaitable reads, see pak_scheduler_start
+    bool start_scheduler(int threads, uint64_t max_inflight = 0) noexcept {
+        return pak_scheduler_start(handle_, threads, max_inflight);
+    }
+#ifdef PAK_HPP_HAS_COROUTINES
+    // co_await archive.read("maps/e1m1.bsp") yields the whole decoded entry
+    ContentsAwaitable read(const Entry& entry, const ReadOptions& options = {}) const noexcept {
+        return ContentsAwaitable(entry, options);
+    }
+    ContentsAwaitable read(std::string_view path, const ReadOptions& options = {}) const noexcept {
+        return read(find(path), options);
+    }
+#endif
+
+private:
+    pak_handle_t* handle_ = nullptr;
+};
+
+} // namespace pak
+
+#endif // PAK_HPP
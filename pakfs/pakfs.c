@@ -0,0 +1,227 @@
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "pak.h"
+
+// Read-only FUSE view of a pak, entries are looked up through the flat index
+// and file handles carry the entry index so reads skip path resolution.
+
+typedef struct _pakfs_options {
+    const char* archive;
+    int show_help;
+} pakfs_options_t;
+
+static pakfs_options_t options;
+static pak_handle_t* pak;
+static struct stat archive_stat;
+
+#define PAKFS_OPTION(t, p) { t, offsetof(pakfs_options_t, p), 1 }
+
+static const struct fuse_opt option_spec[] = {
+    PAKFS_OPTION("--archive=%s", archive),
+    PAKFS_OPTION("-h", show_help),
+    PAKFS_OPTION("--help", show_help),
+    FUSE_OPT_END
+};
+
+static int path_is_root(const char* path) {
+    while (*path == '/')
+        path++;
+    return *path == '\0';
+}
+
+static void fill_stat(struct stat* st, const pak_entry_t* entry) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = archive_stat.st_uid;
+    st->st_gid = archive_stat.st_gid;
+    st->st_atim = archive_stat.st_atim;
+    st->st_mtim = archive_stat.st_mtim;
+    st->st_ctim = archive_stat.st_ctim;
+    if (!entry || PAK_ENTRY_IS_DIR(entry)) {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = pak_get_entry_size(entry);
+        st->st_blocks = (st->st_size + 511) / 512;
+    }
+}
+
+static void* pakfs_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    (void)conn;
+    // the archive never changes under us, let the kernel keep everything it has seen
+    cfg->kernel_cache = 1;
+    cfg->entry_timeout = 3600.0;
+    cfg->attr_timeout = 3600.0;
+    cfg->negative_timeout = 3600.0;
+    return NULL;
+}
+
+static int pakfs_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
+    if (fi) {
+        fill_stat(st, pak_get_entry_from_index(pak, fi->fh));
+        return 0;
+    }
+    if (path_is_root(path)) {
+        fill_stat(st, NULL);
+        return 0;
+    }
+
+    int64_t index = pak_find_index(pak, path);
+    if (index < 0)
+        return -ENOENT;
+    fill_stat(st, pak_get_entry_from_index(pak, index));
+    return 0;
+}
+
+static int pakfs_opendir(const char* path, struct fuse_file_info* fi) {
+    if (path_is_root(path)) {
+        fi->fh = UINT64_MAX;
+        return 0;
+    }
+
+    int64_t index = pak_find_index(pak, path);
+    if (index < 0)
+        return -ENOENT;
+    if (!PAK_ENTRY_IS_DIR(pak_get_entry_from_index(pak, index)))
+        return -ENOTDIR;
+    fi->fh = index;
+    return 0;
+}
+
+static int pakfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+    (void)path;
+    (void)offset;
+    pak_dir_t dir;
+    bool ok;
+    if (fi->fh == UINT64_MAX)
+        ok = pak_opendir(pak, NULL, &dir);
+    else
+        ok = pak_opendir_index(pak, fi->fh, &dir);
+    if (!ok)
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+
+    pak_dirent_t ent;
+    while (pak_readdir(&dir, &ent)) {
+        if (flags & FUSE_READDIR_PLUS) {
+            struct stat st;
+            fill_stat(&st, ent.entry);
+            if (filler(buf, ent.name, &st, 0, FUSE_FILL_DIR_PLUS))
+                break;
+        } else if (filler(buf, ent.name, NULL, 0, 0)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static int pakfs_open(const char* path, struct fuse_file_info* fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    int64_t index = pak_find_index(pak, path);
+    if (index < 0)
+        return -ENOENT;
+    if (PAK_ENTRY_IS_DIR(pak_get_entry_from_index(pak, index)))
+        return -EISDIR;
+
+    fi->fh = index;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int pakfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    (void)path;
+    if (offset < 0)
+        return -EINVAL;
+
+    int64_t ret = pak_read_index(pak, fi->fh, buf, offset, size);
+    if (ret < 0)
+        return -EIO;
+    return ret;
+}
+
+static int pakfs_statfs(const char* path, struct statvfs* st) {
+    (void)path;
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = 4096;
+    st->f_frsize = 4096;
+    st->f_blocks = (archive_stat.st_size + 4095) / 4096;
+    st->f_files = pak_get_entry_count(pak);
+    st->f_namemax = 255;
+    return 0;
+}
+
+static const struct fuse_operations pakfs_ops = {
+    .init = pakfs_init,
+    .getattr = pakfs_getattr,
+    .opendir = pakfs_opendir,
+    .readdir = pakfs_readdir,
+    .open = pakfs_open,
+    .read = pakfs_read,
+    .statfs = pakfs_statfs,
+};
+
+static void print_usage(const char* progname) {
+    printf("usage: %s [options] <archive.pak> <mountpoint>\n\n", progname);
+}
+
+// picks up the first non-option argument as the archive so the usual
+// "pakfs archive.pak /mnt" invocation works
+static int pakfs_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs) {
+    (void)data;
+    (void)outargs;
+    if (key == FUSE_OPT_KEY_NONOPT && !options.archive) {
+        options.archive = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, option_spec, pakfs_opt_proc) == -1)
+        return 1;
+
+    if (options.show_help) {
+        print_usage(argv[0]);
+        fuse_opt_add_arg(&args, "--help");
+        args.argv[0][0] = '\0';
+    } else {
+        if (!options.archive) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (stat(options.archive, &archive_stat) < 0) {
+            perror(options.archive);
+            return 1;
+        }
+
+        pak = pak_open_read(options.archive);
+        if (!pak) {
+            fprintf(stderr, "Failed to open %s\n", options.archive);
+            return 1;
+        }
+        fuse_opt_add_arg(&args, "-oro");
+    }
+
+    int ret = fuse_main(args.argc, args.argv, &pakfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    if (pak)
+        pak_close(pak);
+    return ret;
+}